@@ -0,0 +1,741 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <libxml/tree.h>
+#include <libxml/dict.h>
+#include <libxml/xmlversion.h>
+#include <libxml/HTMLparser.h>
+#include <libxml/HTMLtree.h>
+#include "split.h"
+#include "cache.h"
+#include "io.h"
+#include "trace.h"
+#include "verbose.h"
+
+/* With --cache-dir, parsed documents are kept on disk as snapshots,
+ * so that a run on an input parsed before can skip the parser. A
+ * snapshot is named after the FNV-1a hash of the input and the
+ * libxml2 version, and consists of a header, the node records in
+ * document order, and a pool of NUL-terminated strings. A record is
+ * a run of unsigned LEB128 numbers: the node type, the distance back
+ * to the record of its parent, and the references to its name and
+ * content strings (plus a third one for DTDs). References are pool
+ * offsets plus one, or 0 for NULL. As parents come before their
+ * children, the tree is rebuilt by appending every node to its
+ * parent in one pass over the mmap()ed file. Every distinct string,
+ * whether name, text, or attribute value, is stored only once, which
+ * keeps snapshots of typical documents below the size of the input.
+ *
+ * Snapshots are written to a temporary file that is then renamed,
+ * so a concurrent run never sees half a snapshot. A snapshot's
+ * modification time is updated whenever it is used, and when the
+ * directory grows beyond `cachesize`, the least recently used
+ * snapshots are removed. Problems with the cache are never fatal;
+ * the input is parsed as usual then. */
+
+#define CACHE_MAGIC  "HSPLSNAP"
+#define CACHE_FORMAT 2
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t format;     /*< CACHE_FORMAT */
+    uint32_t xmlversion; /*< libxml2 version the input was parsed with */
+    uint64_t inputhash;
+    uint64_t inputsize;
+    uint32_t num_nodes;  /*< Records, including the document's */
+    uint32_t reserved;
+    uint64_t records_size;
+    uint64_t pool_size;
+};
+
+/**
+ * Slot of the table of strings in the pool.
+ */
+struct PoolSlot {
+    unsigned long long hash;
+    uint32_t ref; /*< Reference to the string; 0 if the slot is free */
+};
+
+struct SnapshotWriter {
+    unsigned char* p_records;
+    size_t records_size;
+    size_t records_capacity;
+    uint32_t num_nodes;
+    char* p_pool;
+    size_t pool_size;
+    size_t pool_capacity;
+    struct PoolSlot* p_slots;  /*< Open-addressing table of the strings stored, by content */
+    size_t slots_capacity;
+    size_t num_strings;
+    const xmlChar** pp_names;  /*< Same for names, by pointer, which saves hashing them */
+    uint32_t* p_name_refs;
+    size_t names_capacity;
+    size_t num_names;
+    bool overflow;             /*< Snapshot too large for 32-bit references */
+};
+
+struct CacheEntry {
+    char name[NAME_MAX + 1];
+    time_t mtime;
+    off_t size;
+};
+
+static htmlDocPtr load_snapshot(const char* path, uint64_t inputhash, uint64_t inputsize);
+static htmlDocPtr build_document(const unsigned char* p_records, uint64_t records_size, uint32_t num_nodes, const char* p_pool, uint64_t pool_size);
+static bool read_number(const unsigned char** pp_pos, const unsigned char* p_end, uint64_t* p_value);
+static bool store_snapshot(struct Splitter* p_splitter, const char* path, htmlDocPtr p_document, uint64_t inputhash, uint64_t inputsize);
+static void add_nodes(struct SnapshotWriter* p_writer, xmlNodePtr p_node, uint32_t parent);
+static uint32_t add_node(struct SnapshotWriter* p_writer, uint32_t parent, int type, const xmlChar* name, const xmlChar* content, const xmlChar* extra);
+static void put_number(struct SnapshotWriter* p_writer, uint64_t value);
+static uint32_t add_string(struct SnapshotWriter* p_writer, const xmlChar* str);
+static uint32_t add_name(struct SnapshotWriter* p_writer, const xmlChar* name);
+static void append_child(xmlNodePtr p_parent, xmlNodePtr p_node);
+static void evict_snapshots(struct Splitter* p_splitter);
+static int compare_entries(const void* p_a, const void* p_b);
+
+/**
+ * Read the input like splitter_read_input(), but take the parsed
+ * document from the cache directory if the same input was parsed
+ * before, and store it there otherwise.
+ */
+void splitter_read_cached_input(struct Splitter* p_splitter)
+{
+    const char* url = strlen(p_splitter->infile) > 0 ? p_splitter->infile : "(stdin)";
+    char path[PATH_MAX];
+    char* p_buffer = NULL;
+    size_t size = 0;
+    uint64_t inputhash = 0;
+    bool usable = true;
+
+    TRACE_BEGIN("read", -1);
+    if (strlen(p_splitter->infile) == 0) {
+        verbprintf("Reading from standard input.\n");
+        p_buffer = splitter_read_stream(stdin, &size);
+    }
+    else {
+        FILE* p_file = fopen(p_splitter->infile, "rb");
+
+        if (!p_file) {
+            int errsav = errno;
+            fprintf(stderr, "Failed to open file '%s': %s\n", p_splitter->infile, strerror(errsav));
+            exit(ERR_IO);
+        }
+
+        verbprintf("Reading file '%s'.\n", p_splitter->infile);
+        p_buffer = splitter_read_stream(p_file, &size);
+        fclose(p_file);
+    }
+    TRACE_END("read", -1);
+
+    inputhash = splitter_hash_bytes(SPLITTER_HASH_INIT, p_buffer, size);
+
+    if (snprintf(path, PATH_MAX, "%s/%016llx-%d.snap", p_splitter->cachedir, (unsigned long long) inputhash, atoi(xmlParserVersion)) >= PATH_MAX) {
+        fprintf(stderr, "Warning: Cache directory path '%s' is too long.\n", p_splitter->cachedir);
+        usable = false;
+    }
+    else if (mkdir(p_splitter->cachedir, 0777) != 0 && errno != EEXIST) {
+        int errsav = errno;
+        fprintf(stderr, "Warning: Failed to create cache directory '%s': %s\n", p_splitter->cachedir, strerror(errsav));
+        usable = false;
+    }
+
+    if (usable) {
+        TRACE_BEGIN("cache-load", -1);
+        p_splitter->p_document = load_snapshot(path, inputhash, size);
+        TRACE_END("cache-load", -1);
+    }
+
+    if (p_splitter->p_document) {
+        verbprintf("Loaded parsed document from cache file '%s'.\n", path);
+        p_splitter->p_document->URL = xmlStrdup(BAD_CAST(url));
+        utime(path, NULL); /* Most recently used */
+    }
+    else {
+        p_splitter->p_document = splitter_parse_buffer(p_splitter, p_buffer, size, url);
+
+        if (usable && p_splitter->p_document) {
+            TRACE_BEGIN("cache-store", -1);
+            if (store_snapshot(p_splitter, path, p_splitter->p_document, inputhash, size))
+                evict_snapshots(p_splitter);
+            TRACE_END("cache-store", -1);
+        }
+    }
+
+    xmlFree(p_buffer);
+}
+
+/* Map the snapshot at `path` and rebuild the document from it.
+ * Returns NULL if there is none, or it does not fit the input. */
+htmlDocPtr load_snapshot(const char* path, uint64_t inputhash, uint64_t inputsize)
+{
+    const struct SnapshotHeader* p_header = NULL;
+    htmlDocPtr p_document = NULL;
+    struct stat info;
+    void* p_map = NULL;
+    uint64_t payload = 0;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(struct SnapshotHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    p_map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p_map == MAP_FAILED)
+        return NULL;
+
+    p_header = (const struct SnapshotHeader*) p_map;
+    payload  = (uint64_t) info.st_size - sizeof(struct SnapshotHeader);
+
+    if (memcmp(p_header->magic, CACHE_MAGIC, 8) != 0 || p_header->format != CACHE_FORMAT
+        || p_header->xmlversion != (uint32_t) atoi(xmlParserVersion)
+        || p_header->inputhash != inputhash || p_header->inputsize != inputsize
+        || p_header->records_size > payload || p_header->pool_size != payload - p_header->records_size) {
+        fprintf(stderr, "Warning: Ignoring cache file '%s', which does not match the input.\n", path);
+    }
+    else if (p_header->num_nodes > p_header->records_size / 4) { /* Each record takes at least 4 bytes */
+        fprintf(stderr, "Warning: Ignoring damaged cache file '%s'.\n", path);
+    }
+    else {
+        const unsigned char* p_records = (const unsigned char*) (p_header + 1);
+
+        p_document = build_document(p_records, p_header->records_size, p_header->num_nodes,
+                                    (const char*) (p_records + p_header->records_size), p_header->pool_size);
+        if (!p_document)
+            fprintf(stderr, "Warning: Ignoring damaged cache file '%s'.\n", path);
+    }
+
+    munmap(p_map, info.st_size);
+    return p_document;
+}
+
+/* String fields of a record; POOL_VALID() must be checked first */
+#define POOL_STRING(offset) ((offset) == 0 ? NULL : BAD_CAST(p_pool + (offset) - 1))
+#define POOL_VALID(offset)  ((offset) <= pool_size)
+
+htmlDocPtr build_document(const unsigned char* p_records, uint64_t records_size, uint32_t num_nodes, const char* p_pool, uint64_t pool_size)
+{
+    const unsigned char* p_pos = p_records;
+    const unsigned char* p_end = p_records + records_size;
+    htmlDocPtr p_document = NULL;
+    xmlNodePtr* pp_nodes = NULL;
+    uint64_t type = 0;
+    uint64_t distance = 0;
+    uint64_t encoding = 0;
+    uint32_t i = 0;
+
+    /* Record 0 is the document itself; the pool must end in a NUL */
+    if (num_nodes == 0 || (pool_size > 0 && p_pool[pool_size - 1] != '\0'))
+        return NULL;
+
+    if (!read_number(&p_pos, p_end, &type) || !read_number(&p_pos, p_end, &distance)
+        || !read_number(&p_pos, p_end, &encoding) || !read_number(&p_pos, p_end, &encoding)
+        || type != XML_HTML_DOCUMENT_NODE || distance != 0 || !POOL_VALID(encoding))
+        return NULL;
+
+    pp_nodes = (xmlNodePtr*) xmlMalloc(num_nodes * sizeof(xmlNodePtr));
+    if (!pp_nodes) {
+        perror("Failed to allocate memory for loading the cache file");
+        exit(ERR_MEM);
+    }
+
+    p_document = htmlNewDocNoDtD(NULL, NULL);
+    if (!p_document) {
+        perror("Failed to allocate memory for loading the cache file");
+        exit(ERR_MEM);
+    }
+
+    /* Names are interned like the parser does it */
+    p_document->dict = xmlDictCreate();
+    if (encoding > 0)
+        p_document->encoding = xmlStrdup(POOL_STRING(encoding));
+
+    pp_nodes[0] = (xmlNodePtr) p_document;
+
+    for(i=1; i < num_nodes; i++) {
+        uint64_t nameref = 0;
+        uint64_t contentref = 0;
+        uint64_t extraref = 0;
+        const xmlChar* name = NULL;
+        const xmlChar* content = NULL;
+        xmlNodePtr p_parent = NULL;
+        xmlNodePtr p_node = NULL;
+
+        pp_nodes[i] = NULL;
+
+        if (!read_number(&p_pos, p_end, &type) || !read_number(&p_pos, p_end, &distance)
+            || !read_number(&p_pos, p_end, &nameref) || !read_number(&p_pos, p_end, &contentref)
+            || (type == XML_DTD_NODE && !read_number(&p_pos, p_end, &extraref)))
+            goto damaged;
+
+        if (distance == 0 || distance > i || !pp_nodes[i - distance]
+            || !POOL_VALID(nameref) || !POOL_VALID(contentref) || !POOL_VALID(extraref))
+            goto damaged;
+
+        p_parent = pp_nodes[i - distance];
+        name     = POOL_STRING(nameref);
+        content  = POOL_STRING(contentref);
+
+        switch (type) {
+        case XML_ELEMENT_NODE:
+            if (!name)
+                goto damaged;
+            p_node = xmlNewDocNode(p_document, NULL, name, NULL);
+            break;
+        case XML_ATTRIBUTE_NODE:
+            if (!name || p_parent->type != XML_ELEMENT_NODE)
+                goto damaged;
+            xmlNewProp(p_parent, name, content);
+            continue; /* Not a child */
+        case XML_TEXT_NODE:
+            p_node = xmlNewDocText(p_document, content);
+            break;
+        case XML_CDATA_SECTION_NODE:
+            p_node = xmlNewCDataBlock(p_document, content, xmlStrlen(content));
+            break;
+        case XML_COMMENT_NODE:
+            p_node = xmlNewDocComment(p_document, content);
+            break;
+        case XML_PI_NODE:
+            if (!name)
+                goto damaged;
+            p_node = xmlNewDocPI(p_document, name, content);
+            break;
+        case XML_ENTITY_REF_NODE:
+            if (!name)
+                goto damaged;
+            p_node = xmlNewReference(p_document, name);
+            break;
+        case XML_DTD_NODE:
+            if (p_parent != (xmlNodePtr) p_document || p_document->intSubset)
+                goto damaged;
+            /* Linked into the document by libxml2 */
+            pp_nodes[i] = (xmlNodePtr) xmlCreateIntSubset(p_document, name, content, POOL_STRING(extraref));
+            continue;
+        default:
+            goto damaged;
+        }
+
+        if (!p_node) {
+            perror("Failed to allocate memory for loading the cache file");
+            exit(ERR_MEM);
+        }
+
+        append_child(p_parent, p_node);
+        pp_nodes[i] = p_node;
+    }
+
+    if (p_pos != p_end)
+        goto damaged;
+
+    xmlFree(pp_nodes);
+    return p_document;
+
+damaged:
+    xmlFree(pp_nodes);
+    xmlFreeDoc(p_document);
+    return NULL;
+}
+
+/* Decode the number at `*pp_pos` and advance past it. Returns
+ * false if it runs past `p_end` or does not fit 64 bits. */
+bool read_number(const unsigned char** pp_pos, const unsigned char* p_end, uint64_t* p_value)
+{
+    const unsigned char* p_pos = *pp_pos;
+    uint64_t value = 0;
+    int shift = 0;
+
+    do {
+        if (p_pos == p_end || shift > 63)
+            return false;
+
+        value |= (uint64_t) (*p_pos & 0x7F) << shift;
+        shift += 7;
+    } while (*p_pos++ & 0x80);
+
+    *pp_pos  = p_pos;
+    *p_value = value;
+    return true;
+}
+
+/* Serialise `p_document` into a new snapshot at `path` */
+bool store_snapshot(struct Splitter* p_splitter, const char* path, htmlDocPtr p_document, uint64_t inputhash, uint64_t inputsize)
+{
+    struct SnapshotWriter writer;
+    struct SnapshotHeader header;
+    char tmppath[PATH_MAX];
+    FILE* p_file = NULL;
+    uint64_t total = 0;
+    bool ok = false;
+
+    memset(&writer, '\0', sizeof(struct SnapshotWriter));
+
+    add_node(&writer, 0, XML_HTML_DOCUMENT_NODE, NULL, p_document->encoding, NULL);
+    add_nodes(&writer, p_document->children, 0);
+
+    total = sizeof(struct SnapshotHeader) + writer.records_size + writer.pool_size;
+
+    if (writer.overflow) {
+        verbprintf("Document too large for the cache.\n");
+    }
+    else if (total > p_splitter->cachesize) {
+        /* It would only evict everything else, itself included */
+        verbprintf("Not caching the parsed document, its snapshot of %lu bytes exceeds the cache size.\n", (unsigned long) total);
+    }
+    else if (snprintf(tmppath, PATH_MAX, "%s.%ld.tmp", path, (long) getpid()) >= PATH_MAX) {
+        fprintf(stderr, "Warning: Cache directory path '%s' is too long.\n", p_splitter->cachedir);
+    }
+    else {
+        memset(&header, '\0', sizeof(struct SnapshotHeader));
+        memcpy(header.magic, CACHE_MAGIC, 8);
+        header.format       = CACHE_FORMAT;
+        header.xmlversion   = (uint32_t) atoi(xmlParserVersion);
+        header.inputhash    = inputhash;
+        header.inputsize    = inputsize;
+        header.num_nodes    = writer.num_nodes;
+        header.records_size = writer.records_size;
+        header.pool_size    = writer.pool_size;
+
+        p_file = fopen(tmppath, "wb");
+        if (p_file) {
+            ok = fwrite(&header, sizeof(struct SnapshotHeader), 1, p_file) == 1
+                && fwrite(writer.p_records, 1, writer.records_size, p_file) == writer.records_size
+                && fwrite(writer.p_pool, 1, writer.pool_size, p_file) == writer.pool_size;
+            ok = fclose(p_file) == 0 && ok;
+        }
+
+        if (ok && rename(tmppath, path) == 0) {
+            verbprintf("Stored parsed document in cache file '%s'.\n", path);
+        }
+        else {
+            int errsav = errno;
+            fprintf(stderr, "Warning: Failed to write cache file '%s': %s\n", path, strerror(errsav));
+            unlink(tmppath);
+            ok = false;
+        }
+    }
+
+    xmlFree(writer.p_records);
+    xmlFree(writer.p_pool);
+    xmlFree(writer.p_slots);
+    xmlFree((void*) writer.pp_names);
+    xmlFree(writer.p_name_refs);
+
+    return ok;
+}
+
+/* Add records for `p_node`, its following siblings, and everything below them */
+void add_nodes(struct SnapshotWriter* p_writer, xmlNodePtr p_node, uint32_t parent)
+{
+    for (; p_node && !p_writer->overflow; p_node = p_node->next) {
+        uint32_t index = 0;
+
+        if (p_node->type == XML_DTD_NODE) {
+            xmlDtdPtr p_dtd = (xmlDtdPtr) p_node;
+
+            add_node(p_writer, parent, XML_DTD_NODE, p_dtd->name, p_dtd->ExternalID, p_dtd->SystemID);
+            continue;
+        }
+        else if (p_node->type == XML_ELEMENT_NODE) {
+            xmlAttrPtr p_attr = NULL;
+
+            index = add_node(p_writer, parent, XML_ELEMENT_NODE, p_node->name, NULL, NULL);
+
+            for (p_attr = p_node->properties; p_attr; p_attr = p_attr->next) {
+                xmlChar* value = p_attr->children ? xmlNodeGetContent((xmlNodePtr) p_attr) : NULL;
+
+                add_node(p_writer, index, XML_ATTRIBUTE_NODE, p_attr->name, value, NULL);
+                xmlFree(value);
+            }
+
+            add_nodes(p_writer, p_node->children, index);
+        }
+        else if (p_node->type == XML_TEXT_NODE || p_node->type == XML_CDATA_SECTION_NODE
+                 || p_node->type == XML_COMMENT_NODE) {
+            add_node(p_writer, parent, p_node->type, NULL, p_node->content, NULL);
+        }
+        else if (p_node->type == XML_PI_NODE || p_node->type == XML_ENTITY_REF_NODE) {
+            add_node(p_writer, parent, p_node->type, p_node->name, p_node->content, NULL);
+        }
+    }
+}
+
+/* Append a record and return its index */
+uint32_t add_node(struct SnapshotWriter* p_writer, uint32_t parent, int type, const xmlChar* name, const xmlChar* content, const xmlChar* extra)
+{
+    uint32_t nameref = 0;
+    uint32_t contentref = 0;
+
+    if (p_writer->num_nodes == UINT32_MAX) {
+        p_writer->overflow = true;
+        return 0;
+    }
+
+    nameref    = type == XML_ELEMENT_NODE || type == XML_ATTRIBUTE_NODE ? add_name(p_writer, name) : add_string(p_writer, name);
+    contentref = add_string(p_writer, content);
+
+    put_number(p_writer, (uint64_t) type);
+    put_number(p_writer, p_writer->num_nodes - parent); /* 0 only for the document */
+    put_number(p_writer, nameref);
+    put_number(p_writer, contentref);
+    if (type == XML_DTD_NODE)
+        put_number(p_writer, add_string(p_writer, extra));
+
+    return p_writer->num_nodes++;
+}
+
+/* Append `value` to the records as unsigned LEB128 */
+void put_number(struct SnapshotWriter* p_writer, uint64_t value)
+{
+    if (p_writer->records_size + 10 > p_writer->records_capacity) {
+        p_writer->records_capacity = p_writer->records_capacity ? p_writer->records_capacity * 2 : 65536;
+        p_writer->p_records = (unsigned char*) xmlRealloc(p_writer->p_records, p_writer->records_capacity);
+        if (!p_writer->p_records) {
+            perror("Failed to allocate memory for the cache file");
+            exit(ERR_MEM);
+        }
+    }
+
+    while (value >= 0x80) {
+        p_writer->p_records[p_writer->records_size++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    p_writer->p_records[p_writer->records_size++] = (unsigned char) value;
+}
+
+/* Store `str` in the pool unless it is there already; returns the
+ * reference to it */
+uint32_t add_string(struct SnapshotWriter* p_writer, const xmlChar* str)
+{
+    unsigned long long hash = 0;
+    size_t len = 0;
+    size_t offset = p_writer->pool_size;
+    size_t i = 0;
+
+    if (!str)
+        return 0;
+
+    if (p_writer->num_strings * 2 >= p_writer->slots_capacity) { /* Grow and rehash */
+        struct PoolSlot* p_old = p_writer->p_slots;
+        size_t old_capacity = p_writer->slots_capacity;
+
+        p_writer->slots_capacity = old_capacity ? old_capacity * 2 : 4096;
+        p_writer->p_slots = (struct PoolSlot*) xmlMalloc(p_writer->slots_capacity * sizeof(struct PoolSlot));
+        if (!p_writer->p_slots) {
+            perror("Failed to allocate memory for the cache file");
+            exit(ERR_MEM);
+        }
+        memset(p_writer->p_slots, '\0', p_writer->slots_capacity * sizeof(struct PoolSlot));
+
+        for(i=0; i < old_capacity; i++) {
+            size_t slot = 0;
+
+            if (!p_old[i].ref)
+                continue;
+
+            slot = p_old[i].hash & (p_writer->slots_capacity - 1);
+            while (p_writer->p_slots[slot].ref)
+                slot = (slot + 1) & (p_writer->slots_capacity - 1);
+
+            p_writer->p_slots[slot] = p_old[i];
+        }
+
+        xmlFree(p_old);
+    }
+
+    len  = xmlStrlen(str) + 1;
+    hash = splitter_hash_bytes(SPLITTER_HASH_INIT, str, len - 1);
+
+    i = hash & (p_writer->slots_capacity - 1);
+    while (p_writer->p_slots[i].ref) {
+        if (p_writer->p_slots[i].hash == hash
+            && memcmp(p_writer->p_pool + p_writer->p_slots[i].ref - 1, str, len) == 0)
+            return p_writer->p_slots[i].ref;
+
+        i = (i + 1) & (p_writer->slots_capacity - 1);
+    }
+
+    if (offset + len >= UINT32_MAX) {
+        p_writer->overflow = true;
+        return 0;
+    }
+
+    if (offset + len > p_writer->pool_capacity) {
+        while (offset + len > p_writer->pool_capacity)
+            p_writer->pool_capacity = p_writer->pool_capacity ? p_writer->pool_capacity * 2 : 65536;
+
+        p_writer->p_pool = (char*) xmlRealloc(p_writer->p_pool, p_writer->pool_capacity);
+        if (!p_writer->p_pool) {
+            perror("Failed to allocate memory for the cache file");
+            exit(ERR_MEM);
+        }
+    }
+
+    memcpy(p_writer->p_pool + offset, str, len);
+    p_writer->pool_size += len;
+
+    p_writer->p_slots[i].hash = hash;
+    p_writer->p_slots[i].ref  = (uint32_t) offset + 1;
+    p_writer->num_strings++;
+
+    return p_writer->p_slots[i].ref;
+}
+
+/* Like add_string(), but looks names up by address first. The
+ * parser interns names, so the same name has the same address. */
+uint32_t add_name(struct SnapshotWriter* p_writer, const xmlChar* name)
+{
+    size_t i = 0;
+
+    if (p_writer->num_names * 2 >= p_writer->names_capacity) { /* Grow and rehash */
+        const xmlChar** pp_old = p_writer->pp_names;
+        uint32_t* p_old_refs = p_writer->p_name_refs;
+        size_t old_capacity = p_writer->names_capacity;
+
+        p_writer->names_capacity = old_capacity ? old_capacity * 2 : 256;
+        p_writer->pp_names       = (const xmlChar**) xmlMalloc(p_writer->names_capacity * sizeof(xmlChar*));
+        p_writer->p_name_refs = (uint32_t*) xmlMalloc(p_writer->names_capacity * sizeof(uint32_t));
+        if (!p_writer->pp_names || !p_writer->p_name_refs) {
+            perror("Failed to allocate memory for the cache file");
+            exit(ERR_MEM);
+        }
+        memset((void*) p_writer->pp_names, '\0', p_writer->names_capacity * sizeof(xmlChar*));
+
+        for(i=0; i < old_capacity; i++) {
+            size_t slot = 0;
+
+            if (!pp_old[i])
+                continue;
+
+            slot = ((uintptr_t) pp_old[i] >> 4) & (p_writer->names_capacity - 1);
+            while (p_writer->pp_names[slot])
+                slot = (slot + 1) & (p_writer->names_capacity - 1);
+
+            p_writer->pp_names[slot]       = pp_old[i];
+            p_writer->p_name_refs[slot] = p_old_refs[i];
+        }
+
+        xmlFree((void*) pp_old);
+        xmlFree(p_old_refs);
+    }
+
+    i = ((uintptr_t) name >> 4) & (p_writer->names_capacity - 1);
+    while (p_writer->pp_names[i]) {
+        if (p_writer->pp_names[i] == name)
+            return p_writer->p_name_refs[i];
+
+        i = (i + 1) & (p_writer->names_capacity - 1);
+    }
+
+    p_writer->pp_names[i]       = name;
+    p_writer->p_name_refs[i] = add_string(p_writer, name);
+    p_writer->num_names++;
+
+    return p_writer->p_name_refs[i];
+}
+
+/* Link `p_node` in as the last child of `p_parent`. Unlike
+ * xmlAddChild(), this never merges adjacent text nodes. */
+void append_child(xmlNodePtr p_parent, xmlNodePtr p_node)
+{
+    p_node->parent = p_parent;
+    p_node->prev   = p_parent->last;
+    p_node->next   = NULL;
+
+    if (p_parent->last)
+        p_parent->last->next = p_node;
+    else
+        p_parent->children = p_node;
+
+    p_parent->last = p_node;
+}
+
+/* Remove the least recently used snapshots until the cache
+ * directory is within its size limit */
+void evict_snapshots(struct Splitter* p_splitter)
+{
+    struct CacheEntry* p_entries = NULL;
+    struct dirent* p_dirent = NULL;
+    DIR* p_dir = opendir(p_splitter->cachedir);
+    size_t num_entries = 0;
+    size_t capacity = 0;
+    size_t i = 0;
+    uint64_t total = 0;
+
+    if (!p_dir)
+        return;
+
+    while ((p_dirent = readdir(p_dir))) {
+        char path[PATH_MAX];
+        struct stat info;
+        size_t len = strlen(p_dirent->d_name);
+
+        if (len < 5 || strcmp(p_dirent->d_name + len - 5, ".snap") != 0)
+            continue;
+
+        if (snprintf(path, PATH_MAX, "%s/%s", p_splitter->cachedir, p_dirent->d_name) >= PATH_MAX
+            || stat(path, &info) != 0)
+            continue;
+
+        if (num_entries == capacity) {
+            capacity  = capacity ? capacity * 2 : 64;
+            p_entries = (struct CacheEntry*) xmlRealloc(p_entries, capacity * sizeof(struct CacheEntry));
+            if (!p_entries) {
+                perror("Failed to allocate memory for the cache directory listing");
+                exit(ERR_MEM);
+            }
+        }
+
+        strcpy(p_entries[num_entries].name, p_dirent->d_name);
+        p_entries[num_entries].mtime = info.st_mtime;
+        p_entries[num_entries].size  = info.st_size;
+        total += info.st_size;
+        num_entries++;
+    }
+    closedir(p_dir);
+
+    if (total > p_splitter->cachesize && num_entries > 0) {
+        qsort(p_entries, num_entries, sizeof(struct CacheEntry), compare_entries);
+
+        for(i=0; i < num_entries && total > p_splitter->cachesize; i++) {
+            char path[PATH_MAX];
+
+            if (snprintf(path, PATH_MAX, "%s/%s", p_splitter->cachedir, p_entries[i].name) >= PATH_MAX)
+                continue;
+            verbprintf("Removing cache file '%s' to keep the cache within %lu bytes.\n", path, (unsigned long) p_splitter->cachesize);
+
+            if (unlink(path) == 0 || errno == ENOENT)
+                total -= p_entries[i].size;
+        }
+    }
+
+    xmlFree(p_entries);
+}
+
+/* Oldest first */
+int compare_entries(const void* p_a, const void* p_b)
+{
+    const struct CacheEntry* p_first  = (const struct CacheEntry*) p_a;
+    const struct CacheEntry* p_second = (const struct CacheEntry*) p_b;
+
+    if (p_first->mtime != p_second->mtime)
+        return p_first->mtime < p_second->mtime ? -1 : 1;
+
+    return strcmp(p_first->name, p_second->name);
+}
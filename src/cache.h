@@ -0,0 +1,6 @@
+#ifndef HTMLSPLIT_CACHE_H
+#define HTMLSPLIT_CACHE_H
+
+void splitter_read_cached_input(struct Splitter* p_splitter); /*< \private */
+
+#endif
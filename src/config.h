@@ -2,5 +2,7 @@
 #define HTMLSPLIT_CONFIG_H
 
 #cmakedefine HTMLSPLIT_VERSION "@HTMLSPLIT_VERSION@"
+#cmakedefine HTMLSPLIT_HAVE_IO_URING
+#cmakedefine HTMLSPLIT_TRACING
 
 #endif
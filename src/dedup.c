@@ -0,0 +1,388 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <libxml/tree.h>
+#include <libxml/HTMLparser.h>
+#include "split.h"
+#include "dedup.h"
+#include "io.h"
+#include "writer.h"
+#include "verbose.h"
+
+/* Parts and assets are looked up by the 64-bit FNV-1a hash of
+ * their serialised content together with its length. Content
+ * with a matching hash is compared byte by byte against the
+ * file it was first written to before it counts as identical. */
+
+struct DedupEntry {
+    unsigned long long hash;
+    size_t size;
+    char* path; /*< File the content was first written to; NULL if the slot is free */
+};
+
+/**
+ * Open-addressing hash table of all parts written so far.
+ */
+struct DedupTable {
+    struct DedupEntry* p_entries;
+    int capacity; /*< Always a power of two */
+    int count;
+    FILE* p_manifest;
+    char manifestpath[PATH_MAX];
+    int num_duplicates;
+    size_t bytes_saved;
+};
+
+static struct DedupTable* get_table(struct Splitter* p_splitter);
+static struct DedupEntry* lookup_entry(struct Splitter* p_splitter, struct DedupTable* p_table, unsigned long long hash, const xmlChar* content, size_t size);
+static bool same_content(struct Splitter* p_splitter, const char* path, const xmlChar* content, size_t size);
+static void grow_table(struct DedupTable* p_table);
+static void externalize_node(struct Splitter* p_splitter, xmlNodePtr p_node, xmlNodePtr p_parent_node);
+static bool is_externalizable(xmlNodePtr p_node);
+static void write_asset(struct Splitter* p_splitter, const xmlChar* content, const char* extension, char* href);
+
+/**
+ * Parse the argument to the --dedup option, which
+ * may be "link" or "manifest". Returns false if the
+ * mode is not understood.
+ */
+bool splitter_parse_dedup(struct Splitter* p_splitter, const char* mode)
+{
+    if (strcmp(mode, "link") == 0)
+        p_splitter->dedupmode = DEDUP_LINK;
+    else if (strcmp(mode, "manifest") == 0)
+        p_splitter->dedupmode = DEDUP_MANIFEST;
+    else
+        return false;
+
+    return true;
+}
+
+/**
+ * Move inline <style> and <script> elements outside the common
+ * parent of the split points (which would otherwise be repeated
+ * in every part) into files in the "assets" subdirectory of the
+ * output directory and reference them from the document instead.
+ * The files are named after the hash of their content, so that
+ * identical blocks share one file.
+ */
+void splitter_externalize_assets(struct Splitter* p_splitter, xmlNodePtr p_parent_node)
+{
+    externalize_node(p_splitter, xmlDocGetRootElement(p_splitter->p_document), p_parent_node);
+}
+
+/**
+ * Replacement for writing a part when deduplication is enabled.
+ * `content` is the serialised part of `size` bytes, which is
+ * hashed; if the same content was already written to another
+ * file, `targetfile` is made a hard link to that file, or only
+ * recorded in the dedup manifest, depending on the `dedupmode`.
+ * The first part with some content is the one copy of it; there
+ * is no separate file named by the hash as for assets, so that
+ * the manifest only refers to parts.
+ */
+void splitter_write_dedup_part(struct Splitter* p_splitter, const char* targetfile, const xmlChar* content, size_t size)
+{
+    struct DedupTable* p_table = get_table(p_splitter);
+    struct DedupEntry* p_entry = NULL;
+    unsigned long long hash = splitter_hash_bytes(SPLITTER_HASH_INIT, content, size);
+
+    p_entry = lookup_entry(p_splitter, p_table, hash, content, size);
+    if (p_entry->path) {
+        size_t outlen = strlen(p_splitter->outdir) + 1; /* Paths in the manifest are relative to the output directory */
+
+        if (p_splitter->dedupmode == DEDUP_LINK) {
+            unlink(targetfile); /* Left over from an earlier run */
+
+            if (link(p_entry->path, targetfile) == 0) {
+                verbprintf("Linking duplicate part '%s' to '%s'.\n", targetfile, p_entry->path);
+                p_table->num_duplicates++;
+                p_table->bytes_saved += size;
+                return;
+            }
+
+            verbprintf("Failed to link '%s' to '%s', writing it out in full.\n", targetfile, p_entry->path);
+        }
+        else {
+            if (!p_table->p_manifest) {
+                if (snprintf(p_table->manifestpath, PATH_MAX, "%s/dedup-manifest.txt", p_splitter->outdir) >= PATH_MAX)
+                    errno = ENAMETOOLONG;
+                else
+                    p_table->p_manifest = fopen(p_table->manifestpath, "w");
+
+                if (!p_table->p_manifest) {
+                    int errsav = errno;
+                    fprintf(stderr, "Failed to open file '%s': %s\n", p_table->manifestpath, strerror(errsav));
+                    exit(ERR_IO);
+                }
+            }
+
+            verbprintf("Recording duplicate part '%s' of '%s' in manifest.\n", targetfile, p_entry->path);
+            fprintf(p_table->p_manifest, "%s %s\n", targetfile + outlen, p_entry->path + outlen);
+            p_table->num_duplicates++;
+            p_table->bytes_saved += size;
+            return;
+        }
+    }
+    else {
+        p_entry->hash = hash;
+        p_entry->size = size;
+        p_entry->path = (char*) xmlStrdup(BAD_CAST(targetfile));
+
+        if (++p_table->count * 2 > p_table->capacity)
+            grow_table(p_table);
+    }
+
+    verbprintf("Writing file '%s'\n", targetfile);
+    splitter_write_file(p_splitter, targetfile, content, size);
+}
+
+/**
+ * Free the deduplication data and report the savings.
+ */
+void splitter_free_dedup(struct Splitter* p_splitter)
+{
+    struct DedupTable* p_table = p_splitter->p_deduptable;
+    int i = 0;
+
+    if (!p_table)
+        return;
+
+    verbprintf("Deduplicated %d parts, saving %lu bytes.\n", p_table->num_duplicates, (unsigned long) p_table->bytes_saved);
+
+    for(i=0; i < p_table->capacity; i++)
+        xmlFree(p_table->p_entries[i].path);
+
+    if (p_table->p_manifest)
+        splitter_close_file(p_splitter, p_table->p_manifest, p_table->manifestpath);
+
+    xmlFree(p_table->p_entries);
+    xmlFree(p_table);
+    p_splitter->p_deduptable = NULL;
+}
+
+struct DedupTable* get_table(struct Splitter* p_splitter)
+{
+    struct DedupTable* p_table = p_splitter->p_deduptable;
+
+    if (p_table)
+        return p_table;
+
+    p_table = (struct DedupTable*) xmlMalloc(sizeof(struct DedupTable));
+    if (!p_table) {
+        perror("Failed to allocate deduplication table");
+        exit(ERR_MEM);
+    }
+
+    memset(p_table, '\0', sizeof(struct DedupTable));
+    grow_table(p_table);
+
+    p_splitter->p_deduptable = p_table;
+    return p_table;
+}
+
+/* Returns the entry for the given content, or the free
+ * slot where it should be inserted. If `content` is NULL,
+ * always returns a free slot. */
+struct DedupEntry* lookup_entry(struct Splitter* p_splitter, struct DedupTable* p_table, unsigned long long hash, const xmlChar* content, size_t size)
+{
+    int i = (int) (hash & (p_table->capacity - 1));
+
+    while (p_table->p_entries[i].path) {
+        struct DedupEntry* p_entry = &p_table->p_entries[i];
+
+        if (content && p_entry->hash == hash && p_entry->size == size && same_content(p_splitter, p_entry->path, content, size))
+            break;
+
+        i = (i + 1) & (p_table->capacity - 1);
+    }
+
+    return &p_table->p_entries[i];
+}
+
+/* Whether the file at `path` holds exactly `size` bytes of
+ * `content`. Unreadable files count as different. A file still
+ * being written is compared against the writer's copy of its
+ * content instead, so the writer is not drained. */
+bool same_content(struct Splitter* p_splitter, const char* path, const xmlChar* content, size_t size)
+{
+    char buf[65536];
+    size_t done = 0;
+    size_t got = 0;
+    FILE* p_file = NULL;
+    const xmlChar* pending = NULL;
+    size_t pending_size = 0;
+
+    pending = splitter_pending_content(p_splitter, path, &pending_size);
+    if (pending) {
+        if (pending_size == size && memcmp(pending, content, size) == 0)
+            return true;
+
+        verbprintf("Hash collision between '%s' and the current content.\n", path);
+        return false;
+    }
+
+    p_file = fopen(path, "rb");
+    if (!p_file)
+        return false;
+
+    while (done < size && (got = fread(buf, 1, sizeof(buf), p_file)) > 0) {
+        if (got > size - done || memcmp(buf, content + done, got) != 0)
+            break;
+
+        done += got;
+    }
+
+    /* Also make sure the file does not go on */
+    if (done == size && fread(buf, 1, 1, p_file) == 0) {
+        fclose(p_file);
+        return true;
+    }
+
+    verbprintf("Hash collision between '%s' and the current content.\n", path);
+    fclose(p_file);
+    return false;
+}
+
+void grow_table(struct DedupTable* p_table)
+{
+    struct DedupEntry* p_old = p_table->p_entries;
+    int oldcapacity = p_table->capacity;
+    int i = 0;
+
+    p_table->capacity = oldcapacity ? oldcapacity * 2 : 256;
+    p_table->p_entries = (struct DedupEntry*) xmlMalloc(p_table->capacity * sizeof(struct DedupEntry));
+
+    if (!p_table->p_entries) {
+        perror("Failed to allocate memory for deduplication table");
+        exit(ERR_MEM);
+    }
+
+    memset(p_table->p_entries, '\0', p_table->capacity * sizeof(struct DedupEntry));
+
+    for(i=0; i < oldcapacity; i++) {
+        if (p_old[i].path)
+            *lookup_entry(NULL, p_table, p_old[i].hash, NULL, p_old[i].size) = p_old[i];
+    }
+
+    xmlFree(p_old);
+}
+
+void externalize_node(struct Splitter* p_splitter, xmlNodePtr p_node, xmlNodePtr p_parent_node)
+{
+    while (p_node) {
+        xmlNodePtr p_next = p_node->next;
+
+        /* The parts’ content itself is left alone */
+        if (p_node == p_parent_node || p_node->type != XML_ELEMENT_NODE) {
+            p_node = p_next;
+            continue;
+        }
+
+        if (is_externalizable(p_node)) {
+            xmlChar* content = xmlNodeGetContent(p_node);
+            char href[PATH_MAX];
+
+            if (xmlStrcasecmp(p_node->name, BAD_CAST("style")) == 0) {
+                xmlNodePtr p_link = xmlNewDocNode(p_splitter->p_document, NULL, BAD_CAST("link"), NULL);
+                xmlChar* media = xmlGetProp(p_node, BAD_CAST("media"));
+
+                write_asset(p_splitter, content, "css", href);
+
+                xmlNewProp(p_link, BAD_CAST("rel"), BAD_CAST("stylesheet"));
+                xmlNewProp(p_link, BAD_CAST("href"), BAD_CAST(href));
+                if (media) {
+                    xmlNewProp(p_link, BAD_CAST("media"), media);
+                    xmlFree(media);
+                }
+
+                xmlReplaceNode(p_node, p_link);
+                xmlFreeNode(p_node);
+            }
+            else {
+                write_asset(p_splitter, content, "js", href);
+
+                xmlNodeSetContent(p_node, NULL);
+                xmlNewProp(p_node, BAD_CAST("src"), BAD_CAST(href));
+            }
+
+            xmlFree(content);
+        }
+        else {
+            externalize_node(p_splitter, p_node->children, p_parent_node);
+        }
+
+        p_node = p_next;
+    }
+}
+
+/* Only plain CSS and classic or module JavaScript is moved out.
+ * Scripts with async or defer attributes would change their
+ * behaviour when given a src attribute, as would scripts of
+ * other types (templates, JSON data). */
+bool is_externalizable(xmlNodePtr p_node)
+{
+    xmlChar* type = NULL;
+    bool result = false;
+
+    if (!p_node->children)
+        return false;
+
+    type = xmlGetProp(p_node, BAD_CAST("type"));
+
+    if (xmlStrcasecmp(p_node->name, BAD_CAST("style")) == 0) {
+        result = !type || xmlStrcasecmp(type, BAD_CAST("text/css")) == 0;
+    }
+    else if (xmlStrcasecmp(p_node->name, BAD_CAST("script")) == 0) {
+        result = !xmlHasProp(p_node, BAD_CAST("src"))
+            && !xmlHasProp(p_node, BAD_CAST("async"))
+            && !xmlHasProp(p_node, BAD_CAST("defer"))
+            && (!type
+                || xmlStrcasecmp(type, BAD_CAST("text/javascript")) == 0
+                || xmlStrcasecmp(type, BAD_CAST("application/javascript")) == 0
+                || xmlStrcasecmp(type, BAD_CAST("module")) == 0);
+    }
+
+    xmlFree(type);
+    return result;
+}
+
+/* Write `content` to a file named by its hash below the assets
+ * directory unless it exists already, and put the URL to it
+ * (relative to the output directory) into `href`. */
+void write_asset(struct Splitter* p_splitter, const xmlChar* content, const char* extension, char* href)
+{
+    char path[PATH_MAX];
+    struct stat info;
+    size_t size = xmlStrlen(content);
+
+    sprintf(href, "assets/%016llx.%s", splitter_hash_bytes(SPLITTER_HASH_INIT, content, size), extension);
+
+    if (snprintf(path, PATH_MAX, "%s/%s", p_splitter->outdir, href) >= PATH_MAX) {
+        fprintf(stderr, "Path of asset '%s' is too long.\n", href);
+        exit(ERR_IO);
+    }
+
+    if (stat(path, &info) == 0 && (size_t) info.st_size == size && same_content(p_splitter, path, content, size)) {
+        verbprintf("Asset '%s' exists already.\n", path);
+        return;
+    }
+
+    *strrchr(path, '/') = '\0';
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        int errsav = errno;
+        fprintf(stderr, "Failed to create directory '%s': %s\n", path, strerror(errsav));
+        exit(ERR_IO);
+    }
+    splitter_sync_directory(p_splitter, path);
+    path[strlen(path)] = '/';
+
+    verbprintf("Writing asset '%s'.\n", path);
+    splitter_write_file(p_splitter, path, content, size);
+}
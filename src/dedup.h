@@ -0,0 +1,20 @@
+#ifndef HTMLSPLIT_DEDUP_H
+#define HTMLSPLIT_DEDUP_H
+
+/**
+ * What to do with parts whose content is identical to
+ * a part written before.
+ */
+enum dedupmode {
+    DEDUP_NONE = 0, /*< Write every part in full */
+    DEDUP_LINK,     /*< Hard-link duplicates to the first occurrence */
+    DEDUP_MANIFEST  /*< Only list duplicates in the dedup manifest */
+};
+
+bool splitter_parse_dedup(struct Splitter* p_splitter, const char* mode);
+
+void splitter_externalize_assets(struct Splitter* p_splitter, xmlNodePtr p_parent_node); /*< \private */
+void splitter_write_dedup_part(struct Splitter* p_splitter, const char* targetfile, const xmlChar* content, size_t size); /*< \private */
+void splitter_free_dedup(struct Splitter* p_splitter); /*< \private */
+
+#endif
@@ -0,0 +1,228 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
+#include <libxml/tree.h>
+#include <libxml/xmlmemory.h>
+#include <libxml/HTMLparser.h>
+#include "split.h"
+#include "governor.h"
+
+/* Every block handed out by the hooks below is prefixed with a
+ * header recording its size, so that xmlFree() knows how much
+ * to subtract from the budget. 16 bytes keep the payload aligned
+ * for any type malloc() itself would be aligned for. */
+#define GOV_HEADER_SIZE 16
+
+static size_t s_maxmem           = 0; /* 0 = unlimited */
+static volatile size_t s_memused = 0;
+static volatile size_t s_mempeak = 0;
+static int s_maxtime             = 0; /* 0 = unlimited */
+static struct timespec s_start;
+static enum governor_pressure s_reported = GOV_PRESSURE_NONE;
+
+/* The counters are updated atomically, as libxml2 may allocate
+ * from several parser threads at once (see parse.c). */
+static void account(size_t oldsize, size_t newsize)
+{
+    size_t used = 0;
+    size_t peak = 0;
+
+    if (newsize < oldsize) {
+        __sync_sub_and_fetch(&s_memused, oldsize - newsize);
+        return;
+    }
+
+    used = __sync_add_and_fetch(&s_memused, newsize - oldsize);
+    if (used > s_maxmem) {
+        fprintf(stderr, "Memory budget of %lu bytes exhausted (%lu bytes in use, %lu more requested), aborting.\n",
+                (unsigned long) s_maxmem, (unsigned long) (used - (newsize - oldsize)), (unsigned long) (newsize - oldsize));
+        exit(ERR_MEM);
+    }
+
+    peak = s_mempeak;
+    while (used > peak && !__sync_bool_compare_and_swap(&s_mempeak, peak, used))
+        peak = s_mempeak;
+}
+
+static void* gov_malloc(size_t size)
+{
+    char* ptr = NULL;
+
+    account(0, size);
+
+    ptr = malloc(size + GOV_HEADER_SIZE);
+    if (!ptr) {
+        __sync_sub_and_fetch(&s_memused, size);
+        return NULL;
+    }
+
+    *((size_t*) ptr) = size;
+    return ptr + GOV_HEADER_SIZE;
+}
+
+static void gov_free(void* mem)
+{
+    char* ptr = NULL;
+
+    if (!mem)
+        return;
+
+    ptr = ((char*) mem) - GOV_HEADER_SIZE;
+    __sync_sub_and_fetch(&s_memused, *((size_t*) ptr));
+    free(ptr);
+}
+
+static void* gov_realloc(void* mem, size_t size)
+{
+    char* ptr = NULL;
+    size_t oldsize = 0;
+
+    if (!mem)
+        return gov_malloc(size);
+
+    ptr     = ((char*) mem) - GOV_HEADER_SIZE;
+    oldsize = *((size_t*) ptr);
+
+    account(oldsize, size);
+
+    ptr = realloc(ptr, size + GOV_HEADER_SIZE);
+    if (!ptr) {
+        account(size, oldsize);
+        return NULL;
+    }
+
+    *((size_t*) ptr) = size;
+    return ptr + GOV_HEADER_SIZE;
+}
+
+static char* gov_strdup(const char* str)
+{
+    size_t len = strlen(str) + 1;
+    char* copy = gov_malloc(len);
+
+    if (copy)
+        memcpy(copy, str, len);
+
+    return copy;
+}
+
+/**
+ * Set up the resource budgets. `maxmem` is the heap budget
+ * in bytes, `maxtime` the wall-clock budget in seconds;
+ * pass 0 for either to leave it unlimited.
+ *
+ * If a memory budget is requested, this installs accounting
+ * hooks into libxml2 via xmlMemSetup(), which means that it
+ * must be called before xmlInitParser() and before anything
+ * else allocates through libxml2. The splitter’s own
+ * bookkeeping allocates through xmlMalloc() as well so that
+ * it is covered by the same budget.
+ */
+void governor_init(size_t maxmem, int maxtime)
+{
+    clock_gettime(CLOCK_MONOTONIC, &s_start);
+    s_maxtime = maxtime;
+
+    if (maxmem > 0) {
+        s_maxmem = maxmem;
+        xmlMemSetup(gov_free, gov_malloc, gov_realloc, gov_strdup);
+    }
+}
+
+/**
+ * Parse a size specification like "512M" into a number
+ * of bytes. The suffixes K, M, and G (powers of 1024)
+ * are understood. Returns 0 if `str` is not a valid size.
+ */
+size_t governor_parse_size(const char* str)
+{
+    char* p_end = NULL;
+    unsigned long value = strtoul(str, &p_end, 10);
+
+    if (p_end == str)
+        return 0;
+
+    switch (*p_end) {
+    case 'G': case 'g':
+        value *= 1024;
+        /* Fall through */
+    case 'M': case 'm':
+        value *= 1024;
+        /* Fall through */
+    case 'K': case 'k':
+        value *= 1024;
+        p_end++;
+        break;
+    }
+
+    if (*p_end != '\0')
+        return 0;
+
+    return (size_t) value;
+}
+
+/**
+ * Check how close the process is to its memory budget.
+ * When a new pressure level is reached for the first time,
+ * a warning is printed so the user knows why output is
+ * degraded. The level never drops again once reached, so
+ * that all parts written afterwards are degraded alike.
+ */
+enum governor_pressure governor_pressure()
+{
+    enum governor_pressure pressure = GOV_PRESSURE_NONE;
+
+    if (s_maxmem == 0)
+        return GOV_PRESSURE_NONE;
+
+    if (s_memused >= s_maxmem / 10 * 9)
+        pressure = GOV_PRESSURE_CRITICAL;
+    else if (s_memused >= s_maxmem / 4 * 3)
+        pressure = GOV_PRESSURE_HIGH;
+
+    if (pressure > s_reported) {
+        if (pressure == GOV_PRESSURE_CRITICAL)
+            fprintf(stderr, "Warning: Memory budget nearly exhausted, skipping optional outputs.\n");
+        else
+            fprintf(stderr, "Warning: Memory budget running low, switching to cheaper strategies.\n");
+
+        s_reported = pressure;
+    }
+
+    return s_reported;
+}
+
+/**
+ * Number of bytes currently allocated through libxml2.
+ * Only tracked if a memory budget was set.
+ */
+size_t governor_mem_used()
+{
+    return s_memused;
+}
+
+/**
+ * Highest value governor_mem_used() has ever had.
+ */
+size_t governor_mem_peak()
+{
+    return s_mempeak;
+}
+
+/**
+ * Returns true if the wall-clock budget passed to
+ * governor_init() has been used up.
+ */
+bool governor_time_exceeded()
+{
+    struct timespec now;
+
+    if (s_maxtime <= 0)
+        return false;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - s_start.tv_sec >= s_maxtime;
+}
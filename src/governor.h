@@ -0,0 +1,23 @@
+#ifndef HTMLSPLIT_GOVERNOR_H
+#define HTMLSPLIT_GOVERNOR_H
+
+/**
+ * Memory pressure levels reported by governor_pressure().
+ * The splitter degrades to cheaper strategies the higher
+ * the pressure gets.
+ */
+enum governor_pressure {
+    GOV_PRESSURE_NONE = 0, /*< Plenty of budget left */
+    GOV_PRESSURE_HIGH,     /*< Above 75% of the budget; drop ToC node copies, flush parts */
+    GOV_PRESSURE_CRITICAL  /*< Above 90% of the budget; skip optional outputs */
+};
+
+void governor_init(size_t maxmem, int maxtime);
+size_t governor_parse_size(const char* str);
+
+enum governor_pressure governor_pressure();
+size_t governor_mem_used();
+size_t governor_mem_peak();
+bool governor_time_exceeded();
+
+#endif
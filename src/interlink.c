@@ -12,6 +12,7 @@
 #include <libxml/HTMLtree.h>
 #include <libxml/xmlerror.h>
 #include "split.h"
+#include "layout.h"
 #include "verbose.h"
 
 /**
@@ -36,14 +37,14 @@ xmlNodePtr splitter_add_interlinks(struct Splitter* p_splitter, xmlNodePtr p_par
 
     interlink_ul = xmlNewChild(interlink_div, NULL, BAD_CAST("ul"), NULL);
 
-    char uri[1024];
+    char uri[PATH_MAX];
 
     if (i > 0) {
         xmlNodePtr li = NULL;
         xmlNodePtr a  = NULL;
 
-        memset(uri, '\0', 1024);
-        sprintf(uri, "%04d.html", i-1);
+        memset(uri, '\0', PATH_MAX);
+        splitter_part_href(p_splitter, i-1, uri);
 
         li = xmlNewChild(interlink_ul, NULL, BAD_CAST("li"), NULL);
         a  = xmlNewChild(li, NULL, BAD_CAST("a"), BAD_CAST("&larr;"));
@@ -54,8 +55,8 @@ xmlNodePtr splitter_add_interlinks(struct Splitter* p_splitter, xmlNodePtr p_par
         xmlNodePtr li = NULL;
         xmlNodePtr a  = NULL;
 
-        memset(uri, '\0', 1024);
-        sprintf(uri, "%04d.html", i+1);
+        memset(uri, '\0', PATH_MAX);
+        splitter_part_href(p_splitter, i+1, uri);
 
         li = xmlNewChild(interlink_ul, NULL, BAD_CAST("li"), NULL);
         a  = xmlNewChild(li, NULL, BAD_CAST("a"), BAD_CAST("&rarr;"));
@@ -10,10 +10,41 @@
 #include <libxml/xpath.h>
 #include <libxml/HTMLparser.h>
 #include <libxml/HTMLtree.h>
+#include <libxml/parserInternals.h>
 #include <libxml/xmlerror.h>
 #include "split.h"
+#include "io.h"
+#include "governor.h"
+#include "dedup.h"
+#include "parse.h"
+#include "writer.h"
+#include "cache.h"
+#include "trace.h"
 #include "verbose.h"
 
+static void minify_document(struct Splitter* p_splitter);
+static void encode_output(struct Splitter* p_splitter);
+static void minify_nodes(struct Splitter* p_splitter, xmlNodePtr p_node, int mode);
+static void minify_element(struct Splitter* p_splitter, xmlNodePtr p_node, int mode);
+static void minify_text(struct Splitter* p_splitter, xmlNodePtr p_node, int mode);
+static void minify_attributes(struct Splitter* p_splitter, xmlNodePtr p_node);
+static bool is_dropped(struct Splitter* p_splitter, xmlNodePtr p_node);
+static bool is_whitespace_text(xmlNodePtr p_node);
+static bool is_block(xmlNodePtr p_node);
+static bool can_omit_end_tag(struct Splitter* p_splitter, xmlNodePtr p_node);
+static bool name_in(const xmlChar* name, const char* const* names);
+static void out_append(struct Splitter* p_splitter, const char* data, size_t len);
+static void out_append_str(struct Splitter* p_splitter, const char* str);
+static void out_append_escaped(struct Splitter* p_splitter, const xmlChar* str, bool attribute);
+static int out_write_callback(void* p_context, const char* data, int len);
+
+/* How whitespace in text is treated by the minifier */
+enum {
+    MINIFY_COLLAPSE = 0, /*< Runs of whitespace become one space */
+    MINIFY_PRESERVE,     /*< <pre> and <textarea>: whitespace is significant */
+    MINIFY_RAW           /*< <script> and <style>: no escaping either */
+};
+
 /**
  * Write out the document in its current state. If `targetfile' is NULL,
  * the document is output to the standard output. If it isn’t, the document
@@ -21,33 +52,571 @@
  */
 void splitter_write_part(struct Splitter* p_splitter, const char* targetfile)
 {
-    if (targetfile) {
+    if (p_splitter->minify) {
+        TRACE_BEGIN("serialize", -1);
+        minify_document(p_splitter);
+        TRACE_END("serialize", -1);
+
+        splitter_write_buffer(p_splitter, targetfile, BAD_CAST(p_splitter->p_outbuf), p_splitter->outbuf_size);
+    }
+    else if (targetfile && p_splitter->dedupmode != DEDUP_NONE) {
+        xmlChar* xmlstr = NULL;
+        int size = 0;
+
+        TRACE_BEGIN("serialize", -1);
+        htmlDocDumpMemory(p_splitter->p_document, &xmlstr, &size);
+        TRACE_END("serialize", -1);
+
+        splitter_write_dedup_part(p_splitter, targetfile, xmlstr, size);
+
+        xmlFree(xmlstr);
+    }
+    else if (targetfile) {
+        xmlChar* xmlstr = NULL;
+        int size = 0;
+
         verbprintf("Writing file '%s'\n", targetfile);
 
-        FILE* p_file = fopen(targetfile, "w");
-        if (p_file) {
-            htmlDocDump(p_file, p_splitter->p_document);
-            fclose(p_file);
-        }
-        else {
-            int errsav = errno;
-            printf("Failed to open file '%s': %s\n", targetfile, strerror(errsav));
-            exit(ERR_IO);
-        }
+        /* Serialised into memory first, so that the "serialize"
+         * and "write-file" trace events measure one thing each */
+        TRACE_BEGIN("serialize", -1);
+        htmlDocDumpMemory(p_splitter->p_document, &xmlstr, &size);
+        TRACE_END("serialize", -1);
+
+        splitter_write_file(p_splitter, targetfile, xmlstr, size);
+
+        xmlFree(xmlstr);
     }
     else { /* Output to stdout */
         xmlChar* xmlstr = NULL;
         int size = 0;
 
         verbprintf("Writing to standard output\n", targetfile);
+
+        TRACE_BEGIN("serialize", -1);
         htmlDocDumpMemory(p_splitter->p_document, &xmlstr, &size);
+        TRACE_END("serialize", -1);
 
+        TRACE_BEGIN("write", -1);
         printf("%s", (char*) xmlstr);
+        TRACE_END("write", -1);
 
         xmlFree(xmlstr);
+
+        /* Don’t let stdio hold on to the part when memory is scarce */
+        if (governor_pressure() >= GOV_PRESSURE_HIGH)
+            fflush(stdout);
     }
 }
 
+/**
+ * Free the output buffer used by the minifier and report
+ * how much it saved.
+ */
+void splitter_free_outbuf(struct Splitter* p_splitter)
+{
+    if (p_splitter->minify)
+        verbprintf("Minified output: %lu bytes written, %lu bytes of whitespace, comments, end tags, and quotes dropped.\n",
+                   (unsigned long) p_splitter->minify_written, (unsigned long) p_splitter->minify_saved);
+
+    xmlFree(p_splitter->p_outbuf);
+    p_splitter->p_outbuf        = NULL;
+    p_splitter->outbuf_size     = 0;
+    p_splitter->outbuf_capacity = 0;
+}
+
+/**
+ * Write an already serialised part to `targetfile` or, if
+ * that is NULL, to the standard output.
+ */
+void splitter_write_buffer(struct Splitter* p_splitter, const char* targetfile, const xmlChar* content, size_t size)
+{
+    if (targetfile && p_splitter->dedupmode != DEDUP_NONE) {
+        splitter_write_dedup_part(p_splitter, targetfile, content, size);
+    }
+    else if (targetfile) {
+        verbprintf("Writing file '%s'\n", targetfile);
+        splitter_write_file(p_splitter, targetfile, content, size);
+    }
+    else {
+        verbprintf("Writing to standard output\n");
+
+        TRACE_BEGIN("write", -1);
+        fwrite(content, 1, size, stdout);
+        TRACE_END("write", -1);
+
+        if (governor_pressure() >= GOV_PRESSURE_HIGH)
+            fflush(stdout);
+    }
+}
+
+/**
+ * Append `len` bytes of `data` to the output buffer.
+ */
+void splitter_out_append(struct Splitter* p_splitter, const char* data, size_t len)
+{
+    out_append(p_splitter, data, len);
+}
+
+/**
+ * Append `str` to the output buffer, escaped for use in
+ * text or, if `attribute` is set, in a quoted attribute value.
+ */
+void splitter_out_append_escaped(struct Splitter* p_splitter, const xmlChar* str, bool attribute)
+{
+    out_append_escaped(p_splitter, str, attribute);
+}
+
+/**
+ * Serialise `p_node` and its following siblings to the end of
+ * the output buffer, minified if that was requested.
+ */
+void splitter_out_append_nodes(struct Splitter* p_splitter, xmlNodePtr p_node)
+{
+    xmlOutputBufferPtr p_output = NULL;
+
+    if (p_splitter->minify) {
+        minify_nodes(p_splitter, p_node, MINIFY_COLLAPSE);
+        return;
+    }
+
+    p_output = xmlOutputBufferCreateIO(out_write_callback, NULL, p_splitter, NULL);
+    if (!p_output) {
+        perror("Failed to allocate output buffer");
+        exit(ERR_MEM);
+    }
+
+    for (; p_node; p_node = p_node->next)
+        htmlNodeDumpFormatOutput(p_output, p_splitter->p_document, p_node, NULL, 1);
+
+    xmlOutputBufferClose(p_output);
+}
+
+/* Serialise the document into the output buffer of `p_splitter`,
+ * leaving out everything that is not needed to reproduce the
+ * same rendering. */
+void minify_document(struct Splitter* p_splitter)
+{
+    xmlNodePtr p_node = NULL;
+
+    p_splitter->outbuf_size = 0;
+
+    for (p_node = p_splitter->p_document->children; p_node; p_node = p_node->next) {
+        if (p_node->type == XML_DTD_NODE) {
+            xmlDtdPtr p_dtd = (xmlDtdPtr) p_node;
+
+            out_append_str(p_splitter, "<!DOCTYPE ");
+            out_append_str(p_splitter, (const char*) p_dtd->name);
+            if (p_dtd->ExternalID) {
+                out_append_str(p_splitter, " PUBLIC \"");
+                out_append_str(p_splitter, (const char*) p_dtd->ExternalID);
+                out_append_str(p_splitter, "\"");
+            }
+            if (p_dtd->SystemID) {
+                out_append_str(p_splitter, p_dtd->ExternalID ? " \"" : " SYSTEM \"");
+                out_append_str(p_splitter, (const char*) p_dtd->SystemID);
+                out_append_str(p_splitter, "\"");
+            }
+            out_append_str(p_splitter, ">");
+        }
+        else {
+            minify_nodes(p_splitter, p_node, MINIFY_COLLAPSE);
+            break; /* minify_nodes() handles the siblings */
+        }
+    }
+
+    encode_output(p_splitter);
+    p_splitter->minify_written += p_splitter->outbuf_size;
+}
+
+/* The minifier produces UTF-8. Convert the output buffer to the
+ * encoding htmlDocDump() would write: the one declared by the
+ * document's <meta> charset, or, without one (or for an unknown
+ * one), ASCII with entities for everything else. Characters the
+ * encoding lacks become character references. */
+void encode_output(struct Splitter* p_splitter)
+{
+    const xmlChar* encoding = htmlGetMetaEncoding(p_splitter->p_document);
+    xmlCharEncodingHandlerPtr p_handler = NULL;
+    xmlOutputBufferPtr p_output = NULL;
+    char* p_utf8 = p_splitter->p_outbuf;
+    size_t size = p_splitter->outbuf_size;
+    size_t i = 0;
+
+    if (encoding && xmlParseCharEncoding((const char*) encoding) == XML_CHAR_ENCODING_UTF8)
+        return;
+
+    /* ASCII reads the same in every encoding */
+    while (i < size && !(p_utf8[i] & 0x80))
+        i++;
+    if (i == size)
+        return;
+
+    if (encoding)
+        p_handler = xmlFindCharEncodingHandler((const char*) encoding);
+    if (!p_handler)
+        p_handler = xmlFindCharEncodingHandler("HTML");
+
+    /* The converted output goes into a new buffer */
+    p_splitter->p_outbuf        = NULL;
+    p_splitter->outbuf_size     = 0;
+    p_splitter->outbuf_capacity = 0;
+
+    p_output = xmlOutputBufferCreateIO(out_write_callback, NULL, p_splitter, p_handler);
+    if (!p_output) {
+        perror("Failed to allocate output buffer");
+        exit(ERR_MEM);
+    }
+
+    xmlOutputBufferWrite(p_output, (int) size, p_utf8);
+    if (xmlOutputBufferClose(p_output) < 0) {
+        fprintf(stderr, "Failed to convert the output to encoding '%s'.\n", encoding ? (const char*) encoding : "HTML");
+        exit(ERR_IO);
+    }
+
+    xmlFree(p_utf8);
+}
+
+void minify_nodes(struct Splitter* p_splitter, xmlNodePtr p_node, int mode)
+{
+    for (; p_node; p_node = p_node->next) {
+        if (mode == MINIFY_COLLAPSE && is_dropped(p_splitter, p_node)) {
+            xmlChar* content = xmlNodeGetContent(p_node);
+            p_splitter->minify_saved += xmlStrlen(content) + (p_node->type == XML_COMMENT_NODE ? 7 : 0);
+            xmlFree(content);
+            continue;
+        }
+
+        switch (p_node->type) {
+        case XML_ELEMENT_NODE:
+            minify_element(p_splitter, p_node, mode);
+            break;
+        case XML_TEXT_NODE:
+            minify_text(p_splitter, p_node, mode);
+            break;
+        case XML_CDATA_SECTION_NODE:
+            out_append_str(p_splitter, (const char*) p_node->content);
+            break;
+        case XML_ENTITY_REF_NODE:
+            out_append_str(p_splitter, "&");
+            out_append_str(p_splitter, (const char*) p_node->name);
+            out_append_str(p_splitter, ";");
+            break;
+        case XML_COMMENT_NODE:
+            out_append_str(p_splitter, "<!--");
+            out_append_str(p_splitter, (const char*) p_node->content);
+            out_append_str(p_splitter, "-->");
+            break;
+        case XML_PI_NODE:
+            out_append_str(p_splitter, "<?");
+            out_append_str(p_splitter, (const char*) p_node->name);
+            if (p_node->content) {
+                out_append_str(p_splitter, " ");
+                out_append_str(p_splitter, (const char*) p_node->content);
+            }
+            out_append_str(p_splitter, ">");
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void minify_element(struct Splitter* p_splitter, xmlNodePtr p_node, int mode)
+{
+    const htmlElemDesc* p_desc = htmlTagLookup(p_node->name);
+    static const char* const preserving[] = {"pre", "textarea", NULL};
+    static const char* const raw[]        = {"script", "style", NULL};
+
+    out_append_str(p_splitter, "<");
+    out_append_str(p_splitter, (const char*) p_node->name);
+    minify_attributes(p_splitter, p_node);
+    out_append_str(p_splitter, ">");
+
+    if (p_desc && p_desc->empty)
+        return;
+
+    if (name_in(p_node->name, raw)) {
+        mode = MINIFY_RAW;
+    }
+    else if (name_in(p_node->name, preserving)) {
+        mode = MINIFY_PRESERVE;
+    }
+
+    minify_nodes(p_splitter, p_node->children, mode);
+
+    if (mode == MINIFY_COLLAPSE && can_omit_end_tag(p_splitter, p_node)) {
+        p_splitter->minify_saved += xmlStrlen(p_node->name) + 3;
+        return;
+    }
+
+    out_append_str(p_splitter, "</");
+    out_append_str(p_splitter, (const char*) p_node->name);
+    out_append_str(p_splitter, ">");
+}
+
+void minify_text(struct Splitter* p_splitter, xmlNodePtr p_node, int mode)
+{
+    const xmlChar* p_char = p_node->content;
+    const xmlChar* p_start = p_char;
+
+    if (mode == MINIFY_RAW) {
+        out_append_str(p_splitter, (const char*) p_node->content);
+        return;
+    }
+    else if (mode == MINIFY_PRESERVE) {
+        out_append_escaped(p_splitter, p_node->content, false);
+        return;
+    }
+
+    /* Escape the text between whitespace runs and replace
+     * each run with a single space. */
+    while (*p_char) {
+        if (IS_BLANK_CH(*p_char)) {
+            const xmlChar* p_end = p_char;
+            xmlChar* chunk = xmlStrndup(p_start, p_char - p_start);
+
+            out_append_escaped(p_splitter, chunk, false);
+            xmlFree(chunk);
+
+            while (IS_BLANK_CH(*p_end))
+                p_end++;
+
+            /* Adjacent text nodes (left over from slicing)
+             * must not add up to several spaces */
+            if (p_splitter->outbuf_size > 0 && p_splitter->p_outbuf[p_splitter->outbuf_size - 1] == ' ') {
+                p_splitter->minify_saved += p_end - p_char;
+            }
+            else {
+                out_append_str(p_splitter, " ");
+                p_splitter->minify_saved += p_end - p_char - 1;
+            }
+
+            p_char = p_start = p_end;
+        }
+        else {
+            p_char++;
+        }
+    }
+
+    out_append_escaped(p_splitter, p_start, false);
+}
+
+/* Attribute values are only quoted if they need to be. */
+void minify_attributes(struct Splitter* p_splitter, xmlNodePtr p_node)
+{
+    xmlAttrPtr p_attr = NULL;
+
+    for (p_attr = p_node->properties; p_attr; p_attr = p_attr->next) {
+        xmlChar* value = NULL;
+
+        out_append_str(p_splitter, " ");
+        out_append_str(p_splitter, (const char*) p_attr->name);
+
+        /* Boolean attributes like <input disabled> need no value */
+        if (!p_attr->children || htmlIsBooleanAttr(p_attr->name))
+            continue;
+
+        value = xmlNodeGetContent((xmlNodePtr) p_attr);
+        out_append_str(p_splitter, "=");
+
+        if (*value && !strpbrk((const char*) value, " \t\n\r\f\"'=<>`")) {
+            out_append_escaped(p_splitter, value, true);
+            p_splitter->minify_saved += 2;
+        }
+        else {
+            out_append_str(p_splitter, "\"");
+            out_append_escaped(p_splitter, value, true);
+            out_append_str(p_splitter, "\"");
+        }
+
+        xmlFree(value);
+    }
+}
+
+/* Comments (except conditional comments) are dropped on request,
+ * and whitespace-only text between block elements always. */
+bool is_dropped(struct Splitter* p_splitter, xmlNodePtr p_node)
+{
+    xmlNodePtr p_prev = p_node->prev;
+    xmlNodePtr p_next = p_node->next;
+
+    if (p_node->type == XML_COMMENT_NODE)
+        return p_splitter->stripcomments && p_node->content[0] != '[';
+
+    if (!is_whitespace_text(p_node))
+        return false;
+
+    while (p_prev && (p_prev->type == XML_COMMENT_NODE || is_whitespace_text(p_prev)))
+        p_prev = p_prev->prev;
+    while (p_next && (p_next->type == XML_COMMENT_NODE || is_whitespace_text(p_next)))
+        p_next = p_next->next;
+
+    return (!p_prev || is_block(p_prev)) && (!p_next || is_block(p_next));
+}
+
+bool is_whitespace_text(xmlNodePtr p_node)
+{
+    const xmlChar* p_char = NULL;
+
+    if (p_node->type != XML_TEXT_NODE)
+        return false;
+
+    for (p_char = p_node->content; *p_char; p_char++) {
+        if (!IS_BLANK_CH(*p_char))
+            return false;
+    }
+
+    return true;
+}
+
+/* Elements around which whitespace does not render */
+bool is_block(xmlNodePtr p_node)
+{
+    static const char* const blocks[] = {
+        "html", "head", "body", "title", "meta", "link", "base", "script", "style",
+        "address", "article", "aside", "blockquote", "details", "dialog", "dd", "div",
+        "dl", "dt", "fieldset", "figcaption", "figure", "footer", "form", "h1", "h2",
+        "h3", "h4", "h5", "h6", "header", "hgroup", "hr", "li", "main", "nav", "ol",
+        "p", "pre", "section", "table", "caption", "colgroup", "col", "thead", "tbody",
+        "tfoot", "tr", "td", "th", "ul", "option", "optgroup", NULL
+    };
+
+    return p_node->type == XML_ELEMENT_NODE && name_in(p_node->name, blocks);
+}
+
+/* Optional end tags as per the HTML specification, section
+ * "Optional tags". `p_next` is what really follows the element
+ * in the output. */
+bool can_omit_end_tag(struct Splitter* p_splitter, xmlNodePtr p_node)
+{
+    static const char* const p_closers[] = {
+        "address", "article", "aside", "blockquote", "details", "div", "dl", "fieldset",
+        "figcaption", "figure", "footer", "form", "h1", "h2", "h3", "h4", "h5", "h6",
+        "header", "hgroup", "hr", "main", "menu", "nav", "ol", "p", "pre", "section",
+        "table", "ul", NULL
+    };
+    static const char* const p_keepers[] = {"a", "audio", "del", "ins", "map", "noscript", "video", NULL};
+    static const char* const li[]       = {"li", NULL};
+    static const char* const dtdd[]     = {"dt", "dd", NULL};
+    static const char* const options[]  = {"option", "optgroup", NULL};
+    static const char* const optgroup[] = {"optgroup", NULL};
+    static const char* const tr[]       = {"tr", NULL};
+    static const char* const cells[]    = {"td", "th", NULL};
+    static const char* const tbodies[]  = {"tbody", "tfoot", NULL};
+    const xmlChar* name = p_node->name;
+    const xmlChar* nextname = NULL;
+    xmlNodePtr p_next = p_node->next;
+
+    while (p_next && is_dropped(p_splitter, p_next))
+        p_next = p_next->next;
+
+    if (p_next && p_next->type != XML_ELEMENT_NODE)
+        return false; /* Followed by text or a comment */
+
+    nextname = p_next ? p_next->name : NULL;
+
+    if (xmlStrEqual(name, BAD_CAST("li")))
+        return !p_next || name_in(nextname, li);
+    if (xmlStrEqual(name, BAD_CAST("dt")))
+        return p_next && name_in(nextname, dtdd);
+    if (xmlStrEqual(name, BAD_CAST("dd")))
+        return !p_next || name_in(nextname, dtdd);
+    if (xmlStrEqual(name, BAD_CAST("p")))
+        return p_next ? name_in(nextname, p_closers) : !(p_node->parent && name_in(p_node->parent->name, p_keepers));
+    if (xmlStrEqual(name, BAD_CAST("option")))
+        return !p_next || name_in(nextname, options);
+    if (xmlStrEqual(name, BAD_CAST("optgroup")))
+        return !p_next || name_in(nextname, optgroup);
+    if (xmlStrEqual(name, BAD_CAST("tr")))
+        return !p_next || name_in(nextname, tr);
+    if (xmlStrEqual(name, BAD_CAST("td")) || xmlStrEqual(name, BAD_CAST("th")))
+        return !p_next || name_in(nextname, cells);
+    if (xmlStrEqual(name, BAD_CAST("thead")))
+        return p_next && name_in(nextname, tbodies);
+    if (xmlStrEqual(name, BAD_CAST("tbody")))
+        return !p_next || name_in(nextname, tbodies);
+    if (xmlStrEqual(name, BAD_CAST("tfoot")))
+        return !p_next;
+    if (xmlStrEqual(name, BAD_CAST("html")) || xmlStrEqual(name, BAD_CAST("body")))
+        return !p_next;
+    if (xmlStrEqual(name, BAD_CAST("head")))
+        return p_next != NULL;
+
+    return false;
+}
+
+bool name_in(const xmlChar* name, const char* const* names)
+{
+    for (; *names; names++) {
+        if (xmlStrcasecmp(name, BAD_CAST(*names)) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+void out_append(struct Splitter* p_splitter, const char* data, size_t len)
+{
+    if (p_splitter->outbuf_size + len > p_splitter->outbuf_capacity) {
+        size_t capacity = p_splitter->outbuf_capacity ? p_splitter->outbuf_capacity : 65536;
+        char* p_buf = NULL;
+
+        while (capacity < p_splitter->outbuf_size + len)
+            capacity *= 2;
+
+        p_buf = (char*) xmlRealloc(p_splitter->p_outbuf, capacity);
+        if (!p_buf) {
+            perror("Failed to allocate output buffer");
+            exit(ERR_MEM);
+        }
+
+        p_splitter->p_outbuf        = p_buf;
+        p_splitter->outbuf_capacity = capacity;
+    }
+
+    memcpy(p_splitter->p_outbuf + p_splitter->outbuf_size, data, len);
+    p_splitter->outbuf_size += len;
+}
+
+void out_append_str(struct Splitter* p_splitter, const char* str)
+{
+    out_append(p_splitter, str, strlen(str));
+}
+
+void out_append_escaped(struct Splitter* p_splitter, const xmlChar* str, bool attribute)
+{
+    const xmlChar* p_start = str;
+    const xmlChar* p_char = str;
+
+    for (; *p_char; p_char++) {
+        const char* entity = NULL;
+
+        if (*p_char == '&')
+            entity = "&amp;";
+        else if (*p_char == '<' && !attribute)
+            entity = "&lt;";
+        else if (*p_char == '>' && !attribute)
+            entity = "&gt;";
+        else if (*p_char == '"' && attribute)
+            entity = "&quot;";
+
+        if (entity) {
+            out_append(p_splitter, (const char*) p_start, p_char - p_start);
+            out_append_str(p_splitter, entity);
+            p_start = p_char + 1;
+        }
+    }
+
+    out_append(p_splitter, (const char*) p_start, p_char - p_start);
+}
+
+int out_write_callback(void* p_context, const char* data, int len)
+{
+    out_append((struct Splitter*) p_context, data, len);
+    return len;
+}
+
 /**
  * Read input from either standard input or a file, depending on
  * the contents of the `infile` attribute of `p_splitter`.
@@ -56,30 +625,119 @@ void splitter_read_input(struct Splitter* p_splitter)
 {
     p_splitter->p_document = NULL;
 
-    if (strlen(p_splitter->infile) == 0) { /* stdin requested */
-        char* p_buffer       = NULL;
-        xmlChar* p_xmlbuffer = NULL;
-        size_t size          = 0;
+    if (strlen(p_splitter->cachedir) > 0) { /* Maybe parsed before */
+        splitter_read_cached_input(p_splitter);
+    }
+    else if (strlen(p_splitter->infile) == 0) { /* stdin requested */
+        char* p_buffer = NULL;
+        size_t size    = 0;
 
         verbprintf("Reading from standard input.\n");
+        TRACE_BEGIN("read", -1);
+        p_buffer = splitter_read_stream(stdin, &size);
+        TRACE_END("read", -1);
+        verbprintf("Read %li bytes from standard input.\n", size);
 
-        while (!feof(stdin)) {
-            p_buffer = realloc(p_buffer, size + 4096);
-            memset(p_buffer + size, '\0', 4096);
+        /* Parse straight from the buffer; a second copy of
+         * the whole input would count against the memory budget. */
+        p_splitter->p_document = splitter_parse_buffer(p_splitter, p_buffer, size, "(stdin)");
 
-            size += fread(p_buffer + size, 1, 4096, stdin);
+        xmlFree(p_buffer);
+    }
+    else if (p_splitter->parsethreads > 1) { /* File requested, parse in parallel */
+        FILE* p_file   = fopen(p_splitter->infile, "rb");
+        char* p_buffer = NULL;
+        size_t size    = 0;
+
+        if (!p_file) {
+            int errsav = errno;
+            fprintf(stderr, "Failed to open file '%s': %s\n", p_splitter->infile, strerror(errsav));
+            exit(ERR_IO);
         }
 
-        verbprintf("Read %li bytes from standard input.\n", size);
+        verbprintf("Reading file '%s'.\n", p_splitter->infile);
+        TRACE_BEGIN("read", -1);
+        p_buffer = splitter_read_stream(p_file, &size);
+        fclose(p_file);
+        TRACE_END("read", -1);
 
-        p_xmlbuffer = xmlCharStrndup(p_buffer, size);
-        p_splitter->p_document = htmlReadDoc(p_xmlbuffer, "(stdin)", "UTF-8", 0);
+        p_splitter->p_document = splitter_parse_buffer(p_splitter, p_buffer, size, p_splitter->infile);
 
-        xmlFree(p_xmlbuffer);
-        free(p_buffer);
+        xmlFree(p_buffer);
     }
     else { /* File requested */
         verbprintf("Reading file '%s'.\n", p_splitter->infile);
+
+        /* Reading and parsing are one step here */
+        TRACE_BEGIN("read+parse", -1);
         p_splitter->p_document = htmlParseFile(p_splitter->infile, "UTF-8");
+        TRACE_END("read+parse", -1);
     }
 }
+
+/**
+ * Parse the `size` bytes at `p_buffer`, in parallel if requested
+ * and possible. `url` names the input in the parser's messages.
+ */
+htmlDocPtr splitter_parse_buffer(struct Splitter* p_splitter, const char* p_buffer, size_t size, const char* url)
+{
+    htmlDocPtr p_document = NULL;
+
+    TRACE_BEGIN("parse", -1);
+    if (p_splitter->parsethreads > 1) {
+        p_document = splitter_parse_parallel(p_splitter, p_buffer, size, url);
+        if (!p_document)
+            verbprintf("Falling back to serial parsing.\n");
+    }
+
+    if (!p_document)
+        p_document = htmlReadMemory(p_buffer, size, url, "UTF-8", 0);
+    TRACE_END("parse", -1);
+
+    return p_document;
+}
+
+/**
+ * Read all of `p_file` into a buffer allocated with xmlMalloc()
+ * and store its length in `p_size`.
+ */
+char* splitter_read_stream(FILE* p_file, size_t* p_size)
+{
+    char* p_buffer  = NULL;
+    size_t capacity = 0;
+
+    *p_size = 0;
+
+    while (!feof(p_file) && !ferror(p_file)) {
+        if (*p_size == capacity) {
+            capacity = capacity ? capacity * 2 : 65536;
+            p_buffer = xmlRealloc(p_buffer, capacity);
+            if (!p_buffer) {
+                perror("Failed to allocate memory for input");
+                exit(ERR_MEM);
+            }
+        }
+
+        *p_size += fread(p_buffer + *p_size, 1, capacity - *p_size, p_file);
+    }
+
+    return p_buffer;
+}
+
+/**
+ * 64-bit FNV-1a hash of the `size` bytes at `p_data`, continuing
+ * from `hash`, which is SPLITTER_HASH_INIT for a new hash. Used
+ * to recognise content seen before, not for security.
+ */
+unsigned long long splitter_hash_bytes(unsigned long long hash, const void* p_data, size_t size)
+{
+    const unsigned char* p_byte = (const unsigned char*) p_data;
+    size_t i = 0;
+
+    for(i=0; i < size; i++) {
+        hash ^= p_byte[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
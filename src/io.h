@@ -1,7 +1,19 @@
 #ifndef HTMLSPLIT_IO_H
 #define HTMLSPLIT_IO_H
 
+/* Start value for splitter_hash_bytes() */
+#define SPLITTER_HASH_INIT 14695981039346656037ULL
+
 void splitter_write_part(struct Splitter* p_splitter, const char* targetfile);
 void splitter_read_input(struct Splitter* p_splitter);
+char* splitter_read_stream(FILE* p_file, size_t* p_size);
+unsigned long long splitter_hash_bytes(unsigned long long hash, const void* p_data, size_t size);
+htmlDocPtr splitter_parse_buffer(struct Splitter* p_splitter, const char* p_buffer, size_t size, const char* url);
+void splitter_free_outbuf(struct Splitter* p_splitter);
+void splitter_write_buffer(struct Splitter* p_splitter, const char* targetfile, const xmlChar* content, size_t size);
+
+void splitter_out_append(struct Splitter* p_splitter, const char* data, size_t len); /*< \private */
+void splitter_out_append_escaped(struct Splitter* p_splitter, const xmlChar* str, bool attribute); /*< \private */
+void splitter_out_append_nodes(struct Splitter* p_splitter, xmlNodePtr p_node); /*< \private */
 
 #endif
@@ -0,0 +1,300 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <libxml/tree.h>
+#include <libxml/HTMLparser.h>
+#include "split.h"
+#include "layout.h"
+#include "writer.h"
+#include "verbose.h"
+
+static int shard_of(struct Splitter* p_splitter, int index);
+static int count_digits(int num, int base);
+static bool is_relative_url(const xmlChar* url);
+static void relocate_attribute(xmlNodePtr p_node, const char* attrname, bool into_shard);
+
+/**
+ * Parse a sharding specification as given on the commandline.
+ * `spec` has the form "range:N" (N consecutive parts per
+ * subdirectory) or "hash:N" (parts spread over N subdirectories).
+ * Returns false if `spec` is not understood.
+ */
+bool splitter_parse_shard(struct Splitter* p_splitter, const char* spec)
+{
+    const char* p_colon = strchr(spec, ':');
+    char* p_end = NULL;
+    long size = 0;
+
+    if (!p_colon)
+        return false;
+
+    if (p_colon - spec == 5 && strncmp(spec, "range", 5) == 0)
+        p_splitter->shardmode = SHARD_RANGE;
+    else if (p_colon - spec == 4 && strncmp(spec, "hash", 4) == 0)
+        p_splitter->shardmode = SHARD_HASH;
+    else
+        return false;
+
+    errno = 0;
+    size  = strtol(p_colon + 1, &p_end, 10);
+    if (errno != 0 || p_end == p_colon + 1 || *p_end != '\0' || size <= 0 || size > INT_MAX)
+        return false;
+
+    p_splitter->shardsize = (int) size;
+    return true;
+}
+
+/**
+ * Prepare the file naming for a document with `total` split
+ * points, i.e. `total` + 1 parts. The part number in the
+ * name pattern is zero-padded to the number of digits of
+ * the highest part number (but at least 4) unless the
+ * pattern specifies a width of its own.
+ */
+void splitter_init_layout(struct Splitter* p_splitter, int total)
+{
+    const char* p_src = p_splitter->namepattern;
+    char* p_dest = p_splitter->namefmt;
+    int conversions = 0;
+    int autowidth = count_digits(total, 10);
+
+    if (autowidth < 4)
+        autowidth = 4;
+
+    memset(p_splitter->namefmt, '\0', sizeof(p_splitter->namefmt));
+
+    while (*p_src) {
+        const char* p_conv = p_src + 1;
+
+        if (*p_src == '/') {
+            fprintf(stderr, "Name pattern '%s' must not contain a slash, use sharding for subdirectories.\n", p_splitter->namepattern);
+            exit(ERR_CLI);
+        }
+        else if (*p_src != '%' || *p_conv == '%') {
+            if (*p_src == '%')
+                *p_dest++ = *p_src++;
+            *p_dest++ = *p_src++;
+            continue;
+        }
+
+        /* Conversion specification; only %d with flags and width is allowed */
+        while (*p_conv == '0' || *p_conv == '-' || *p_conv == ' ')
+            p_conv++;
+        while (isdigit((unsigned char) *p_conv))
+            p_conv++;
+
+        if (*p_conv != 'd' || ++conversions > 1) {
+            fprintf(stderr, "Name pattern '%s' must contain exactly one %%d conversion.\n", p_splitter->namepattern);
+            exit(ERR_CLI);
+        }
+
+        if (p_conv == p_src + 1) /* Plain %d: automatic width */
+            p_dest += sprintf(p_dest, "%%0%dd", autowidth);
+        else {
+            memcpy(p_dest, p_src, p_conv - p_src + 1);
+            p_dest += p_conv - p_src + 1;
+        }
+
+        p_src = p_conv + 1;
+    }
+
+    if (conversions != 1) {
+        fprintf(stderr, "Name pattern '%s' must contain exactly one %%d conversion.\n", p_splitter->namepattern);
+        exit(ERR_CLI);
+    }
+
+    verbprintf("Using file name format '%s'.\n", p_splitter->namefmt);
+
+    /* Shard directories */
+    switch (p_splitter->shardmode) {
+    case SHARD_RANGE:
+        p_splitter->num_shards = total / p_splitter->shardsize + 1;
+        p_splitter->shardwidth = count_digits(p_splitter->num_shards - 1, 10);
+        break;
+    case SHARD_HASH:
+        p_splitter->num_shards = p_splitter->shardsize;
+        p_splitter->shardwidth = count_digits(p_splitter->num_shards - 1, 16);
+        break;
+    default:
+        p_splitter->num_shards = 0;
+        return;
+    }
+
+    if (p_splitter->shardwidth < 2)
+        p_splitter->shardwidth = 2;
+
+    p_splitter->p_shard_made = (bool*) xmlMalloc(p_splitter->num_shards * sizeof(bool));
+    if (!p_splitter->p_shard_made) {
+        perror("Failed to allocate memory for shard directory cache");
+        exit(ERR_MEM);
+    }
+
+    memset(p_splitter->p_shard_made, '\0', p_splitter->num_shards * sizeof(bool));
+    verbprintf("Distributing parts over %d subdirectories.\n", p_splitter->num_shards);
+}
+
+/**
+ * Free the data allocated by splitter_init_layout().
+ */
+void splitter_free_layout(struct Splitter* p_splitter)
+{
+    xmlFree(p_splitter->p_shard_made);
+    p_splitter->p_shard_made = NULL;
+    p_splitter->num_shards   = 0;
+}
+
+/**
+ * Write the path of the part with number `index` relative
+ * to the output directory into `path`, which must be able
+ * to hold PATH_MAX bytes.
+ */
+void splitter_part_path(struct Splitter* p_splitter, int index, char* path)
+{
+    int len = 0;
+
+    switch (p_splitter->shardmode) {
+    case SHARD_RANGE:
+        len = sprintf(path, "%0*d/", p_splitter->shardwidth, shard_of(p_splitter, index));
+        break;
+    case SHARD_HASH:
+        len = sprintf(path, "%0*x/", p_splitter->shardwidth, shard_of(p_splitter, index));
+        break;
+    }
+
+    snprintf(path + len, PATH_MAX - len, p_splitter->namefmt, index);
+}
+
+/**
+ * Like splitter_part_path(), but writes the URL to use for
+ * linking to the part with number `index` from another part.
+ */
+void splitter_part_href(struct Splitter* p_splitter, int index, char* href)
+{
+    if (p_splitter->shardmode == SHARD_NONE) {
+        splitter_part_path(p_splitter, index, href);
+    }
+    else {
+        strcpy(href, "../");
+        splitter_part_path(p_splitter, index, href + 3);
+    }
+}
+
+/**
+ * Ensure the shard directory the part with number `index`
+ * goes into exists below the output directory. Directories
+ * already created in this run are remembered and not
+ * checked again.
+ */
+void splitter_make_part_dir(struct Splitter* p_splitter, int index)
+{
+    char path[PATH_MAX];
+    int shard = 0;
+
+    if (p_splitter->shardmode == SHARD_NONE)
+        return;
+
+    shard = shard_of(p_splitter, index);
+    if (p_splitter->p_shard_made[shard])
+        return;
+
+    memset(path, '\0', PATH_MAX);
+    strcpy(path, p_splitter->outdir);
+    strcat(path, "/");
+    splitter_part_path(p_splitter, index, path + strlen(path));
+    *strrchr(path, '/') = '\0'; /* Strip file name */
+
+    verbprintf("Creating directory '%s'.\n", path);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        int errsav = errno;
+        fprintf(stderr, "Failed to create directory '%s': %s\n", path, strerror(errsav));
+        exit(ERR_IO);
+    }
+
+    splitter_sync_directory(p_splitter, path);
+    p_splitter->p_shard_made[shard] = true;
+}
+
+/**
+ * Parts placed in shard directories are one level deeper than
+ * the input document was, so relative links in them need an
+ * additional "../". This function walks `p_node`, its following
+ * siblings, and all their descendants and adds that prefix to
+ * relative `href` and `src` attributes (`into_shard` = true),
+ * or removes it again (`into_shard` = false).
+ */
+void splitter_relocate_links(struct Splitter* p_splitter, xmlNodePtr p_node, bool into_shard)
+{
+    if (p_splitter->shardmode == SHARD_NONE)
+        return;
+
+    for (; p_node; p_node = p_node->next) {
+        if (p_node->type != XML_ELEMENT_NODE)
+            continue;
+
+        relocate_attribute(p_node, "href", into_shard);
+        relocate_attribute(p_node, "src", into_shard);
+
+        splitter_relocate_links(p_splitter, p_node->children, into_shard);
+    }
+}
+
+void relocate_attribute(xmlNodePtr p_node, const char* attrname, bool into_shard)
+{
+    xmlChar* url = xmlGetProp(p_node, BAD_CAST(attrname));
+
+    if (!url)
+        return;
+
+    if (into_shard && is_relative_url(url)) {
+        xmlChar* newurl = xmlStrncatNew(BAD_CAST("../"), url, -1);
+        xmlSetProp(p_node, BAD_CAST(attrname), newurl);
+        xmlFree(newurl);
+    }
+    else if (!into_shard && xmlStrncmp(url, BAD_CAST("../"), 3) == 0) {
+        xmlSetProp(p_node, BAD_CAST(attrname), url + 3);
+    }
+
+    xmlFree(url);
+}
+
+/* A relative URL is one without scheme that does not start at
+ * the server root and is not a mere fragment or query. */
+bool is_relative_url(const xmlChar* url)
+{
+    const xmlChar* p_char = url;
+
+    if (*url == '\0' || *url == '/' || *url == '#' || *url == '?')
+        return false;
+
+    while (isalnum(*p_char) || *p_char == '+' || *p_char == '-' || *p_char == '.')
+        p_char++;
+
+    return *p_char != ':';
+}
+
+int shard_of(struct Splitter* p_splitter, int index)
+{
+    if (p_splitter->shardmode == SHARD_RANGE)
+        return index / p_splitter->shardsize;
+
+    /* Knuth’s multiplicative hash spreads consecutive parts evenly */
+    return (int) ((index * 2654435761u) % (unsigned int) p_splitter->shardsize);
+}
+
+int count_digits(int num, int base)
+{
+    int digits = 1;
+
+    while (num >= base) {
+        num /= base;
+        digits++;
+    }
+
+    return digits;
+}
@@ -0,0 +1,23 @@
+#ifndef HTMLSPLIT_LAYOUT_H
+#define HTMLSPLIT_LAYOUT_H
+
+/**
+ * How parts are distributed over subdirectories of
+ * the output directory.
+ */
+enum shardmode {
+    SHARD_NONE = 0, /*< All parts directly in the output directory */
+    SHARD_RANGE,    /*< `shardsize` consecutive parts per subdirectory */
+    SHARD_HASH      /*< Parts hashed into `shardsize` subdirectories */
+};
+
+bool splitter_parse_shard(struct Splitter* p_splitter, const char* spec);
+
+void splitter_init_layout(struct Splitter* p_splitter, int total); /*< \private */
+void splitter_free_layout(struct Splitter* p_splitter); /*< \private */
+void splitter_part_path(struct Splitter* p_splitter, int index, char* path); /*< \private */
+void splitter_part_href(struct Splitter* p_splitter, int index, char* href); /*< \private */
+void splitter_make_part_dir(struct Splitter* p_splitter, int index); /*< \private */
+void splitter_relocate_links(struct Splitter* p_splitter, xmlNodePtr p_node, bool into_shard); /*< \private */
+
+#endif
@@ -4,6 +4,7 @@
 #include <locale.h>
 #include <signal.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <limits.h>
 #include <libxml/tree.h>
 #include <libxml/parser.h>
@@ -14,12 +15,90 @@
 #include "split.h"
 #include "verbose.h"
 #include "toc.h"
+#include "governor.h"
+#include "layout.h"
+#include "dedup.h"
+#include "writer.h"
+#include "variant.h"
+#include "template.h"
+#include "trace.h"
+#include "plan.h"
+#include "watch.h"
 
 static struct Splitter* sp_splitter = NULL;
 
+/* Options that only have a long form. Their values start above
+ * the range of characters used by the short options. */
+enum longopt {
+    OPT_MAX_MEMORY = 256,
+    OPT_MAX_TIME,
+    OPT_NAME_PATTERN,
+    OPT_SHARD,
+    OPT_SEARCH_INDEX,
+    OPT_DEDUP,
+    OPT_MINIFY,
+    OPT_STRIP_COMMENTS,
+    OPT_PARSE_THREADS,
+    OPT_ASYNC_WRITE,
+    OPT_DURABILITY,
+    OPT_NODE_TABLE,
+    OPT_TOC_PAGES,
+    OPT_TOC_JSON,
+    OPT_PART_TOC,
+    OPT_VARIANT,
+    OPT_VARIANT_THREADS,
+    OPT_TEMPLATE,
+    OPT_RESOURCE_HINTS,
+    OPT_DEPS_FILE,
+    OPT_TRACE,
+    OPT_PLAN,
+    OPT_WATCH,
+    OPT_CACHE_DIR,
+    OPT_CACHE_SIZE
+};
+
+static struct option s_longopts[] = {
+    {"max-memory",     required_argument, NULL, OPT_MAX_MEMORY},
+    {"max-time",       required_argument, NULL, OPT_MAX_TIME},
+    {"name-pattern",   required_argument, NULL, OPT_NAME_PATTERN},
+    {"shard",          required_argument, NULL, OPT_SHARD},
+    {"search-index",   required_argument, NULL, OPT_SEARCH_INDEX},
+    {"dedup",          required_argument, NULL, OPT_DEDUP},
+    {"minify",         no_argument,       NULL, OPT_MINIFY},
+    {"strip-comments", no_argument,       NULL, OPT_STRIP_COMMENTS},
+    {"parse-threads",  required_argument, NULL, OPT_PARSE_THREADS},
+    {"async-write",    required_argument, NULL, OPT_ASYNC_WRITE},
+    {"durability",     required_argument, NULL, OPT_DURABILITY},
+    {"node-table",     no_argument,       NULL, OPT_NODE_TABLE},
+    {"toc-pages",      required_argument, NULL, OPT_TOC_PAGES},
+    {"toc-json",       no_argument,       NULL, OPT_TOC_JSON},
+    {"part-toc",       no_argument,       NULL, OPT_PART_TOC},
+    {"variant",        required_argument, NULL, OPT_VARIANT},
+    {"variant-threads", required_argument, NULL, OPT_VARIANT_THREADS},
+    {"template",       required_argument, NULL, OPT_TEMPLATE},
+    {"resource-hints", required_argument, NULL, OPT_RESOURCE_HINTS},
+    {"deps-file",      required_argument, NULL, OPT_DEPS_FILE},
+    {"trace",          required_argument, NULL, OPT_TRACE},
+    {"plan",           required_argument, NULL, OPT_PLAN},
+    {"watch",          no_argument,       NULL, OPT_WATCH},
+    {"cache-dir",      required_argument, NULL, OPT_CACHE_DIR},
+    {"cache-size",     required_argument, NULL, OPT_CACHE_SIZE},
+    {NULL, 0, NULL, 0}
+};
+
 static void print_usage(const char* name)
 {
-    fprintf(stderr, "Usage: %s -V | -h | [-v] [l] [-t] [-q] [-x XPATH] [-i FILE] [-o FILE] [-p SECNUM]\n", name);
+    fprintf(stderr, "Usage: %s -V | -h | [-v] [l] [-t] [-q] [-x XPATH] [-i FILE] [-o FILE] [-p SECNUM]\n"
+            "       [--max-memory SIZE] [--max-time SECONDS]\n"
+            "       [--name-pattern PATTERN] [--shard range:N|hash:N]\n"
+            "       [--search-index FILE] [--dedup link|manifest]\n"
+            "       [--minify] [--strip-comments] [--parse-threads N]\n"
+            "       [--async-write DEPTH] [--durability none|fsync|syncfs]\n"
+            "       [--node-table] [--toc-pages chapter|level] [--toc-json] [--part-toc]\n"
+            "       [--variant NAME:SETTINGS]... [--variant-threads N]\n"
+            "       [--template FILE] [--resource-hints N] [--deps-file FILE]\n"
+            "       [--trace FILE] [--plan text|json] [--watch]\n"
+            "       [--cache-dir DIR] [--cache-size SIZE]\n", name);
 }
 
 static void print_copyright()
@@ -40,7 +119,7 @@ static bool parse_argv(int argc, char* argv[], struct Splitter* p_splitter)
     int curopt = 0;
     bool copyright = true;
 
-    while ((curopt = getopt(argc, argv, "Vvhlqi:o:x:s:p:t:T:")) > 0) {
+    while ((curopt = getopt_long(argc, argv, "Vvhlqi:o:x:s:p:t:T:", s_longopts, NULL)) > 0) {
         switch (curopt) {
         case 'v':
             g_htmlsplit_verbose = true;
@@ -78,15 +157,166 @@ static bool parse_argv(int argc, char* argv[], struct Splitter* p_splitter)
             break;
         case 'h':
             print_usage(argv[0]);
-            xmlCleanupParser();
             exit(0);
             break;
+        case OPT_MAX_MEMORY:
+            p_splitter->maxmem = governor_parse_size(optarg);
+            if (p_splitter->maxmem == 0) {
+                fprintf(stderr, "Invalid memory budget '%s'.\n", optarg);
+                exit(ERR_CLI);
+            }
+            break;
+        case OPT_MAX_TIME:
+            p_splitter->maxtime = atoi(optarg);
+            break;
+        case OPT_NAME_PATTERN:
+            if (strlen(optarg) >= sizeof(p_splitter->namepattern) / 2) {
+                fprintf(stderr, "Name pattern '%s' is too long.\n", optarg);
+                exit(ERR_CLI);
+            }
+            strcpy(p_splitter->namepattern, optarg);
+            break;
+        case OPT_SHARD:
+            if (!splitter_parse_shard(p_splitter, optarg)) {
+                fprintf(stderr, "Invalid sharding specification '%s'.\n", optarg);
+                exit(ERR_CLI);
+            }
+            break;
+        case OPT_SEARCH_INDEX:
+            strcpy(p_splitter->searchindex, optarg);
+            break;
+        case OPT_DEDUP:
+            if (!splitter_parse_dedup(p_splitter, optarg)) {
+                fprintf(stderr, "Invalid deduplication mode '%s'.\n", optarg);
+                exit(ERR_CLI);
+            }
+            break;
+        case OPT_MINIFY:
+            p_splitter->minify = true;
+            break;
+        case OPT_STRIP_COMMENTS:
+            p_splitter->minify        = true;
+            p_splitter->stripcomments = true;
+            break;
+        case OPT_PARSE_THREADS:
+            p_splitter->parsethreads = atoi(optarg);
+            if (p_splitter->parsethreads < 1) {
+                fprintf(stderr, "Invalid number of parser threads '%s'.\n", optarg);
+                exit(ERR_CLI);
+            }
+            break;
+        case OPT_ASYNC_WRITE:
+            p_splitter->writedepth = atoi(optarg);
+            if (p_splitter->writedepth < 1) {
+                fprintf(stderr, "Invalid number of asynchronous writes '%s'.\n", optarg);
+                exit(ERR_CLI);
+            }
+            break;
+        case OPT_DURABILITY:
+            if (!splitter_parse_durability(p_splitter, optarg)) {
+                fprintf(stderr, "Invalid durability mode '%s'.\n", optarg);
+                exit(ERR_CLI);
+            }
+            break;
+        case OPT_NODE_TABLE:
+            p_splitter->nodetable = true;
+            break;
+        case OPT_TOC_PAGES:
+            if (!splitter_parse_toc_pages(p_splitter, optarg)) {
+                fprintf(stderr, "Invalid ToC pagination mode '%s'.\n", optarg);
+                exit(ERR_CLI);
+            }
+            break;
+        case OPT_TOC_JSON:
+            p_splitter->tocjson = true;
+            break;
+        case OPT_PART_TOC:
+            p_splitter->parttoc = true;
+            break;
+        case OPT_VARIANT:
+            if (!splitter_add_variant(p_splitter, optarg)) {
+                fprintf(stderr, "Invalid variant '%s'.\n", optarg);
+                exit(ERR_CLI);
+            }
+            break;
+        case OPT_VARIANT_THREADS:
+            p_splitter->variantthreads = atoi(optarg);
+            if (p_splitter->variantthreads < 1) {
+                fprintf(stderr, "Invalid number of variant threads '%s'.\n", optarg);
+                exit(ERR_CLI);
+            }
+            break;
+        case OPT_TEMPLATE:
+            strcpy(p_splitter->templatefile, optarg);
+            break;
+        case OPT_RESOURCE_HINTS:
+            p_splitter->resourcehints = atoi(optarg);
+            if (p_splitter->resourcehints < 0) {
+                fprintf(stderr, "Invalid number of resources to preload '%s'.\n", optarg);
+                exit(ERR_CLI);
+            }
+            break;
+        case OPT_DEPS_FILE:
+            strcpy(p_splitter->depsfile, optarg);
+            break;
+        case OPT_TRACE:
+            strcpy(p_splitter->tracefile, optarg);
+            break;
+        case OPT_PLAN:
+            if (!splitter_parse_plan(p_splitter, optarg)) {
+                fprintf(stderr, "Invalid plan format '%s'.\n", optarg);
+                exit(ERR_CLI);
+            }
+            break;
+        case OPT_WATCH:
+            p_splitter->watch = true;
+            break;
+        case OPT_CACHE_DIR:
+            strcpy(p_splitter->cachedir, optarg);
+            break;
+        case OPT_CACHE_SIZE:
+            p_splitter->cachesize = governor_parse_size(optarg);
+            if (p_splitter->cachesize == 0) {
+                fprintf(stderr, "Invalid cache size '%s'.\n", optarg);
+                exit(ERR_CLI);
+            }
+            break;
         default: /* '?' */
             print_usage(argv[0]);
             exit(ERR_CLI);
         }
     }
 
+    /* Variants may set -t and -o on their own */
+    if ((p_splitter->tocpages != TOC_PAGES_SINGLE || p_splitter->tocjson || p_splitter->parttoc) && p_splitter->tocdepth <= 0 && p_splitter->num_variants == 0) {
+        fprintf(stderr, "The ToC options --toc-pages, --toc-json, and --part-toc require -t.\n");
+        exit(ERR_CLI);
+    }
+
+    if (p_splitter->tocjson && strlen(p_splitter->outdir) == 0 && p_splitter->num_variants == 0) {
+        fprintf(stderr, "--toc-json requires -o.\n");
+        exit(ERR_CLI);
+    }
+
+    if (p_splitter->planmode != PLAN_NONE && p_splitter->num_variants > 0) {
+        fprintf(stderr, "--plan cannot be combined with --variant.\n");
+        exit(ERR_CLI);
+    }
+
+    if (p_splitter->watch) {
+        if (strlen(p_splitter->infile) == 0 || strlen(p_splitter->outdir) == 0) {
+            fprintf(stderr, "--watch requires -i and -o.\n");
+            exit(ERR_CLI);
+        }
+
+        if (p_splitter->num_variants > 0 || p_splitter->planmode != PLAN_NONE || p_splitter->maxtime > 0) {
+            fprintf(stderr, "--watch cannot be combined with --variant, --plan, or --max-time.\n");
+            exit(ERR_CLI);
+        }
+    }
+
+    splitter_setup_variants(p_splitter);
+
     if (copyright)
         print_copyright();
 
@@ -101,14 +331,13 @@ void cleanup()
 void handle_sigterm_and_sigint(int sigval)
 {
     sp_splitter->terminate = true;
+    splitter_terminate_variants(sp_splitter);
+    splitter_terminate_watch(sp_splitter);
 }
 
 int main(int argc, char* argv[])
 {
     setlocale(LC_ALL, "");
-    xmlInitParser();
-
-    atexit(cleanup);
 
     sp_splitter = splitter_new();
 
@@ -122,10 +351,46 @@ int main(int argc, char* argv[])
 
     parse_argv(argc, argv, sp_splitter);
 
-    splitter_split_file(sp_splitter);
+    if (strlen(sp_splitter->tracefile) > 0 && !trace_start(sp_splitter->tracefile)) {
+        fprintf(stderr, "htmlsplit was built without tracing support.\n");
+        exit(ERR_CLI);
+    }
+
+    /* The memory hooks must be in place before libxml2
+     * allocates anything, so the parser can only be
+     * initialised after the options are known. */
+    governor_init(sp_splitter->maxmem, sp_splitter->maxtime);
+    xmlInitParser();
+    atexit(cleanup);
+
+    if (strlen(sp_splitter->templatefile) > 0)
+        splitter_load_template(sp_splitter);
+
+    /* Variants and watch cycles bring their own ToC, and a plan writes nothing */
+    if (sp_splitter->planmode != PLAN_NONE) {
+        splitter_plan_file(sp_splitter);
+    }
+    else if (sp_splitter->watch) {
+        splitter_watch(sp_splitter);
+    }
+    else if (sp_splitter->num_variants > 0) {
+        splitter_split_variants(sp_splitter);
+    }
+    else {
+        splitter_split_file(sp_splitter);
+    }
 
-    if (sp_splitter->tocdepth > 0)
-        splitter_generate_tocfile(sp_splitter);
+    if (governor_time_exceeded()) {
+        splitter_free(sp_splitter);
+        return ERR_TIME;
+    }
+
+    if (sp_splitter->tocdepth > 0 && sp_splitter->num_variants == 0 && sp_splitter->planmode == PLAN_NONE && !sp_splitter->watch) {
+        if (governor_pressure() < GOV_PRESSURE_CRITICAL)
+            splitter_generate_tocfile(sp_splitter);
+        else
+            fprintf(stderr, "Warning: Not generating the ToC file due to memory pressure.\n");
+    }
 
     splitter_free(sp_splitter);
 
@@ -0,0 +1,337 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
+#include <libxml/HTMLparser.h>
+#include "split.h"
+#include "nodetable.h"
+#include "verbose.h"
+
+/* The node table mirrors the elements of the document in preorder,
+ * so that the subtree of element n is exactly the range [n, end).
+ * Each libxml2 node records its index in the table (plus one) in
+ * its `_private` member. Element names are interned in the
+ * document’s dictionary by the parser, so tag lookup mostly
+ * compares pointers. */
+
+static int add_entry(struct NodeTable* p_table, xmlNodePtr p_node, int parent, int* p_lastchild);
+static int lookup_tag(struct NodeTable* p_table, const xmlChar* name);
+static int pool_add(struct NodeTable* p_table, xmlNodePtr p_node, const char* attrname);
+static bool is_heading(const xmlChar* name);
+static void* grow(void* ptr, size_t size, const char* what);
+
+/**
+ * Build the node table for the document and locate the split
+ * points given in `p_splitpoints` in it. If the split points
+ * are not all element children of one common parent, no table
+ * is built and `p_nodetable` stays NULL.
+ */
+void splitter_build_node_table(struct Splitter* p_splitter, xmlNodeSetPtr p_splitpoints)
+{
+    struct NodeTable* p_table = NULL;
+    xmlNodePtr p_node = xmlDocGetRootElement(p_splitter->p_document);
+    xmlNodePtr p_parent_node = NULL;
+    int* p_lastchild = NULL;
+    int capacity = 0;
+    int parent = -1;
+    int i = 0;
+
+    p_table = (struct NodeTable*) grow(NULL, sizeof(struct NodeTable), "node table");
+    memset(p_table, '\0', sizeof(struct NodeTable));
+
+    while (p_node) {
+        xmlNodePtr p_next = NULL;
+        int index = 0;
+
+        if (p_table->num_entries == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            p_table->p_entries = (struct NodeEntry*) grow(p_table->p_entries, capacity * sizeof(struct NodeEntry), "node table");
+            p_table->p_nodes   = (xmlNodePtr*) grow(p_table->p_nodes, capacity * sizeof(xmlNodePtr), "node table");
+            p_lastchild        = (int*) grow(p_lastchild, (capacity + 1) * sizeof(int), "node table");
+
+            if (p_table->num_entries == 0)
+                p_lastchild[0] = -1;
+        }
+
+        index = add_entry(p_table, p_node, parent, p_lastchild);
+
+        /* Descend */
+        p_next = xmlFirstElementChild(p_node);
+        if (p_next) {
+            parent = index;
+            p_node = p_next;
+            continue;
+        }
+
+        p_table->p_entries[index].end = index + 1;
+
+        /* Climb up until there is a next sibling, closing
+         * the subtrees left on the way */
+        while (!(p_next = xmlNextElementSibling(p_node)) && parent >= 0) {
+            p_table->p_entries[parent].end = p_table->num_entries;
+            p_node = p_table->p_nodes[parent];
+            parent = p_table->p_entries[parent].parent;
+        }
+
+        p_node = p_next;
+    }
+
+    xmlFree(p_lastchild);
+
+    verbprintf("Node table has %d elements with %d distinct names, %lu bytes of attributes, and %d headings.\n",
+               p_table->num_entries, p_table->num_tags, (unsigned long) p_table->pool_size, p_table->num_headings);
+
+    /* Locate the split points */
+    p_table->common_parent = -1;
+    p_table->p_splits = (int*) grow(NULL, (p_splitpoints->nodeNr + 1) * sizeof(int), "split points");
+
+    for(i=0; i < p_splitpoints->nodeNr; i++) {
+        xmlNodePtr p_split = p_splitpoints->nodeTab[i];
+
+        if (p_split->type != XML_ELEMENT_NODE || (p_parent_node && p_split->parent != p_parent_node)) {
+            verbprintf("Split points do not share a common parent, not using the node table.\n");
+            p_splitter->p_nodetable = p_table;
+            splitter_free_node_table(p_splitter);
+            return;
+        }
+
+        p_parent_node = p_split->parent;
+        p_table->p_splits[p_table->num_splits++] = splitter_node_index(p_split);
+    }
+
+    p_splitter->p_nodetable = p_table;
+
+    if (!p_parent_node || p_parent_node->type != XML_ELEMENT_NODE) {
+        verbprintf("Split points are not below an element, not using the node table.\n");
+        splitter_free_node_table(p_splitter);
+        return;
+    }
+
+    p_table->common_parent = splitter_node_index(p_parent_node);
+}
+
+/**
+ * Free the node table, if any.
+ */
+void splitter_free_node_table(struct Splitter* p_splitter)
+{
+    struct NodeTable* p_table = p_splitter->p_nodetable;
+    int i = 0;
+
+    if (!p_table)
+        return;
+
+    for(i=0; i < p_table->num_entries; i++)
+        p_table->p_nodes[i]->_private = NULL;
+
+    xmlFree(p_table->p_entries);
+    xmlFree(p_table->p_nodes);
+    xmlFree(p_table->p_tags);
+    xmlFree(p_table->p_pool);
+    xmlFree(p_table->p_splits);
+    xmlFree(p_table->p_headings);
+    xmlFree(p_table);
+
+    p_splitter->p_nodetable = NULL;
+}
+
+/**
+ * Index of the given node in the node table, or -1 if it is
+ * not in there (like nodes created after building the table).
+ */
+int splitter_node_index(xmlNodePtr p_node)
+{
+    return (int) (intptr_t) p_node->_private - 1;
+}
+
+/**
+ * Range [`*p_first`, `*p_last`) of elements below the common
+ * parent that are kept for part number `part`. All elements
+ * outside the common parent are kept for every part.
+ */
+void splitter_part_range(struct NodeTable* p_table, int part, int* p_first, int* p_last)
+{
+    int parent = p_table->common_parent;
+
+    /* Nothing before the first split point is removed for the first part */
+    *p_first = part > 0 ? p_table->p_splits[part - 1] : parent + 1;
+    *p_last  = part < p_table->num_splits ? p_table->p_splits[part] : p_table->p_entries[parent].end;
+}
+
+/**
+ * Whether element `node` is in the document while part
+ * number `part` is being written.
+ */
+bool splitter_node_in_part(struct NodeTable* p_table, int node, int part)
+{
+    int parent = p_table->common_parent;
+    int first = 0;
+    int last = 0;
+
+    if (node <= parent || node >= p_table->p_entries[parent].end)
+        return true;
+
+    splitter_part_range(p_table, part, &first, &last);
+    return node >= first && node < last;
+}
+
+/**
+ * Position in `p_headings` of the first heading at or
+ * after element `node`.
+ */
+int splitter_first_heading(struct NodeTable* p_table, int node)
+{
+    int low = 0;
+    int high = p_table->num_headings;
+
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+
+        if (p_table->p_headings[mid] < node)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/**
+ * Same as splitter_detect_target_anchor(), but working on the
+ * node table for the state of the document while part number
+ * `part` is being written. The result points into the table
+ * and must not be freed.
+ */
+const char* splitter_table_anchor(struct NodeTable* p_table, int node, int part)
+{
+    struct NodeEntry* p_entry = &p_table->p_entries[node];
+
+    /* ID attribute in H* tag */
+    if (p_entry->id >= 0)
+        return p_table->p_pool + p_entry->id;
+
+    /* NAME attribute in the first child element, which directly follows in preorder */
+    if (p_entry->end > node + 1)
+        if (p_table->p_entries[node + 1].name >= 0)
+            return p_table->p_pool + p_table->p_entries[node + 1].name;
+
+    /* NAME attribute in the previous and next element,
+     * unless they are sliced away for this part */
+    if (p_entry->prev >= 0 && p_table->p_entries[p_entry->prev].name >= 0 && splitter_node_in_part(p_table, p_entry->prev, part))
+        return p_table->p_pool + p_table->p_entries[p_entry->prev].name;
+
+    if (p_entry->next >= 0 && p_table->p_entries[p_entry->next].name >= 0 && splitter_node_in_part(p_table, p_entry->next, part))
+        return p_table->p_pool + p_table->p_entries[p_entry->next].name;
+
+    return NULL;
+}
+
+/* Append an entry for `p_node` below element `parent`. `p_lastchild`
+ * records the last child added to each element so far, offset by
+ * one for the top level. */
+int add_entry(struct NodeTable* p_table, xmlNodePtr p_node, int parent, int* p_lastchild)
+{
+    int index = p_table->num_entries++;
+    struct NodeEntry* p_entry = &p_table->p_entries[index];
+
+    p_entry->parent = parent;
+    p_entry->prev   = p_lastchild[parent + 1];
+    p_entry->next   = -1;
+    p_entry->end    = index + 1; /* Fixed up when leaving the subtree */
+    p_entry->tag    = lookup_tag(p_table, p_node->name);
+    p_entry->id     = pool_add(p_table, p_node, "id");
+    p_entry->name   = pool_add(p_table, p_node, "name");
+
+    if (p_entry->prev >= 0)
+        p_table->p_entries[p_entry->prev].next = index;
+
+    p_lastchild[parent + 1] = index;
+    p_lastchild[index + 1]  = -1;
+
+    p_table->p_nodes[index] = p_node;
+    p_node->_private = (void*) (intptr_t) (index + 1);
+
+    if (is_heading(p_node->name)) {
+        if ((p_table->num_headings & (p_table->num_headings - 1)) == 0) /* Power of two: full */
+            p_table->p_headings = (int*) grow(p_table->p_headings, (p_table->num_headings ? p_table->num_headings * 2 : 1) * sizeof(int), "heading list");
+
+        p_table->p_headings[p_table->num_headings++] = index;
+    }
+
+    return index;
+}
+
+int lookup_tag(struct NodeTable* p_table, const xmlChar* name)
+{
+    int i = 0;
+
+    /* Most recently added names are checked first, as
+     * documents tend to repeat the same few elements. */
+    for(i = p_table->num_tags - 1; i >= 0; i--) {
+        if (p_table->p_tags[i] == name)
+            return i;
+    }
+
+    for(i = p_table->num_tags - 1; i >= 0; i--) {
+        if (xmlStrEqual(p_table->p_tags[i], name))
+            return i;
+    }
+
+    if ((p_table->num_tags & (p_table->num_tags - 1)) == 0)
+        p_table->p_tags = (const xmlChar**) grow(p_table->p_tags, (p_table->num_tags ? p_table->num_tags * 2 : 1) * sizeof(xmlChar*), "tag list");
+
+    p_table->p_tags[p_table->num_tags] = name;
+    return p_table->num_tags++;
+}
+
+/* Copy the value of the attribute into the string pool
+ * and return its offset, or -1 if it is not set. */
+int pool_add(struct NodeTable* p_table, xmlNodePtr p_node, const char* attrname)
+{
+    xmlChar* value = NULL;
+    size_t len = 0;
+    int offset = (int) p_table->pool_size;
+
+    if (!p_node->properties || !xmlHasProp(p_node, BAD_CAST(attrname)))
+        return -1;
+
+    value = xmlGetProp(p_node, BAD_CAST(attrname));
+    if (!value)
+        return -1;
+
+    len = xmlStrlen(value) + 1;
+
+    if (p_table->pool_size + len > p_table->pool_capacity) {
+        while (p_table->pool_size + len > p_table->pool_capacity)
+            p_table->pool_capacity = p_table->pool_capacity ? p_table->pool_capacity * 2 : 4096;
+
+        p_table->p_pool = (char*) grow(p_table->p_pool, p_table->pool_capacity, "attribute pool");
+    }
+
+    memcpy(p_table->p_pool + p_table->pool_size, value, len);
+    p_table->pool_size += len;
+
+    xmlFree(value);
+    return offset;
+}
+
+bool is_heading(const xmlChar* name)
+{
+    return name[0] == 'h' && name[1] >= '1' && name[1] <= '6' && name[2] == '\0';
+}
+
+void* grow(void* ptr, size_t size, const char* what)
+{
+    ptr = xmlRealloc(ptr, size);
+
+    if (!ptr) {
+        fprintf(stderr, "Failed to allocate memory for %s.\n", what);
+        exit(ERR_MEM);
+    }
+
+    return ptr;
+}
@@ -0,0 +1,47 @@
+#ifndef HTMLSPLIT_NODETABLE_H
+#define HTMLSPLIT_NODETABLE_H
+
+/**
+ * One element of the document in the node table. All
+ * references to other elements are indices into the table;
+ * -1 means there is none.
+ */
+struct NodeEntry {
+    int parent;
+    int prev;       /*< Previous element sibling */
+    int next;       /*< Next element sibling */
+    int end;        /*< One past the last descendant */
+    int tag;        /*< Index into `p_tags` */
+    int id;         /*< Offset of the "id" attribute's value in the string pool */
+    int name;       /*< Offset of the "name" attribute's value in the string pool */
+};
+
+/**
+ * Compact representation of all elements of the document in
+ * preorder, built once after parsing.
+ */
+struct NodeTable {
+    struct NodeEntry* p_entries;
+    xmlNodePtr* p_nodes;        /*< libxml2 node of each entry, for serialisation */
+    int num_entries;
+    const xmlChar** p_tags;     /*< Distinct element names, as interned in the document's dictionary */
+    int num_tags;
+    char* p_pool;               /*< Attribute values, NUL-terminated */
+    size_t pool_size;
+    size_t pool_capacity;
+    int* p_splits;              /*< Indices of the split points */
+    int num_splits;
+    int* p_headings;            /*< Indices of all <h1> to <h6> */
+    int num_headings;
+    int common_parent;          /*< Index of the split points' parent */
+};
+
+void splitter_build_node_table(struct Splitter* p_splitter, xmlNodeSetPtr p_splitpoints); /*< \private */
+void splitter_free_node_table(struct Splitter* p_splitter); /*< \private */
+int splitter_node_index(xmlNodePtr p_node); /*< \private */
+void splitter_part_range(struct NodeTable* p_table, int part, int* p_first, int* p_last); /*< \private */
+bool splitter_node_in_part(struct NodeTable* p_table, int node, int part); /*< \private */
+int splitter_first_heading(struct NodeTable* p_table, int node); /*< \private */
+const char* splitter_table_anchor(struct NodeTable* p_table, int node, int part); /*< \private */
+
+#endif
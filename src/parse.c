@@ -0,0 +1,539 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <limits.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <libxml/tree.h>
+#include <libxml/parser.h>
+#include <libxml/HTMLparser.h>
+#include "split.h"
+#include "parse.h"
+#include "trace.h"
+#include "verbose.h"
+
+/* Parallel parsing works like this: A quick scan over the raw bytes
+ * finds all start tags of the split element (the "boundaries") and
+ * notes for each of them whether all elements opened since the first
+ * one have been closed again, i.e. whether the boundary is safe to
+ * cut at. The bytes between a number of safe boundaries ("chunks")
+ * are parsed on separate threads as documents of their own. At the
+ * same time, the main thread parses the rest of the document (the
+ * "skeleton") with a marker element where the chunks were. Finally,
+ * the chunks’ nodes replace the marker.
+ *
+ * Whenever something does not look exactly like the serial parser
+ * would have produced it, the parallel result is discarded and the
+ * caller falls back to parsing serially. */
+
+#define PARSE_MAX_DEPTH   256
+#define PARSE_MAX_NAMELEN 32
+#define PARSE_MARKER_ATTR "data-htmlsplit-marker"
+
+struct ParseChunk {
+    const char* p_data;
+    size_t size;
+    htmlDocPtr p_doc;
+    pthread_t thread;
+};
+
+/**
+ * Result of scanning the raw input.
+ */
+struct PreScan {
+    size_t* p_boundaries; /*< Offsets of the safe boundaries; the first is the first split point */
+    int num_boundaries;
+    size_t tail;          /*< Offset of the end tag that closes the split points’ parent, or EOF */
+};
+
+static bool split_element_name(const char* splitexpr, char* name);
+static bool prescan(const char* p_buffer, size_t size, const char* name, struct PreScan* p_scan);
+static size_t read_tag_name(const char* p_buffer, size_t size, size_t pos, char* name);
+static size_t find_tag_end(const char* p_buffer, size_t size, size_t pos);
+static size_t find_string(const char* p_buffer, size_t size, size_t pos, const char* str, bool nocase);
+static bool name_in(const char* name, const char* const* names);
+static void* parse_chunk(void* p_arg);
+static xmlNodePtr find_marker(xmlNodePtr p_node);
+static bool graft_chunk(struct ParseChunk* p_chunk, htmlDocPtr p_document, xmlNodePtr p_marker, const char* name);
+
+static const char* const s_void_elements[] = {
+    "area", "base", "br", "col", "embed", "hr", "img", "input", "keygen", "link",
+    "meta", "param", "source", "track", "wbr", NULL
+};
+
+static const char* const s_raw_elements[] = {
+    "script", "style", "textarea", "title", "xmp", "iframe", "noembed", "noframes", NULL
+};
+
+/* Elements whose start tag implicitly closes an open <p> */
+static const char* const s_p_closers[] = {
+    "address", "article", "aside", "blockquote", "details", "div", "dl", "fieldset",
+    "figcaption", "figure", "footer", "form", "h1", "h2", "h3", "h4", "h5", "h6",
+    "header", "hgroup", "hr", "main", "menu", "nav", "ol", "p", "pre", "section",
+    "table", "ul", NULL
+};
+
+/* Parents in which the chunks would be parsed differently out of context */
+static const char* const s_context_elements[] = {
+    "table", "thead", "tbody", "tfoot", "tr", "ul", "ol", "dl", "select", "colgroup", NULL
+};
+
+/**
+ * Parse the `size` bytes at `p_buffer` using the number of
+ * threads requested in `p_splitter`. Returns NULL if the
+ * document cannot safely be parsed in parallel, in which case
+ * it must be parsed serially.
+ */
+htmlDocPtr splitter_parse_parallel(struct Splitter* p_splitter, const char* p_buffer, size_t size, const char* url)
+{
+    struct PreScan scan;
+    struct ParseChunk* p_chunks = NULL;
+    htmlDocPtr p_document = NULL;
+    xmlNodePtr p_marker = NULL;
+    char name[PARSE_MAX_NAMELEN];
+    char marker[2 * PARSE_MAX_NAMELEN + 64];
+    char* p_skeleton = NULL;
+    size_t skeletonsize = 0;
+    int num_chunks = 0;
+    int i = 0;
+    bool ok = true;
+
+    if (!split_element_name(p_splitter->splitexpr, name)) {
+        verbprintf("XPath expression '%s' is too complex for parallel parsing.\n", p_splitter->splitexpr);
+        return NULL;
+    }
+
+    memset(&scan, '\0', sizeof(struct PreScan));
+    if (!prescan(p_buffer, size, name, &scan) || scan.num_boundaries < 2) {
+        verbprintf("No safe chunk boundaries found for parallel parsing.\n");
+        xmlFree(scan.p_boundaries);
+        return NULL;
+    }
+
+    /* Pick chunks of roughly equal size, starting at safe boundaries */
+    p_chunks = (struct ParseChunk*) xmlMalloc(p_splitter->parsethreads * sizeof(struct ParseChunk));
+    if (!p_chunks) {
+        perror("Failed to allocate memory for parse chunks");
+        exit(ERR_MEM);
+    }
+    memset(p_chunks, '\0', p_splitter->parsethreads * sizeof(struct ParseChunk));
+
+    p_chunks[0].p_data = p_buffer + scan.p_boundaries[0];
+    num_chunks = 1;
+
+    for(i=1; i < scan.num_boundaries && num_chunks < p_splitter->parsethreads; i++) {
+        size_t target = scan.p_boundaries[0] + num_chunks * ((scan.tail - scan.p_boundaries[0]) / p_splitter->parsethreads);
+
+        if (scan.p_boundaries[i] >= target) {
+            p_chunks[num_chunks-1].size = (p_buffer + scan.p_boundaries[i]) - p_chunks[num_chunks-1].p_data;
+            p_chunks[num_chunks++].p_data = p_buffer + scan.p_boundaries[i];
+        }
+    }
+    p_chunks[num_chunks-1].size = (p_buffer + scan.tail) - p_chunks[num_chunks-1].p_data;
+
+    if (num_chunks < 2) {
+        verbprintf("Safe chunk boundaries are too unevenly spread for parallel parsing.\n");
+        xmlFree(p_chunks);
+        xmlFree(scan.p_boundaries);
+        return NULL;
+    }
+
+    verbprintf("Parsing %d chunks in parallel.\n", num_chunks);
+
+    for(i=0; i < num_chunks; i++) {
+        if (pthread_create(&p_chunks[i].thread, NULL, parse_chunk, &p_chunks[i]) != 0) {
+            verbprintf("Failed to start parser thread, not parsing in parallel.\n");
+
+            while (i-- > 0) {
+                pthread_join(p_chunks[i].thread, NULL);
+                xmlFreeDoc(p_chunks[i].p_doc);
+            }
+
+            xmlFree(p_chunks);
+            xmlFree(scan.p_boundaries);
+            return NULL;
+        }
+    }
+
+    /* Meanwhile, parse the skeleton with the marker in place of the chunks.
+     * The marker has the split element’s name so that it closes the same
+     * open elements the first split point would. */
+    sprintf(marker, "<%s %s=\"\"></%s>", name, PARSE_MARKER_ATTR, name);
+    skeletonsize = scan.p_boundaries[0] + strlen(marker) + (size - scan.tail);
+
+    p_skeleton = (char*) xmlMalloc(skeletonsize);
+    if (!p_skeleton) {
+        perror("Failed to allocate memory for the document skeleton");
+        exit(ERR_MEM);
+    }
+
+    memcpy(p_skeleton, p_buffer, scan.p_boundaries[0]);
+    memcpy(p_skeleton + scan.p_boundaries[0], marker, strlen(marker));
+    memcpy(p_skeleton + scan.p_boundaries[0] + strlen(marker), p_buffer + scan.tail, size - scan.tail);
+
+    p_document = htmlReadMemory(p_skeleton, skeletonsize, url, "UTF-8", 0);
+    xmlFree(p_skeleton);
+
+    for(i=0; i < num_chunks; i++)
+        pthread_join(p_chunks[i].thread, NULL);
+
+    /* Put the chunks in place of the marker */
+    if (p_document)
+        p_marker = find_marker(xmlDocGetRootElement(p_document));
+
+    if (!p_marker || !p_marker->parent || name_in((const char*) p_marker->parent->name, s_context_elements)) {
+        verbprintf("Split points are in a context that cannot be parsed in parallel.\n");
+        ok = false;
+    }
+
+    for(i=0; i < num_chunks && ok; i++)
+        ok = graft_chunk(&p_chunks[i], p_document, p_marker, name);
+
+    for(i=0; i < num_chunks; i++)
+        xmlFreeDoc(p_chunks[i].p_doc);
+
+    xmlFree(p_chunks);
+    xmlFree(scan.p_boundaries);
+
+    if (!ok) {
+        xmlFreeDoc(p_document);
+        return NULL;
+    }
+
+    xmlUnlinkNode(p_marker);
+    xmlFreeNode(p_marker);
+
+    return p_document;
+}
+
+/**
+ * Find the offsets of the split points in the `size` bytes at
+ * `p_buffer` with the same quick scan used for parallel parsing.
+ * Only split points on the level of the first one are found, and
+ * `*p_tail` is set to the offset where their parent ends. The
+ * offsets are stored in `*pp_boundaries`, to be freed with xmlFree().
+ * Returns false if the split expression or the document is too
+ * complex for the scan.
+ */
+bool splitter_find_boundaries(struct Splitter* p_splitter, const char* p_buffer, size_t size,
+                              size_t** pp_boundaries, int* p_num_boundaries, size_t* p_tail)
+{
+    struct PreScan scan;
+    char name[PARSE_MAX_NAMELEN];
+
+    if (!split_element_name(p_splitter->splitexpr, name))
+        return false;
+
+    memset(&scan, '\0', sizeof(struct PreScan));
+    if (!prescan(p_buffer, size, name, &scan)) {
+        xmlFree(scan.p_boundaries);
+        return false;
+    }
+
+    *pp_boundaries    = scan.p_boundaries;
+    *p_num_boundaries = scan.num_boundaries;
+    *p_tail           = scan.tail;
+    return true;
+}
+
+/* Only expressions whose last step is a plain element name, like
+ * "//h1" or "/html/body/div/h2", name the element to look for in
+ * the raw input. */
+bool split_element_name(const char* splitexpr, char* name)
+{
+    const char* p_start = strrchr(splitexpr, '/');
+    const char* p_char = NULL;
+
+    if (!p_start || strpbrk(splitexpr, "[|()@*:") || strlen(++p_start) >= PARSE_MAX_NAMELEN)
+        return false;
+
+    for (p_char = p_start; *p_char; p_char++) {
+        if (!isalnum((unsigned char) *p_char))
+            return false;
+    }
+
+    for (p_char = p_start; *p_char; p_char++)
+        *name++ = tolower((unsigned char) *p_char);
+    *name = '\0';
+
+    return p_start[0] != '\0';
+}
+
+/* Find the boundaries in the raw input. Comments, raw text elements
+ * (like <script>), and the insides of tags are skipped. Returns false
+ * if the document cannot be chunked at all. */
+bool prescan(const char* p_buffer, size_t size, const char* name, struct PreScan* p_scan)
+{
+    char stack[PARSE_MAX_DEPTH][PARSE_MAX_NAMELEN];
+    int depth = 0;
+    int capacity = 0;
+    bool started = false;
+    bool escaped = false;
+    size_t pos = 0;
+
+    p_scan->tail = size;
+
+    while (pos < size) {
+        char tag[PARSE_MAX_NAMELEN];
+        size_t tagend = 0;
+
+        if (p_buffer[pos] != '<') {
+            pos++;
+            continue;
+        }
+
+        if (pos + 4 <= size && strncmp(p_buffer + pos, "<!--", 4) == 0) {
+            pos = find_string(p_buffer, size, pos + 4, "-->", false) + 3;
+            continue;
+        }
+        else if (pos + 1 < size && (p_buffer[pos+1] == '!' || p_buffer[pos+1] == '?')) {
+            pos = find_tag_end(p_buffer, size, pos) + 1;
+            continue;
+        }
+        else if (pos + 1 < size && p_buffer[pos+1] == '/') { /* End tag */
+            if (read_tag_name(p_buffer, size, pos + 2, tag) == 0) {
+                pos++;
+                continue;
+            }
+
+            if (started && !escaped) {
+                int i = depth - 1;
+
+                while (i >= 0 && strcmp(stack[i], tag) != 0)
+                    i--;
+
+                if (i >= 0) {
+                    depth = i;
+                }
+                else { /* Closes an element opened before the first split point */
+                    escaped = true;
+                    p_scan->tail = pos;
+                }
+            }
+
+            pos = find_tag_end(p_buffer, size, pos) + 1;
+            continue;
+        }
+        else if (read_tag_name(p_buffer, size, pos + 1, tag) == 0) {
+            pos++;
+            continue;
+        }
+
+        /* Start tag */
+        tagend = find_tag_end(p_buffer, size, pos);
+
+        if (strcmp(tag, name) == 0) {
+            int i = 0;
+            bool only_p = true;
+
+            for(i=0; i < depth; i++)
+                only_p = only_p && strcmp(stack[i], "p") == 0;
+
+            if (escaped) {
+                /* Split point outside the parent of the others */
+                xmlFree(p_scan->p_boundaries);
+                p_scan->p_boundaries = NULL;
+                return false;
+            }
+
+            if (!started || depth == 0 || (only_p && name_in(name, s_p_closers))) {
+                if (p_scan->num_boundaries == capacity) {
+                    capacity = capacity ? capacity * 2 : 1024;
+                    p_scan->p_boundaries = (size_t*) xmlRealloc(p_scan->p_boundaries, capacity * sizeof(size_t));
+
+                    if (!p_scan->p_boundaries) {
+                        perror("Failed to allocate memory for chunk boundaries");
+                        exit(ERR_MEM);
+                    }
+                }
+
+                p_scan->p_boundaries[p_scan->num_boundaries++] = pos;
+                depth = 0;
+            }
+
+            started = true;
+        }
+
+        if (started && !escaped && !name_in(tag, s_void_elements) && p_buffer[tagend - 1] != '/') {
+            /* Start tags that implicitly close the current element */
+            if (depth > 0) {
+                const char* top = stack[depth-1];
+
+                if ((strcmp(top, "p") == 0 && name_in(tag, s_p_closers))
+                    || (strcmp(tag, "li") == 0 && strcmp(top, "li") == 0)
+                    || ((strcmp(tag, "dt") == 0 || strcmp(tag, "dd") == 0) && (strcmp(top, "dt") == 0 || strcmp(top, "dd") == 0))
+                    || ((strcmp(tag, "td") == 0 || strcmp(tag, "th") == 0) && (strcmp(top, "td") == 0 || strcmp(top, "th") == 0))
+                    || (strcmp(tag, "option") == 0 && strcmp(top, "option") == 0))
+                    depth--;
+            }
+
+            if (depth == PARSE_MAX_DEPTH) {
+                xmlFree(p_scan->p_boundaries);
+                p_scan->p_boundaries = NULL;
+                return false;
+            }
+
+            strcpy(stack[depth++], tag);
+        }
+
+        pos = tagend + 1;
+
+        /* Raw text runs until the matching end tag */
+        if (name_in(tag, s_raw_elements)) {
+            char endtag[PARSE_MAX_NAMELEN + 2];
+
+            sprintf(endtag, "</%s", tag);
+            pos = find_string(p_buffer, size, pos, endtag, true);
+        }
+    }
+
+    return started;
+}
+
+/* Read the element name at `pos` into `name` in lower case.
+ * Returns its length, or 0 if there is no name at `pos`. */
+size_t read_tag_name(const char* p_buffer, size_t size, size_t pos, char* name)
+{
+    size_t len = 0;
+
+    if (pos >= size || !isalpha((unsigned char) p_buffer[pos]))
+        return 0;
+
+    while (pos + len < size && (isalnum((unsigned char) p_buffer[pos + len]) || p_buffer[pos + len] == '-' || p_buffer[pos + len] == ':')) {
+        if (len < PARSE_MAX_NAMELEN - 1)
+            name[len] = tolower((unsigned char) p_buffer[pos + len]);
+        len++;
+    }
+
+    name[len < PARSE_MAX_NAMELEN - 1 ? len : PARSE_MAX_NAMELEN - 1] = '\0';
+    return len;
+}
+
+/* Offset of the ">" closing the tag at `pos`, skipping quoted
+ * attribute values. Returns `size` - 1 if there is none. */
+size_t find_tag_end(const char* p_buffer, size_t size, size_t pos)
+{
+    char quote = '\0';
+
+    for (; pos < size; pos++) {
+        if (quote) {
+            if (p_buffer[pos] == quote)
+                quote = '\0';
+        }
+        else if (p_buffer[pos] == '"' || p_buffer[pos] == '\'') {
+            quote = p_buffer[pos];
+        }
+        else if (p_buffer[pos] == '>') {
+            return pos;
+        }
+    }
+
+    return size - 1;
+}
+
+/* Offset of the next occurence of `str` at or after `pos`,
+ * or `size` if there is none. */
+size_t find_string(const char* p_buffer, size_t size, size_t pos, const char* str, bool nocase)
+{
+    size_t len = strlen(str);
+
+    for (; pos + len <= size; pos++) {
+        if (nocase ? strncasecmp(p_buffer + pos, str, len) == 0 : strncmp(p_buffer + pos, str, len) == 0)
+            return pos;
+    }
+
+    return size;
+}
+
+bool name_in(const char* name, const char* const* names)
+{
+    for (; *names; names++) {
+        if (strcmp(name, *names) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/* Thread function. The chunk is parsed as the body of a document
+ * of its own; errors are not reported, as the serial fallback
+ * would report them anyway. */
+void* parse_chunk(void* p_arg)
+{
+    static const char prefix[] = "<html><body>";
+    struct ParseChunk* p_chunk = (struct ParseChunk*) p_arg;
+    char* p_data = (char*) xmlMalloc(sizeof(prefix) - 1 + p_chunk->size);
+
+    if (!p_data)
+        return NULL;
+
+    memcpy(p_data, prefix, sizeof(prefix) - 1);
+    memcpy(p_data + sizeof(prefix) - 1, p_chunk->p_data, p_chunk->size);
+
+    TRACE_BEGIN("parse-chunk", -1);
+    p_chunk->p_doc = htmlReadMemory(p_data, sizeof(prefix) - 1 + p_chunk->size, NULL, "UTF-8",
+                                    HTML_PARSE_NOERROR | HTML_PARSE_NOWARNING | HTML_PARSE_NONET);
+    TRACE_END("parse-chunk", -1);
+
+    xmlFree(p_data);
+    return NULL;
+}
+
+xmlNodePtr find_marker(xmlNodePtr p_node)
+{
+    for (; p_node; p_node = p_node->next) {
+        xmlNodePtr p_found = NULL;
+
+        if (p_node->type != XML_ELEMENT_NODE)
+            continue;
+
+        if (xmlHasProp(p_node, BAD_CAST(PARSE_MARKER_ATTR)))
+            return p_node;
+
+        p_found = find_marker(p_node->children);
+        if (p_found)
+            return p_found;
+    }
+
+    return NULL;
+}
+
+/* Move the body contents of a parsed chunk in front of the marker.
+ * Returns false if the chunk was not parsed as expected. */
+bool graft_chunk(struct ParseChunk* p_chunk, htmlDocPtr p_document, xmlNodePtr p_marker, const char* name)
+{
+    xmlNodePtr p_root = NULL;
+    xmlNodePtr p_body = NULL;
+    xmlNodePtr p_node = NULL;
+
+    if (!p_chunk->p_doc)
+        return false;
+
+    p_root = xmlDocGetRootElement(p_chunk->p_doc);
+    p_body = p_root ? xmlFirstElementChild(p_root) : NULL;
+
+    /* Anything ending up outside <body> (like a <title> moved into <head>),
+     * or not starting with the split point, means the chunk was parsed
+     * differently than it would have been in context. */
+    if (!p_body || xmlStrcmp(p_body->name, BAD_CAST("body")) != 0 || p_body->next || p_body->prev
+        || !p_body->children || p_body->children->type != XML_ELEMENT_NODE
+        || xmlStrcmp(p_body->children->name, BAD_CAST(name)) != 0) {
+        verbprintf("Chunk was not parsed like in context.\n");
+        return false;
+    }
+
+    p_node = p_body->children;
+    while (p_node) {
+        xmlNodePtr p_next = p_node->next;
+
+        xmlUnlinkNode(p_node);
+        xmlDOMWrapAdoptNode(NULL, p_chunk->p_doc, p_node, p_document, p_marker->parent, 0);
+        xmlAddPrevSibling(p_marker, p_node);
+
+        p_node = p_next;
+    }
+
+    return true;
+}
@@ -0,0 +1,8 @@
+#ifndef HTMLSPLIT_PARSE_H
+#define HTMLSPLIT_PARSE_H
+
+htmlDocPtr splitter_parse_parallel(struct Splitter* p_splitter, const char* p_buffer, size_t size, const char* url); /*< \private */
+bool splitter_find_boundaries(struct Splitter* p_splitter, const char* p_buffer, size_t size,
+                              size_t** pp_boundaries, int* p_num_boundaries, size_t* p_tail); /*< \private */
+
+#endif
@@ -0,0 +1,350 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
+#include <libxml/HTMLparser.h>
+#include "split.h"
+#include "plan.h"
+#include "io.h"
+#include "layout.h"
+#include "search.h"
+#include "trace.h"
+#include "verbose.h"
+
+/* The plan is made in a single walk over the parsed document,
+ * without modifying or serialising it. Every node's serialised
+ * size is estimated from the lengths of its name, attributes, and
+ * text, summed up bottom-up. As in resource.c, the split points
+ * are visited in document order, so that each element below the
+ * split points' common parent is attributed to the part started
+ * by the last split point seen. Everything else ends up in every
+ * part and is counted once as shared. The estimate ignores the
+ * line breaks added by the serialiser, the links between parts,
+ * and --minify, so it is a rough one, but its cost is linear in
+ * the document size. */
+
+/**
+ * What the plan says about one part.
+ */
+struct PlanPart {
+    size_t bytes;   /*< Estimated size of the part's own elements */
+    int headings;   /*< Headings within the -t depth (all without -t) */
+    int anchors;    /*< Elements with an ID, and <a name="..."> */
+    xmlChar* title; /*< Text of the first heading, NULL if none */
+};
+
+struct Plan {
+    struct PlanPart* p_parts;
+    int total;                   /*< Number of split points; there are one more parts */
+    int part;                    /*< Part of the node currently visited */
+    int tocdepth;
+    xmlNodeSetPtr p_splitpoints;
+    xmlNodePtr p_common_parent;
+    size_t shared;               /*< Estimated size of everything outside the parts */
+};
+
+static size_t estimate_nodes(struct Plan* p_plan, xmlNodePtr p_node, bool inside, bool raw);
+static size_t estimate_node(struct Plan* p_plan, xmlNodePtr p_node, bool inside, bool raw);
+static size_t estimate_element(struct Plan* p_plan, xmlNodePtr p_node, bool inside, bool raw);
+static size_t estimate_text(const xmlChar* text, bool attribute);
+static size_t estimate_dtd(xmlDtdPtr p_dtd);
+static int heading_level(xmlNodePtr p_node);
+static void print_text_plan(struct Splitter* p_splitter, struct Plan* p_plan);
+static void print_json_plan(struct Splitter* p_splitter, struct Plan* p_plan);
+
+/**
+ * Parse the output format for --plan, "text" or "json".
+ * Returns false if `mode` is not understood.
+ */
+bool splitter_parse_plan(struct Splitter* p_splitter, const char* mode)
+{
+    if (strcmp(mode, "text") == 0)
+        p_splitter->planmode = PLAN_TEXT;
+    else if (strcmp(mode, "json") == 0)
+        p_splitter->planmode = PLAN_JSON;
+    else
+        return false;
+
+    return true;
+}
+
+/**
+ * Read and parse the input, and print how it would be split to
+ * the standard output instead of splitting it: the parts with
+ * their first heading, estimated size, number of headings, and
+ * number of anchors. Nothing is written to the output directory.
+ */
+void splitter_plan_file(struct Splitter* p_splitter)
+{
+    struct Plan plan;
+    xmlXPathContextPtr p_context = NULL;
+    xmlXPathObjectPtr p_results  = NULL;
+    xmlNodePtr p_node = NULL;
+    int i = 0;
+
+    splitter_read_input(p_splitter);
+
+    if (!p_splitter->p_document) {
+        fprintf(stderr, "Failed to parse document file '%s'.\n", p_splitter->infile);
+        exit(ERR_PARSE);
+    }
+
+    TRACE_BEGIN("plan", -1);
+
+    p_context = xmlXPathNewContext(p_splitter->p_document);
+    p_results = xmlXPathEvalExpression(BAD_CAST(p_splitter->splitexpr), p_context);
+
+    if (!p_results->nodesetval) {
+        fprintf(stderr, "XPath expression '%s' is invalid.\n", p_splitter->splitexpr);
+        exit(ERR_CLI);
+    }
+
+    memset(&plan, '\0', sizeof(struct Plan));
+    plan.total         = p_results->nodesetval->nodeNr;
+    plan.tocdepth      = p_splitter->tocdepth > 0 ? p_splitter->tocdepth : 6;
+    plan.p_splitpoints = p_results->nodesetval;
+    if (plan.total > 0)
+        plan.p_common_parent = plan.p_splitpoints->nodeTab[0]->parent;
+
+    verbprintf("Found %d split points.\n", plan.total);
+
+    plan.p_parts = (struct PlanPart*) xmlMalloc((plan.total + 1) * sizeof(struct PlanPart));
+    if (!plan.p_parts) {
+        perror("Failed to allocate memory for the plan");
+        exit(ERR_MEM);
+    }
+    memset(plan.p_parts, '\0', (plan.total + 1) * sizeof(struct PlanPart));
+
+    /* Without split points, everything is in the only part */
+    for (p_node = p_splitter->p_document->children; p_node; p_node = p_node->next) {
+        if (p_node->type == XML_DTD_NODE)
+            plan.shared += estimate_dtd((xmlDtdPtr) p_node);
+        else
+            plan.shared += estimate_node(&plan, p_node, plan.total == 0, false) + 1; /* Line break */
+    }
+
+    splitter_init_layout(p_splitter, plan.total);
+
+    if (p_splitter->planmode == PLAN_JSON)
+        print_json_plan(p_splitter, &plan);
+    else
+        print_text_plan(p_splitter, &plan);
+
+    TRACE_END("plan", -1);
+
+    for(i=0; i <= plan.total; i++)
+        xmlFree(plan.p_parts[i].title);
+    xmlFree(plan.p_parts);
+
+    xmlXPathFreeObject(p_results);
+    xmlXPathFreeContext(p_context);
+}
+
+/* Estimate the size of `p_node` and its following siblings */
+size_t estimate_nodes(struct Plan* p_plan, xmlNodePtr p_node, bool inside, bool raw)
+{
+    size_t size = 0;
+
+    for (; p_node; p_node = p_node->next)
+        size += estimate_node(p_plan, p_node, inside, raw);
+
+    return size;
+}
+
+/* Estimate the size of `p_node`, recording headings and anchors
+ * if it is `inside` the parts. In `raw` text (<script>, <style>)
+ * nothing is escaped. */
+size_t estimate_node(struct Plan* p_plan, xmlNodePtr p_node, bool inside, bool raw)
+{
+    switch (p_node->type) {
+    case XML_ELEMENT_NODE:
+        return estimate_element(p_plan, p_node, inside, raw);
+    case XML_TEXT_NODE:
+        return raw ? (size_t) xmlStrlen(p_node->content) : estimate_text(p_node->content, false);
+    case XML_CDATA_SECTION_NODE:
+        return xmlStrlen(p_node->content);
+    case XML_COMMENT_NODE:
+        return xmlStrlen(p_node->content) + 7; /* <!----> */
+    case XML_PI_NODE:
+        return xmlStrlen(p_node->name) + xmlStrlen(p_node->content) + 4; /* <? >, roughly */
+    case XML_ENTITY_REF_NODE:
+        return xmlStrlen(p_node->name) + 2; /* &; */
+    default:
+        return 0;
+    }
+}
+
+size_t estimate_element(struct Plan* p_plan, xmlNodePtr p_node, bool inside, bool raw)
+{
+    const htmlElemDesc* p_desc = htmlTagLookup(p_node->name);
+    size_t namelen = xmlStrlen(p_node->name);
+    size_t size = namelen + 2; /* <name> */
+    xmlAttrPtr p_attr = NULL;
+    int level = 0;
+
+    /* A new part starts here */
+    if (inside && p_plan->part < p_plan->total && p_node == p_plan->p_splitpoints->nodeTab[p_plan->part])
+        p_plan->part++;
+
+    for (p_attr = p_node->properties; p_attr; p_attr = p_attr->next) {
+        size += xmlStrlen(p_attr->name) + 1; /* Leading space */
+
+        if (p_attr->children && p_attr->children->content)
+            size += estimate_text(p_attr->children->content, true) + 3; /* ="" */
+
+        if (inside && (xmlStrcasecmp(p_attr->name, BAD_CAST("id")) == 0
+                       || (xmlStrcasecmp(p_attr->name, BAD_CAST("name")) == 0 && xmlStrcasecmp(p_node->name, BAD_CAST("a")) == 0)))
+            p_plan->p_parts[p_plan->part].anchors++;
+    }
+
+    level = heading_level(p_node);
+    if (inside && level > 0 && level <= p_plan->tocdepth) {
+        struct PlanPart* p_part = &p_plan->p_parts[p_plan->part];
+
+        if (!p_part->title)
+            p_part->title = xmlNodeGetContent(p_node);
+        p_part->headings++;
+    }
+
+    if (p_desc && p_desc->empty)
+        return size;
+
+    if (xmlStrcasecmp(p_node->name, BAD_CAST("script")) == 0 || xmlStrcasecmp(p_node->name, BAD_CAST("style")) == 0)
+        raw = true;
+
+    size += namelen + 3; /* </name> */
+
+    if (p_node == p_plan->p_common_parent) {
+        xmlNodePtr p_child = NULL;
+
+        /* Only the elements are sliced off; the rest stays in every
+         * part. A split point belongs to the part it starts. */
+        for (p_child = p_node->children; p_child; p_child = p_child->next) {
+            size_t childsize = estimate_node(p_plan, p_child, true, raw);
+
+            if (p_child->type == XML_ELEMENT_NODE)
+                p_plan->p_parts[p_plan->part].bytes += childsize;
+            else
+                size += childsize;
+        }
+    }
+    else {
+        size += estimate_nodes(p_plan, p_node->children, inside, raw);
+    }
+
+    return size;
+}
+
+/* Length of `text` with the characters the serialiser escapes
+ * replaced by their entities */
+size_t estimate_text(const xmlChar* text, bool attribute)
+{
+    const xmlChar* p_char = NULL;
+    size_t size = 0;
+
+    if (!text)
+        return 0;
+
+    for (p_char = text; *p_char; p_char++) {
+        if (*p_char == '&')
+            size += 5; /* &amp; */
+        else if (*p_char == '<' || *p_char == '>')
+            size += attribute ? 1 : 4; /* &lt; &gt; */
+        else if (*p_char == '"' && attribute)
+            size += 6; /* &quot; */
+        else
+            size++;
+    }
+
+    return size;
+}
+
+/* <!DOCTYPE name PUBLIC "..." "..."> and a line break */
+size_t estimate_dtd(xmlDtdPtr p_dtd)
+{
+    size_t size = xmlStrlen(p_dtd->name) + 12;
+
+    if (p_dtd->ExternalID)
+        size += xmlStrlen(p_dtd->ExternalID) + 10;
+    if (p_dtd->SystemID)
+        size += xmlStrlen(p_dtd->SystemID) + 3;
+
+    return size;
+}
+
+/* 1 to 6 for <h1> to <h6>, 0 for anything else */
+int heading_level(xmlNodePtr p_node)
+{
+    const xmlChar* name = p_node->name;
+
+    if ((name[0] == 'h' || name[0] == 'H') && name[1] >= '1' && name[1] <= '6' && name[2] == '\0')
+        return name[1] - '0';
+
+    return 0;
+}
+
+void print_text_plan(struct Splitter* p_splitter, struct Plan* p_plan)
+{
+    size_t sum = 0;
+    int i = 0;
+
+    printf("%6s  %-24s  %10s  %8s  %7s  %s\n", "Part", "File", "Bytes", "Headings", "Anchors", "First heading");
+
+    for(i=0; i <= p_plan->total; i++) {
+        struct PlanPart* p_part = &p_plan->p_parts[i];
+        char path[PATH_MAX];
+        xmlChar* p_char = NULL;
+
+        /* Headings may span several lines */
+        for (p_char = p_part->title; p_char && *p_char; p_char++) {
+            if (*p_char == '\n' || *p_char == '\r' || *p_char == '\t')
+                *p_char = ' ';
+        }
+
+        memset(path, '\0', PATH_MAX);
+        splitter_part_path(p_splitter, i, path);
+
+        printf("%6d  %-24s  %10lu  %8d  %7d  %s\n", i, path, (unsigned long) (p_plan->shared + p_part->bytes),
+               p_part->headings, p_part->anchors, p_part->title ? (const char*) p_part->title : "-");
+
+        sum += p_plan->shared + p_part->bytes;
+    }
+
+    printf("%d parts, about %lu bytes in total, of which %lu bytes are repeated in every part.\n",
+           p_plan->total + 1, (unsigned long) sum, (unsigned long) p_plan->shared);
+}
+
+void print_json_plan(struct Splitter* p_splitter, struct Plan* p_plan)
+{
+    size_t sum = 0;
+    int i = 0;
+
+    printf("{\"version\":1,\"xpath\":");
+    splitter_write_json_string(stdout, p_splitter->splitexpr);
+    printf(",\"shared_bytes\":%lu,\"parts\":[", (unsigned long) p_plan->shared);
+
+    for(i=0; i <= p_plan->total; i++) {
+        struct PlanPart* p_part = &p_plan->p_parts[i];
+        char path[PATH_MAX];
+
+        memset(path, '\0', PATH_MAX);
+        splitter_part_path(p_splitter, i, path);
+
+        printf("%s{\"part\":%d,\"file\":", i > 0 ? "," : "", i);
+        splitter_write_json_string(stdout, path);
+        printf(",\"bytes\":%lu,\"headings\":%d,\"anchors\":%d,\"title\":",
+               (unsigned long) (p_plan->shared + p_part->bytes), p_part->headings, p_part->anchors);
+        if (p_part->title)
+            splitter_write_json_string(stdout, (const char*) p_part->title);
+        else
+            printf("null");
+        putchar('}');
+
+        sum += p_plan->shared + p_part->bytes;
+    }
+
+    printf("],\"total_bytes\":%lu}\n", (unsigned long) sum);
+}
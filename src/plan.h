@@ -0,0 +1,16 @@
+#ifndef HTMLSPLIT_PLAN_H
+#define HTMLSPLIT_PLAN_H
+
+/**
+ * How the split plan is output with --plan.
+ */
+enum planmode {
+    PLAN_NONE = 0, /*< Split normally */
+    PLAN_TEXT,     /*< Table for humans */
+    PLAN_JSON      /*< JSON for scripts */
+};
+
+bool splitter_parse_plan(struct Splitter* p_splitter, const char* mode);
+void splitter_plan_file(struct Splitter* p_splitter);
+
+#endif
@@ -0,0 +1,444 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
+#include <libxml/HTMLparser.h>
+#include "split.h"
+#include "resource.h"
+#include "layout.h"
+#include "search.h"
+#include "io.h"
+#include "writer.h"
+#include "verbose.h"
+
+/* The resources a part depends on are the images, scripts, and
+ * stylesheets referenced from it. References outside the split
+ * points' common parent (typically the stylesheets in <head>) are
+ * shared by all parts. Everything is found in a single walk over
+ * the document before splitting: as the split points are visited
+ * in document order, each reference below the common parent
+ * belongs to the part started by the last split point seen.
+ *
+ * The dependency file is JSON of the following form:
+ *
+ *   {"version":1,
+ *    "parts":{
+ *      "0000.html":[{"href":"style.css","as":"style"},...],
+ *      ...}}
+ *
+ * listing the shared resources first and then those of the part,
+ * with URLs as they appear in the part. */
+
+enum resourcekind {
+    RESOURCE_IMAGE = 0,
+    RESOURCE_SCRIPT,
+    RESOURCE_STYLE
+};
+
+static const char* const s_kind_names[] = {"image", "script", "style"};
+
+struct ResourceRef {
+    int part;       /*< Part number, -1 if shared by all parts */
+    int kind;       /*< One of the `resourcekind` enum values */
+    size_t href;    /*< Offset of the URL in the string pool */
+};
+
+struct Resources {
+    struct ResourceRef* p_refs; /*< Shared references first, then the parts' in part order */
+    int num_refs;
+    int num_shared;
+    int* p_part_start;          /*< Index of the first reference of each part, plus one past the last */
+    char* p_pool;
+    size_t pool_size;
+    size_t pool_capacity;
+    FILE* p_depsfile;
+    bool deps_written;          /*< Whether an entry was written to `p_depsfile` yet */
+    xmlNodePtr* p_hint_nodes;   /*< <link> elements added to the current part */
+    int num_hint_nodes;
+};
+
+static void scan_node(struct Resources* p_res, struct ResourceRef** pp_shared, int* p_num_shared, xmlNodePtr p_node,
+                      xmlNodePtr p_common_parent, xmlNodeSetPtr p_splitpoints, int* p_part, bool inside);
+static void add_ref(struct Resources* p_res, struct ResourceRef** pp_refs, int* p_num_refs, int first, int part, int kind, const xmlChar* href);
+static void write_dep(struct Resources* p_res, struct ResourceRef* p_ref, bool comma);
+static bool has_rel(xmlNodePtr p_node, const char* rel);
+static xmlNodePtr find_head(struct Splitter* p_splitter);
+static void add_hint(struct Splitter* p_splitter, xmlNodePtr p_head, const char* rel, const char* href, const char* as);
+static void append_hint(struct Splitter* p_splitter, const char* rel, const char* href, const char* as);
+
+/**
+ * Whether resource hints or a dependency file were requested.
+ */
+bool splitter_resources_wanted(struct Splitter* p_splitter)
+{
+    return p_splitter->resourcehints >= 0 || strlen(p_splitter->depsfile) > 0;
+}
+
+/**
+ * Find the resources referenced from the document and assign them
+ * to the parts delimited by `p_splitpoints`, of which there are
+ * `total`. Also opens the dependency file, if one was requested.
+ */
+void splitter_scan_resources(struct Splitter* p_splitter, xmlNodeSetPtr p_splitpoints, int total)
+{
+    struct Resources* p_res = NULL;
+    struct ResourceRef* p_shared = NULL;
+    xmlNodePtr p_common_parent = NULL;
+    int num_shared = 0;
+    int part = 0;
+    int i = 0;
+
+    p_res = (struct Resources*) xmlMalloc(sizeof(struct Resources));
+    if (!p_res) {
+        perror("Failed to allocate resource list");
+        exit(ERR_MEM);
+    }
+    memset(p_res, '\0', sizeof(struct Resources));
+
+    if (p_splitpoints && p_splitpoints->nodeNr > 0)
+        p_common_parent = p_splitpoints->nodeTab[0]->parent;
+
+    scan_node(p_res, &p_shared, &num_shared, xmlDocGetRootElement(p_splitter->p_document), p_common_parent, p_splitpoints, &part, false);
+
+    /* Put the shared references in front */
+    p_res->p_refs = (struct ResourceRef*) xmlRealloc(p_res->p_refs, (p_res->num_refs + num_shared + 1) * sizeof(struct ResourceRef));
+    if (!p_res->p_refs) {
+        perror("Failed to allocate resource list");
+        exit(ERR_MEM);
+    }
+    memmove(p_res->p_refs + num_shared, p_res->p_refs, p_res->num_refs * sizeof(struct ResourceRef));
+    if (num_shared > 0)
+        memcpy(p_res->p_refs, p_shared, num_shared * sizeof(struct ResourceRef));
+    p_res->num_refs  += num_shared;
+    p_res->num_shared = num_shared;
+    xmlFree(p_shared);
+
+    /* Index the parts */
+    p_res->p_part_start = (int*) xmlMalloc((total + 2) * sizeof(int));
+    if (!p_res->p_part_start) {
+        perror("Failed to allocate resource list");
+        exit(ERR_MEM);
+    }
+
+    part = 0;
+    for(i = num_shared; i <= p_res->num_refs; i++) {
+        while (part <= total && (i == p_res->num_refs || p_res->p_refs[i].part >= part))
+            p_res->p_part_start[part++] = i;
+    }
+    p_res->p_part_start[total + 1] = p_res->num_refs;
+
+    verbprintf("Found %d resource references, %d of them shared by all parts.\n", p_res->num_refs, num_shared);
+
+    if (strlen(p_splitter->depsfile) > 0) {
+        p_res->p_depsfile = fopen(p_splitter->depsfile, "w");
+        if (!p_res->p_depsfile) {
+            int errsav = errno;
+            fprintf(stderr, "Failed to open file '%s': %s\n", p_splitter->depsfile, strerror(errsav));
+            exit(ERR_IO);
+        }
+
+        verbprintf("Writing resource dependencies to '%s'.\n", p_splitter->depsfile);
+        fprintf(p_res->p_depsfile, "{\"version\":1,\"parts\":{");
+    }
+
+    p_splitter->p_resources = p_res;
+}
+
+/**
+ * Add <link rel="preload"> elements for the first `resourcehints`
+ * resources of part number `index` and a <link rel="prefetch">
+ * for the next part to the document's <head>. They are removed
+ * again by splitter_remove_resource_hints().
+ */
+void splitter_add_resource_hints(struct Splitter* p_splitter, int index, int total)
+{
+    struct Resources* p_res = p_splitter->p_resources;
+    xmlNodePtr p_head = find_head(p_splitter);
+    int i = 0;
+
+    if (!p_res || !p_head || p_splitter->resourcehints < 0)
+        return;
+
+    p_res->p_hint_nodes = (xmlNodePtr*) xmlMalloc((p_splitter->resourcehints + 1) * sizeof(xmlNodePtr));
+    if (!p_res->p_hint_nodes) {
+        perror("Failed to allocate memory for resource hints");
+        exit(ERR_MEM);
+    }
+
+    for(i = p_res->p_part_start[index]; i < p_res->p_part_start[index + 1] && p_res->num_hint_nodes < p_splitter->resourcehints; i++) {
+        struct ResourceRef* p_ref = &p_res->p_refs[i];
+        add_hint(p_splitter, p_head, "preload", p_res->p_pool + p_ref->href, s_kind_names[p_ref->kind]);
+    }
+
+    if (index < total) {
+        char href[PATH_MAX];
+
+        memset(href, '\0', PATH_MAX);
+        splitter_part_href(p_splitter, index + 1, href);
+        add_hint(p_splitter, p_head, "prefetch", href, NULL);
+    }
+}
+
+/**
+ * Remove the elements added by splitter_add_resource_hints()
+ * from the document again and free them.
+ */
+void splitter_remove_resource_hints(struct Splitter* p_splitter)
+{
+    struct Resources* p_res = p_splitter->p_resources;
+    int i = 0;
+
+    if (!p_res)
+        return;
+
+    for(i=0; i < p_res->num_hint_nodes; i++) {
+        xmlUnlinkNode(p_res->p_hint_nodes[i]);
+        xmlFreeNode(p_res->p_hint_nodes[i]);
+    }
+
+    xmlFree(p_res->p_hint_nodes);
+    p_res->p_hint_nodes   = NULL;
+    p_res->num_hint_nodes = 0;
+}
+
+/**
+ * Same as splitter_add_resource_hints(), but appending the
+ * elements as text to the output buffer, for templates.
+ */
+void splitter_append_resource_hints(struct Splitter* p_splitter, int index, int total)
+{
+    struct Resources* p_res = p_splitter->p_resources;
+    int count = 0;
+    int i = 0;
+
+    if (!p_res || p_splitter->resourcehints < 0)
+        return;
+
+    for(i = p_res->p_part_start[index]; i < p_res->p_part_start[index + 1] && count < p_splitter->resourcehints; i++, count++) {
+        struct ResourceRef* p_ref = &p_res->p_refs[i];
+        append_hint(p_splitter, "preload", p_res->p_pool + p_ref->href, s_kind_names[p_ref->kind]);
+    }
+
+    if (index < total) {
+        char href[PATH_MAX];
+
+        memset(href, '\0', PATH_MAX);
+        splitter_part_href(p_splitter, index + 1, href);
+        append_hint(p_splitter, "prefetch", href, NULL);
+    }
+}
+
+/**
+ * Add the entry for part number `index` to the dependency
+ * file, if one is written.
+ */
+void splitter_write_part_deps(struct Splitter* p_splitter, int index)
+{
+    struct Resources* p_res = p_splitter->p_resources;
+    char path[PATH_MAX];
+    int i = 0;
+
+    if (!p_res || !p_res->p_depsfile)
+        return;
+
+    memset(path, '\0', PATH_MAX);
+    splitter_part_path(p_splitter, index, path);
+
+    if (p_res->deps_written)
+        fputc(',', p_res->p_depsfile);
+    p_res->deps_written = true;
+
+    splitter_write_json_string(p_res->p_depsfile, path);
+    fputs(":[", p_res->p_depsfile);
+
+    for(i=0; i < p_res->num_shared; i++)
+        write_dep(p_res, &p_res->p_refs[i], i > 0);
+
+    for(i = p_res->p_part_start[index]; i < p_res->p_part_start[index + 1]; i++)
+        write_dep(p_res, &p_res->p_refs[i], p_res->num_shared > 0 || i > p_res->p_part_start[index]);
+
+    fputc(']', p_res->p_depsfile);
+}
+
+/**
+ * Finish the dependency file and free the resource list.
+ */
+void splitter_free_resources(struct Splitter* p_splitter)
+{
+    struct Resources* p_res = p_splitter->p_resources;
+
+    if (!p_res)
+        return;
+
+    splitter_remove_resource_hints(p_splitter);
+
+    if (p_res->p_depsfile) {
+        fprintf(p_res->p_depsfile, "}}\n");
+        splitter_close_file(p_splitter, p_res->p_depsfile, p_splitter->depsfile);
+    }
+
+    xmlFree(p_res->p_refs);
+    xmlFree(p_res->p_part_start);
+    xmlFree(p_res->p_pool);
+    xmlFree(p_res);
+
+    p_splitter->p_resources = NULL;
+}
+
+/* Collect the references in `p_node`, its following siblings, and
+ * their descendants. `*p_part` is the number of the part the walk
+ * is in, which advances with every split point passed. */
+void scan_node(struct Resources* p_res, struct ResourceRef** pp_shared, int* p_num_shared, xmlNodePtr p_node,
+               xmlNodePtr p_common_parent, xmlNodeSetPtr p_splitpoints, int* p_part, bool inside)
+{
+    for (; p_node; p_node = p_node->next) {
+        xmlChar* href = NULL;
+        int kind = -1;
+
+        if (p_node->type != XML_ELEMENT_NODE)
+            continue;
+
+        if (inside && *p_part < p_splitpoints->nodeNr && p_node == p_splitpoints->nodeTab[*p_part])
+            (*p_part)++;
+
+        if (xmlStrcasecmp(p_node->name, BAD_CAST("img")) == 0) {
+            href = xmlGetProp(p_node, BAD_CAST("src"));
+            kind = RESOURCE_IMAGE;
+        }
+        else if (xmlStrcasecmp(p_node->name, BAD_CAST("script")) == 0) {
+            href = xmlGetProp(p_node, BAD_CAST("src"));
+            kind = RESOURCE_SCRIPT;
+        }
+        else if (xmlStrcasecmp(p_node->name, BAD_CAST("link")) == 0 && has_rel(p_node, "stylesheet") && !has_rel(p_node, "alternate")) {
+            href = xmlGetProp(p_node, BAD_CAST("href"));
+            kind = RESOURCE_STYLE;
+        }
+
+        if (href && *href) {
+            if (inside)
+                add_ref(p_res, &p_res->p_refs, &p_res->num_refs, 0, *p_part, kind, href);
+            else
+                add_ref(p_res, pp_shared, p_num_shared, 0, -1, kind, href);
+        }
+        xmlFree(href);
+
+        scan_node(p_res, pp_shared, p_num_shared, p_node->children, p_common_parent, p_splitpoints, p_part,
+                  inside || p_node == p_common_parent);
+    }
+}
+
+/* Append a reference to `*pp_refs`, unless the same URL is already
+ * listed from index `first` on (the refs of the same part). */
+void add_ref(struct Resources* p_res, struct ResourceRef** pp_refs, int* p_num_refs, int first, int part, int kind, const xmlChar* href)
+{
+    size_t len = xmlStrlen(href) + 1;
+    int i = 0;
+
+    /* Refs of the current part are at the end */
+    for(i = *p_num_refs - 1; i >= first && (*pp_refs)[i].part == part; i--) {
+        if (strcmp(p_res->p_pool + (*pp_refs)[i].href, (const char*) href) == 0)
+            return;
+    }
+
+    if ((*p_num_refs & (*p_num_refs - 1)) == 0) { /* Power of two: full */
+        *pp_refs = (struct ResourceRef*) xmlRealloc(*pp_refs, (*p_num_refs ? *p_num_refs * 2 : 1) * sizeof(struct ResourceRef));
+        if (!*pp_refs) {
+            perror("Failed to allocate resource list");
+            exit(ERR_MEM);
+        }
+    }
+
+    if (p_res->pool_size + len > p_res->pool_capacity) {
+        while (p_res->pool_size + len > p_res->pool_capacity)
+            p_res->pool_capacity = p_res->pool_capacity ? p_res->pool_capacity * 2 : 4096;
+
+        p_res->p_pool = (char*) xmlRealloc(p_res->p_pool, p_res->pool_capacity);
+        if (!p_res->p_pool) {
+            perror("Failed to allocate resource list");
+            exit(ERR_MEM);
+        }
+    }
+
+    memcpy(p_res->p_pool + p_res->pool_size, href, len);
+
+    (*pp_refs)[*p_num_refs].part = part;
+    (*pp_refs)[*p_num_refs].kind = kind;
+    (*pp_refs)[*p_num_refs].href = p_res->pool_size;
+    (*p_num_refs)++;
+
+    p_res->pool_size += len;
+}
+
+void write_dep(struct Resources* p_res, struct ResourceRef* p_ref, bool comma)
+{
+    if (comma)
+        fputc(',', p_res->p_depsfile);
+
+    fputs("{\"href\":", p_res->p_depsfile);
+    splitter_write_json_string(p_res->p_depsfile, p_res->p_pool + p_ref->href);
+    fprintf(p_res->p_depsfile, ",\"as\":\"%s\"}", s_kind_names[p_ref->kind]);
+}
+
+/* Whether the whitespace-separated "rel" attribute contains `rel` */
+bool has_rel(xmlNodePtr p_node, const char* rel)
+{
+    xmlChar* value = xmlGetProp(p_node, BAD_CAST("rel"));
+    const xmlChar* p_char = value;
+    size_t len = strlen(rel);
+    bool found = false;
+
+    while (p_char && *p_char && !found) {
+        while (*p_char == ' ' || *p_char == '\t' || *p_char == '\n')
+            p_char++;
+
+        found = xmlStrncasecmp(p_char, BAD_CAST(rel), len) == 0 && (p_char[len] == '\0' || p_char[len] == ' ' || p_char[len] == '\t' || p_char[len] == '\n');
+
+        while (*p_char && *p_char != ' ' && *p_char != '\t' && *p_char != '\n')
+            p_char++;
+    }
+
+    xmlFree(value);
+    return found;
+}
+
+xmlNodePtr find_head(struct Splitter* p_splitter)
+{
+    xmlNodePtr p_node = xmlDocGetRootElement(p_splitter->p_document);
+
+    for (p_node = p_node ? xmlFirstElementChild(p_node) : NULL; p_node; p_node = xmlNextElementSibling(p_node)) {
+        if (xmlStrcasecmp(p_node->name, BAD_CAST("head")) == 0)
+            return p_node;
+    }
+
+    return NULL;
+}
+
+void add_hint(struct Splitter* p_splitter, xmlNodePtr p_head, const char* rel, const char* href, const char* as)
+{
+    struct Resources* p_res = p_splitter->p_resources;
+    xmlNodePtr p_link = xmlNewChild(p_head, NULL, BAD_CAST("link"), NULL);
+
+    xmlNewProp(p_link, BAD_CAST("rel"), BAD_CAST(rel));
+    xmlNewProp(p_link, BAD_CAST("href"), BAD_CAST(href));
+    if (as)
+        xmlNewProp(p_link, BAD_CAST("as"), BAD_CAST(as));
+
+    p_res->p_hint_nodes[p_res->num_hint_nodes++] = p_link;
+}
+
+void append_hint(struct Splitter* p_splitter, const char* rel, const char* href, const char* as)
+{
+    splitter_out_append(p_splitter, "<link rel=\"", 11);
+    splitter_out_append(p_splitter, rel, strlen(rel));
+    splitter_out_append(p_splitter, "\" href=\"", 8);
+    splitter_out_append_escaped(p_splitter, BAD_CAST(href), true);
+    if (as) {
+        splitter_out_append(p_splitter, "\" as=\"", 6);
+        splitter_out_append(p_splitter, as, strlen(as));
+    }
+    splitter_out_append(p_splitter, "\">", 2);
+}
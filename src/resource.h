@@ -0,0 +1,14 @@
+#ifndef HTMLSPLIT_RESOURCE_H
+#define HTMLSPLIT_RESOURCE_H
+
+struct Resources; /* opaque; see resource.c */
+
+bool splitter_resources_wanted(struct Splitter* p_splitter); /*< \private */
+void splitter_scan_resources(struct Splitter* p_splitter, xmlNodeSetPtr p_splitpoints, int total); /*< \private */
+void splitter_add_resource_hints(struct Splitter* p_splitter, int index, int total); /*< \private */
+void splitter_remove_resource_hints(struct Splitter* p_splitter); /*< \private */
+void splitter_append_resource_hints(struct Splitter* p_splitter, int index, int total); /*< \private */
+void splitter_write_part_deps(struct Splitter* p_splitter, int index); /*< \private */
+void splitter_free_resources(struct Splitter* p_splitter); /*< \private */
+
+#endif
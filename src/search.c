@@ -0,0 +1,732 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <libxml/tree.h>
+#include <libxml/HTMLparser.h>
+#include <libxml/parserInternals.h>
+#include "split.h"
+#include "search.h"
+#include "layout.h"
+#include "toc.h"
+#include "governor.h"
+#include "writer.h"
+#include "verbose.h"
+
+/* The search index is a JSON file of the following form:
+ *
+ *   {"version":1,
+ *    "parts":["0000.html","0001.html",...],
+ *    "terms":{
+ *      "TERM":{"p":[[PART,FREQ],...],"a":[[PART,"ANCHOR"],...]},
+ *      ...}}
+ *
+ * "parts" lists the part files relative to the output directory;
+ * PART is an index into this list. Terms are sorted bytewise and
+ * map to the parts containing them along with the number of
+ * occurrences in that part ("p"), and to the anchors of all
+ * headings containing them ("a"). Either list may be missing.
+ *
+ * Terms are runs of letters and digits, see is_term_char(). ASCII,
+ * Latin-1 and Latin Extended-A letters are converted to lower case.
+ * Terms shorter than SEARCH_MIN_TERMLEN bytes are ignored, longer
+ * ones than SEARCH_MAX_TERMLEN bytes are truncated after the last
+ * whole character that fits.
+ *
+ * To keep memory usage bounded, postings are collected for a
+ * while, then sorted and written to a temporary file (a "run").
+ * Whenever SEARCH_MERGE_FANIN runs of the same level exist, they
+ * are merged into one run of the next level, so the number of
+ * open runs only grows with the logarithm of the index size.
+ * When all parts are processed, the remaining runs are merged
+ * into the final index file. */
+
+#define SEARCH_MIN_TERMLEN   2
+#define SEARCH_MAX_TERMLEN   64
+#define SEARCH_MAX_ANCHORLEN 1024
+#define SEARCH_RUN_POSTINGS  (1 << 16)   /* postings per run */
+#define SEARCH_POOL_SIZE     (2 << 20)   /* bytes of term strings per run */
+#define SEARCH_MERGE_FANIN   16          /* runs merged into one at a time */
+
+enum postingkind {
+    POSTING_PART = 0,
+    POSTING_ANCHOR
+};
+
+struct Posting {
+    size_t term;   /*< Offset of the term in the string pool */
+    size_t anchor; /*< Offset of the anchor in the string pool (anchor postings only) */
+    int kind;
+    int part;
+    int freq;
+};
+
+/**
+ * Posting as stored in a run file.
+ */
+struct RunRecord {
+    char term[SEARCH_MAX_TERMLEN + 1];
+    char anchor[SEARCH_MAX_ANCHORLEN + 1];
+    int kind;
+    int part;
+    int freq;
+};
+
+/**
+ * State of a k-way merge of runs. The runs with records left
+ * are kept in a min-heap ordered by their current record.
+ */
+struct RunMerge {
+    FILE** p_runs;
+    struct RunRecord* p_heads; /*< Current record of each run */
+    int* p_heap;               /*< Indices into `p_runs` */
+    int heapsize;
+    struct RunRecord pending;  /*< Combined record not yet returned */
+    bool has_pending;
+};
+
+struct SearchIndex {
+    FILE* p_outfile;
+    FILE** p_runs;
+    int* p_levels;             /*< Merge level of each run; never increasing along `p_runs` */
+    int num_runs;
+    struct Posting* p_postings;
+    int num_postings;
+    char* p_pool;
+    size_t poolsize;
+};
+
+static const char* s_sortpool = NULL; /* For compare_postings(), qsort() has no context argument */
+static pthread_mutex_t s_sortmutex = PTHREAD_MUTEX_INITIALIZER; /* Guards `s_sortpool` when variants are split in parallel */
+
+static void index_node(struct SearchIndex* p_index, struct Splitter* p_splitter, xmlNodePtr p_node, int part, const char* anchor);
+static void index_text(struct SearchIndex* p_index, const xmlChar* text, int part, const char* anchor);
+static bool is_term_char(int cp);
+static int fold_case(int cp);
+static void add_posting(struct SearchIndex* p_index, const char* term, int kind, int part, const char* anchor);
+static void flush_run(struct SearchIndex* p_index);
+static void merge_level(struct SearchIndex* p_index, int first);
+static void merge_init(struct RunMerge* p_merge, FILE** p_runs, int num_runs);
+static bool merge_next(struct RunMerge* p_merge, struct RunRecord* p_record);
+static void merge_free(struct RunMerge* p_merge);
+static void sift_down(struct RunMerge* p_merge, int pos);
+static int compare_postings(const void* p_a, const void* p_b);
+static int compare_records(const struct RunRecord* p_a, const struct RunRecord* p_b);
+static void write_record(FILE* p_file, const struct RunRecord* p_record);
+static bool read_record(FILE* p_file, struct RunRecord* p_record);
+static void emit_record(FILE* p_file, const struct RunRecord* p_record, char* curterm, int* p_curkind);
+
+/**
+ * Start a search index for a document with `total` split
+ * points. The index file named by the `searchindex` member
+ * of `p_splitter` is opened and its header is written.
+ */
+struct SearchIndex* splitter_search_new(struct Splitter* p_splitter, int total)
+{
+    struct SearchIndex* p_index = NULL;
+    char path[PATH_MAX];
+    int i = 0;
+
+    p_index = (struct SearchIndex*) xmlMalloc(sizeof(struct SearchIndex));
+    if (!p_index) {
+        perror("Failed to allocate search index");
+        exit(ERR_MEM);
+    }
+
+    memset(p_index, '\0', sizeof(struct SearchIndex));
+
+    p_index->p_postings = (struct Posting*) xmlMalloc(SEARCH_RUN_POSTINGS * sizeof(struct Posting));
+    p_index->p_pool     = (char*) xmlMalloc(SEARCH_POOL_SIZE);
+    if (!p_index->p_postings || !p_index->p_pool) {
+        perror("Failed to allocate search index buffers");
+        exit(ERR_MEM);
+    }
+
+    p_index->p_outfile = fopen(p_splitter->searchindex, "w");
+    if (!p_index->p_outfile) {
+        int errsav = errno;
+        fprintf(stderr, "Failed to open file '%s': %s\n", p_splitter->searchindex, strerror(errsav));
+        exit(ERR_IO);
+    }
+
+    verbprintf("Writing search index to '%s'.\n", p_splitter->searchindex);
+
+    fprintf(p_index->p_outfile, "{\"version\":1,\"parts\":[");
+    for(i=0; i <= total; i++) {
+        splitter_part_path(p_splitter, i, path);
+
+        if (i > 0)
+            fputc(',', p_index->p_outfile);
+        splitter_write_json_string(p_index->p_outfile, path);
+    }
+    fprintf(p_index->p_outfile, "],\"terms\":{");
+
+    return p_index;
+}
+
+/**
+ * Free a search index without writing it out.
+ */
+void splitter_search_free(struct SearchIndex* p_index)
+{
+    int i = 0;
+
+    if (!p_index)
+        return;
+
+    for(i=0; i < p_index->num_runs; i++)
+        fclose(p_index->p_runs[i]);
+
+    if (p_index->p_outfile)
+        fclose(p_index->p_outfile);
+
+    xmlFree(p_index->p_runs);
+    xmlFree(p_index->p_levels);
+    xmlFree(p_index->p_postings);
+    xmlFree(p_index->p_pool);
+    xmlFree(p_index);
+}
+
+/**
+ * To be called during the splitting process while the document
+ * only contains the part with number `index`. Collects the
+ * postings for all text below the element children of
+ * `p_parent_node`, i.e. the part’s content.
+ */
+void splitter_search_index_part(struct Splitter* p_splitter, xmlNodePtr p_parent_node, int index)
+{
+    struct SearchIndex* p_index = p_splitter->p_searchindex;
+    xmlNodePtr p_node = NULL;
+
+    /* Single-part document */
+    if (!p_parent_node)
+        p_parent_node = xmlDocGetRootElement(p_splitter->p_document);
+
+    verbprintf("Indexing part %d for search.\n", index);
+
+    for (p_node = xmlFirstElementChild(p_parent_node); p_node; p_node = xmlNextElementSibling(p_node))
+        index_node(p_index, p_splitter, p_node, index, NULL);
+
+    /* Don’t hold on to the postings when memory is scarce */
+    if (governor_pressure() >= GOV_PRESSURE_HIGH && p_index->num_postings > 0)
+        flush_run(p_index);
+}
+
+/**
+ * Merge all collected postings into the index file, close
+ * it, and free the search index.
+ */
+void splitter_search_finish(struct Splitter* p_splitter)
+{
+    struct SearchIndex* p_index = p_splitter->p_searchindex;
+    struct RunMerge merge;
+    struct RunRecord record;
+    char curterm[SEARCH_MAX_TERMLEN + 1];
+    int curkind = -1;
+
+    if (p_index->num_postings > 0)
+        flush_run(p_index);
+
+    verbprintf("Merging %d search index runs.\n", p_index->num_runs);
+
+    memset(curterm, '\0', sizeof(curterm));
+
+    merge_init(&merge, p_index->p_runs, p_index->num_runs);
+    while (merge_next(&merge, &record))
+        emit_record(p_index->p_outfile, &record, curterm, &curkind);
+    merge_free(&merge);
+
+    if (curkind >= 0)
+        fprintf(p_index->p_outfile, "]}");
+    fprintf(p_index->p_outfile, "}}\n");
+
+    splitter_close_file(p_splitter, p_index->p_outfile, p_splitter->searchindex);
+    p_index->p_outfile = NULL;
+
+    splitter_search_free(p_index);
+    p_splitter->p_searchindex = NULL;
+}
+
+void index_node(struct SearchIndex* p_index, struct Splitter* p_splitter, xmlNodePtr p_node, int part, const char* anchor)
+{
+    xmlChar* heading_anchor = NULL;
+    xmlNodePtr p_child = NULL;
+
+    if (xmlStrcasecmp(p_node->name, BAD_CAST("script")) == 0 || xmlStrcasecmp(p_node->name, BAD_CAST("style")) == 0)
+        return;
+
+    /* Terms in headings additionally point to the heading’s anchor */
+    if (p_node->name[0] == 'h' && p_node->name[1] >= '1' && p_node->name[1] <= '6' && p_node->name[2] == '\0') {
+        heading_anchor = splitter_detect_target_anchor(p_splitter, p_node);
+
+        if (heading_anchor && xmlStrlen(heading_anchor) <= SEARCH_MAX_ANCHORLEN)
+            anchor = (const char*) heading_anchor;
+    }
+
+    for (p_child = p_node->children; p_child; p_child = p_child->next) {
+        if (p_child->type == XML_TEXT_NODE || p_child->type == XML_CDATA_SECTION_NODE)
+            index_text(p_index, p_child->content, part, anchor);
+        else if (p_child->type == XML_ELEMENT_NODE)
+            index_node(p_index, p_splitter, p_child, part, anchor);
+    }
+
+    xmlFree(heading_anchor);
+}
+
+void index_text(struct SearchIndex* p_index, const xmlChar* text, int part, const char* anchor)
+{
+    const xmlChar* p_char = text;
+    char term[SEARCH_MAX_TERMLEN + 1];
+
+    if (!text)
+        return;
+
+    while (*p_char) {
+        int len = 0;
+        int cp = 0;
+        int size = 0;
+
+        /* Skip to the next term; invalid UTF-8 separates terms, too */
+        while (*p_char) {
+            size = 4;
+            cp   = xmlGetUTF8Char(p_char, &size);
+            if (cp >= 0 && is_term_char(cp))
+                break;
+
+            p_char += cp >= 0 ? size : 1;
+        }
+
+        while (*p_char) {
+            xmlChar utf8[4];
+            int utf8len = 0;
+
+            size = 4;
+            cp   = xmlGetUTF8Char(p_char, &size);
+            if (cp < 0 || !is_term_char(cp))
+                break;
+
+            /* Characters not fitting anymore are dropped whole */
+            utf8len = xmlCopyCharMultiByte(utf8, fold_case(cp));
+            if (len + utf8len <= SEARCH_MAX_TERMLEN) {
+                memcpy(term + len, utf8, utf8len);
+                len += utf8len;
+            }
+
+            p_char += size;
+        }
+
+        if (len < SEARCH_MIN_TERMLEN)
+            continue;
+
+        term[len] = '\0';
+        add_posting(p_index, term, POSTING_PART, part, NULL);
+
+        if (anchor)
+            add_posting(p_index, term, POSTING_ANCHOR, part, anchor);
+    }
+}
+
+/* Whether the code point `cp` is part of a term. Apart from ASCII
+ * punctuation, the Unicode blocks of spaces, punctuation, and
+ * symbols common in text separate terms, while everything else
+ * (letters, digits, combining marks, ideographs) makes them up. */
+bool is_term_char(int cp)
+{
+    if (cp < 0x80)
+        return (cp >= '0' && cp <= '9') || (cp >= 'A' && cp <= 'Z') || (cp >= 'a' && cp <= 'z');
+
+    /* C1 controls, NBSP, and Latin-1 punctuation and signs, except ª µ º */
+    if (cp <= 0xBF)
+        return cp == 0xAA || cp == 0xB5 || cp == 0xBA;
+
+    if (cp == 0xD7 || cp == 0xF7) /* × ÷ */
+        return false;
+
+    return !(cp == 0x1680                          /* Ogham space */
+             || (cp >= 0x2000 && cp <= 0x206F)     /* General Punctuation: spaces, dashes, quotes */
+             || (cp >= 0x20A0 && cp <= 0x20CF)     /* Currency Symbols */
+             || (cp >= 0x2190 && cp <= 0x2BFF)     /* Arrows, mathematical and technical symbols, shapes */
+             || (cp >= 0x2E00 && cp <= 0x2E7F)     /* Supplemental Punctuation */
+             || (cp >= 0x3000 && cp <= 0x303F)     /* CJK Symbols and Punctuation */
+             || (cp >= 0xFE10 && cp <= 0xFE1F)     /* Vertical Forms */
+             || (cp >= 0xFE30 && cp <= 0xFE6F)     /* CJK Compatibility and Small Form Variants */
+             || cp == 0xFEFF                       /* Byte order mark */
+             || (cp >= 0xFF01 && cp <= 0xFF0F) || (cp >= 0xFF1A && cp <= 0xFF20)
+             || (cp >= 0xFF3B && cp <= 0xFF40) || (cp >= 0xFF5B && cp <= 0xFF65) /* Fullwidth punctuation */
+             || (cp >= 0xFFF0 && cp <= 0xFFFF)     /* Specials */
+             || (cp >= 0x1F000 && cp <= 0x1FAFF)); /* Emoji and other pictographs */
+}
+
+/* Lower case of `cp` for ASCII, Latin-1, and Latin Extended-A; any
+ * other code point is returned as is. Independent of the locale. */
+int fold_case(int cp)
+{
+    if (cp >= 'A' && cp <= 'Z')
+        return cp + 0x20;
+    if (cp >= 0xC0 && cp <= 0xDE && cp != 0xD7)
+        return cp + 0x20;
+    if (cp == 0x130) /* İ */
+        return 'i';
+    if (cp == 0x178) /* Ÿ */
+        return 0xFF;
+
+    /* Pairs of upper and lower case letters; ı ĸ ŉ ſ have no upper case here */
+    if ((cp >= 0x100 && cp <= 0x137) || (cp >= 0x14A && cp <= 0x177))
+        return cp | 1;
+    if (((cp >= 0x139 && cp <= 0x148) || (cp >= 0x179 && cp <= 0x17E)) && (cp & 1))
+        return cp + 1;
+
+    return cp;
+}
+
+void add_posting(struct SearchIndex* p_index, const char* term, int kind, int part, const char* anchor)
+{
+    struct Posting* p_posting = NULL;
+    size_t termlen = strlen(term) + 1;
+    size_t anchorlen = anchor ? strlen(anchor) + 1 : 0;
+
+    if (p_index->num_postings == SEARCH_RUN_POSTINGS || p_index->poolsize + termlen + anchorlen > SEARCH_POOL_SIZE)
+        flush_run(p_index);
+
+    p_posting = &p_index->p_postings[p_index->num_postings++];
+    p_posting->kind = kind;
+    p_posting->part = part;
+    p_posting->freq = 1;
+
+    p_posting->term = p_index->poolsize;
+    memcpy(p_index->p_pool + p_index->poolsize, term, termlen);
+    p_index->poolsize += termlen;
+
+    if (anchor) {
+        p_posting->anchor = p_index->poolsize;
+        memcpy(p_index->p_pool + p_index->poolsize, anchor, anchorlen);
+        p_index->poolsize += anchorlen;
+    }
+}
+
+/* Sort the collected postings and write them out as a new run,
+ * combining equal postings into one with their frequencies summed. */
+void flush_run(struct SearchIndex* p_index)
+{
+    FILE* p_run = NULL;
+    FILE** p_runs = NULL;
+    int* p_levels = NULL;
+    struct RunRecord record;
+    struct RunRecord next;
+    int i = 0;
+
+    verbprintf("Writing search index run with %d postings.\n", p_index->num_postings);
+
+    p_run = tmpfile();
+    if (!p_run) {
+        perror("Failed to create temporary file for the search index");
+        exit(ERR_IO);
+    }
+
+    p_runs = (FILE**) xmlRealloc(p_index->p_runs, (p_index->num_runs + 1) * sizeof(FILE*));
+    if (p_runs)
+        p_index->p_runs = p_runs;
+    p_levels = (int*) xmlRealloc(p_index->p_levels, (p_index->num_runs + 1) * sizeof(int));
+    if (p_levels)
+        p_index->p_levels = p_levels;
+    if (!p_runs || !p_levels) {
+        perror("Failed to allocate memory for search index runs");
+        exit(ERR_MEM);
+    }
+
+    pthread_mutex_lock(&s_sortmutex);
+    s_sortpool = p_index->p_pool;
+    qsort(p_index->p_postings, p_index->num_postings, sizeof(struct Posting), compare_postings);
+    pthread_mutex_unlock(&s_sortmutex);
+
+    for(i=0; i < p_index->num_postings; i++) {
+        struct Posting* p_posting = &p_index->p_postings[i];
+
+        strcpy(next.term, p_index->p_pool + p_posting->term);
+        strcpy(next.anchor, p_posting->kind == POSTING_ANCHOR ? p_index->p_pool + p_posting->anchor : "");
+        next.kind = p_posting->kind;
+        next.part = p_posting->part;
+        next.freq = p_posting->freq;
+
+        if (i > 0 && compare_records(&record, &next) == 0) {
+            record.freq += next.freq;
+        }
+        else {
+            if (i > 0)
+                write_record(p_run, &record);
+            record = next;
+        }
+    }
+    if (p_index->num_postings > 0)
+        write_record(p_run, &record);
+
+    rewind(p_run);
+
+    p_index->p_runs[p_index->num_runs]   = p_run;
+    p_index->p_levels[p_index->num_runs] = 0;
+    p_index->num_runs++;
+    p_index->num_postings = 0;
+    p_index->poolsize     = 0;
+
+    /* As levels never increase along the list, the last runs
+     * all have the same level if the first and last of them do. */
+    while (p_index->num_runs >= SEARCH_MERGE_FANIN
+           && p_index->p_levels[p_index->num_runs - SEARCH_MERGE_FANIN] == p_index->p_levels[p_index->num_runs - 1])
+        merge_level(p_index, p_index->num_runs - SEARCH_MERGE_FANIN);
+}
+
+/* Merge the runs from index `first` to the last one into one
+ * run of the next level, which takes the place of `first`. */
+void merge_level(struct SearchIndex* p_index, int first)
+{
+    struct RunMerge merge;
+    struct RunRecord record;
+    FILE* p_run = NULL;
+    int i = 0;
+
+    verbprintf("Merging %d search index runs of level %d.\n", p_index->num_runs - first, p_index->p_levels[first]);
+
+    p_run = tmpfile();
+    if (!p_run) {
+        perror("Failed to create temporary file for the search index");
+        exit(ERR_IO);
+    }
+
+    merge_init(&merge, p_index->p_runs + first, p_index->num_runs - first);
+    while (merge_next(&merge, &record))
+        write_record(p_run, &record);
+    merge_free(&merge);
+
+    rewind(p_run);
+
+    for(i=first; i < p_index->num_runs; i++)
+        fclose(p_index->p_runs[i]);
+
+    p_index->p_runs[first] = p_run;
+    p_index->p_levels[first]++;
+    p_index->num_runs = first + 1;
+}
+
+/* Prepare merging the `num_runs` runs starting at `p_runs` */
+void merge_init(struct RunMerge* p_merge, FILE** p_runs, int num_runs)
+{
+    int i = 0;
+
+    memset(p_merge, '\0', sizeof(struct RunMerge));
+    p_merge->p_runs  = p_runs;
+    p_merge->p_heads = (struct RunRecord*) xmlMalloc((num_runs + 1) * sizeof(struct RunRecord));
+    p_merge->p_heap  = (int*) xmlMalloc((num_runs + 1) * sizeof(int));
+    if (!p_merge->p_heads || !p_merge->p_heap) {
+        perror("Failed to allocate memory for merging the search index");
+        exit(ERR_MEM);
+    }
+
+    for(i=0; i < num_runs; i++) {
+        if (read_record(p_runs[i], &p_merge->p_heads[i]))
+            p_merge->p_heap[p_merge->heapsize++] = i;
+    }
+
+    for(i=p_merge->heapsize / 2 - 1; i >= 0; i--)
+        sift_down(p_merge, i);
+}
+
+/* Get the next record of the merge into `p_record`. Records with
+ * the same key from different runs (a part spanning two runs) are
+ * combined. Returns false when all runs are exhausted. */
+bool merge_next(struct RunMerge* p_merge, struct RunRecord* p_record)
+{
+    while (p_merge->heapsize > 0) {
+        int run = p_merge->p_heap[0];
+        bool ready = false;
+
+        if (p_merge->has_pending && compare_records(&p_merge->pending, &p_merge->p_heads[run]) == 0) {
+            p_merge->pending.freq += p_merge->p_heads[run].freq;
+        }
+        else {
+            if (p_merge->has_pending) {
+                *p_record = p_merge->pending;
+                ready = true;
+            }
+
+            p_merge->pending     = p_merge->p_heads[run];
+            p_merge->has_pending = true;
+        }
+
+        if (!read_record(p_merge->p_runs[run], &p_merge->p_heads[run]))
+            p_merge->p_heap[0] = p_merge->p_heap[--p_merge->heapsize];
+        sift_down(p_merge, 0);
+
+        if (ready)
+            return true;
+    }
+
+    if (p_merge->has_pending) {
+        *p_record = p_merge->pending;
+        p_merge->has_pending = false;
+        return true;
+    }
+
+    return false;
+}
+
+void merge_free(struct RunMerge* p_merge)
+{
+    xmlFree(p_merge->p_heads);
+    xmlFree(p_merge->p_heap);
+}
+
+/* Restore the heap order from position `pos` downwards */
+void sift_down(struct RunMerge* p_merge, int pos)
+{
+    int* p_heap = p_merge->p_heap;
+
+    while (true) {
+        int child = 2 * pos + 1;
+        int tmp = 0;
+
+        if (child >= p_merge->heapsize)
+            break;
+
+        if (child + 1 < p_merge->heapsize
+            && compare_records(&p_merge->p_heads[p_heap[child + 1]], &p_merge->p_heads[p_heap[child]]) < 0)
+            child++;
+
+        if (compare_records(&p_merge->p_heads[p_heap[child]], &p_merge->p_heads[p_heap[pos]]) >= 0)
+            break;
+
+        tmp           = p_heap[pos];
+        p_heap[pos]   = p_heap[child];
+        p_heap[child] = tmp;
+        pos = child;
+    }
+}
+
+int compare_postings(const void* p_a, const void* p_b)
+{
+    const struct Posting* p_pa = (const struct Posting*) p_a;
+    const struct Posting* p_pb = (const struct Posting*) p_b;
+    int result = strcmp(s_sortpool + p_pa->term, s_sortpool + p_pb->term);
+
+    if (result != 0)
+        return result;
+    if (p_pa->kind != p_pb->kind)
+        return p_pa->kind - p_pb->kind;
+    if (p_pa->part != p_pb->part)
+        return p_pa->part - p_pb->part;
+    if (p_pa->kind == POSTING_ANCHOR)
+        return strcmp(s_sortpool + p_pa->anchor, s_sortpool + p_pb->anchor);
+
+    return 0;
+}
+
+int compare_records(const struct RunRecord* p_a, const struct RunRecord* p_b)
+{
+    int result = strcmp(p_a->term, p_b->term);
+
+    if (result != 0)
+        return result;
+    if (p_a->kind != p_b->kind)
+        return p_a->kind - p_b->kind;
+    if (p_a->part != p_b->part)
+        return p_a->part - p_b->part;
+
+    return strcmp(p_a->anchor, p_b->anchor);
+}
+
+/* Run file records: term length (1 byte), term, kind (1 byte),
+ * part and frequency (native ints), anchor length (2 bytes), anchor. */
+void write_record(FILE* p_file, const struct RunRecord* p_record)
+{
+    unsigned char termlen   = (unsigned char) strlen(p_record->term);
+    unsigned char kind      = (unsigned char) p_record->kind;
+    unsigned short anchorlen = (unsigned short) strlen(p_record->anchor);
+
+    fwrite(&termlen, 1, 1, p_file);
+    fwrite(p_record->term, 1, termlen, p_file);
+    fwrite(&kind, 1, 1, p_file);
+    fwrite(&p_record->part, sizeof(int), 1, p_file);
+    fwrite(&p_record->freq, sizeof(int), 1, p_file);
+    fwrite(&anchorlen, sizeof(unsigned short), 1, p_file);
+    fwrite(p_record->anchor, 1, anchorlen, p_file);
+}
+
+bool read_record(FILE* p_file, struct RunRecord* p_record)
+{
+    unsigned char termlen    = 0;
+    unsigned char kind       = 0;
+    unsigned short anchorlen = 0;
+
+    if (fread(&termlen, 1, 1, p_file) != 1)
+        return false;
+
+    fread(p_record->term, 1, termlen, p_file);
+    p_record->term[termlen] = '\0';
+
+    fread(&kind, 1, 1, p_file);
+    p_record->kind = kind;
+
+    fread(&p_record->part, sizeof(int), 1, p_file);
+    fread(&p_record->freq, sizeof(int), 1, p_file);
+
+    fread(&anchorlen, sizeof(unsigned short), 1, p_file);
+    fread(p_record->anchor, 1, anchorlen, p_file);
+    p_record->anchor[anchorlen] = '\0';
+
+    return true;
+}
+
+/* Write one posting into the JSON output. `curterm` and `p_curkind`
+ * track which term object and which list in it are open. */
+void emit_record(FILE* p_file, const struct RunRecord* p_record, char* curterm, int* p_curkind)
+{
+    if (*p_curkind < 0 || strcmp(curterm, p_record->term) != 0) {
+        if (*p_curkind >= 0)
+            fprintf(p_file, "]},");
+
+        fprintf(p_file, "\"%s\":{", p_record->term); /* Terms never need escaping */
+        strcpy(curterm, p_record->term);
+        *p_curkind = -1;
+    }
+
+    if (*p_curkind != p_record->kind) {
+        if (*p_curkind >= 0)
+            fprintf(p_file, "],");
+
+        fprintf(p_file, p_record->kind == POSTING_PART ? "\"p\":[" : "\"a\":[");
+        *p_curkind = p_record->kind;
+    }
+    else {
+        fputc(',', p_file);
+    }
+
+    if (p_record->kind == POSTING_PART) {
+        fprintf(p_file, "[%d,%d]", p_record->part, p_record->freq);
+    }
+    else {
+        fprintf(p_file, "[%d,", p_record->part);
+        splitter_write_json_string(p_file, p_record->anchor);
+        fputc(']', p_file);
+    }
+}
+
+/**
+ * Write `str` to `p_file` as a JSON string literal.
+ */
+void splitter_write_json_string(FILE* p_file, const char* str)
+{
+    const unsigned char* p_char = (const unsigned char*) str;
+
+    fputc('"', p_file);
+    for (; *p_char; p_char++) {
+        if (*p_char == '"' || *p_char == '\\')
+            fprintf(p_file, "\\%c", *p_char);
+        else if (*p_char < 0x20)
+            fprintf(p_file, "\\u%04x", *p_char);
+        else
+            fputc(*p_char, p_file);
+    }
+    fputc('"', p_file);
+}
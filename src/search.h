@@ -0,0 +1,12 @@
+#ifndef HTMLSPLIT_SEARCH_H
+#define HTMLSPLIT_SEARCH_H
+
+struct SearchIndex; /* opaque; see search.c */
+
+struct SearchIndex* splitter_search_new(struct Splitter* p_splitter, int total); /*< \private */
+void splitter_search_index_part(struct Splitter* p_splitter, xmlNodePtr p_parent_node, int index); /*< \private */
+void splitter_search_finish(struct Splitter* p_splitter); /*< \private */
+void splitter_search_free(struct SearchIndex* p_index); /*< \private */
+void splitter_write_json_string(FILE* p_file, const char* str); /*< \private */
+
+#endif
@@ -15,6 +15,17 @@
 #include "interlink.h"
 #include "toc.h"
 #include "io.h"
+#include "layout.h"
+#include "search.h"
+#include "dedup.h"
+#include "writer.h"
+#include "nodetable.h"
+#include "variant.h"
+#include "template.h"
+#include "resource.h"
+#include "watch.h"
+#include "governor.h"
+#include "trace.h"
 #include "verbose.h"
 
 /* The BAD_CAST() macro comes from libxml2 itself,
@@ -25,6 +36,9 @@ static void slice_following_nodes(struct Splitter* p_splitter, xmlNodePtr p_node
 static void slice_preceeding_nodes(struct Splitter* p_splitter, xmlNodePtr p_node);
 static void reinsert_following_nodes(struct Splitter* p_splitter, xmlNodePtr p_node);
 static void reinsert_preceeding_nodes(struct Splitter* p_splitter, xmlNodePtr p_node);
+static xmlNodePtr split_point(struct Splitter* p_splitter, xmlXPathObjectPtr p_results, int index);
+static xmlNodePtr next_element(struct Splitter* p_splitter, xmlNodePtr p_node);
+static xmlNodePtr prev_element(struct Splitter* p_splitter, xmlNodePtr p_node);
 
 /**
  * Create a new Splitter struct. The result must be
@@ -55,6 +69,12 @@ struct Splitter* splitter_new()
     strcpy(ptr->splitexpr, "//h1"); /* default split point xpath */
     strcpy(ptr->stdoutsep, "<!-- HTMLSPLIT -->"); /* default stdout split separator */
     strcpy(ptr->tocname, "Table of Contents");
+    strcpy(ptr->namepattern, "%d.html"); /* default part file names, automatic width */
+    ptr->shardmode            = SHARD_NONE;
+    ptr->parsethreads         = 1;
+    ptr->variantthreads       = 1;
+    ptr->resourcehints        = -1;
+    ptr->cachesize            = 256 * 1024 * 1024;
 
     return ptr;
 }
@@ -64,6 +84,17 @@ struct Splitter* splitter_new()
  */
 void splitter_free(struct Splitter* ptr)
 {
+    splitter_free_layout(ptr);
+    if (ptr->p_searchindex) /* Cut short; still leave a valid index of the parts done */
+        splitter_search_finish(ptr);
+    splitter_free_dedup(ptr);
+    splitter_free_outbuf(ptr);
+    splitter_free_node_table(ptr);
+    splitter_free_variants(ptr);
+    splitter_free_template(ptr);
+    splitter_free_resources(ptr);
+    splitter_free_writer(ptr); /* After all other output files are closed */
+    splitter_free_watch(ptr);
     xmlFreeDoc(ptr->p_document);
     free(ptr);
 }
@@ -80,17 +111,29 @@ void splitter_split_file(struct Splitter* p_splitter)
     handle_body(p_splitter);
 }
 
+/**
+ * Split the document already in `p_document`, which is
+ * modified in the process.
+ */
+void splitter_split_document(struct Splitter* p_splitter)
+{
+    handle_body(p_splitter);
+}
+
 void handle_body(struct Splitter* p_splitter)
 {
     xmlXPathContextPtr p_context = NULL;
     xmlXPathObjectPtr p_results  = NULL;
+    xmlNodePtr p_common_parent   = NULL;
     char targetfilename[PATH_MAX];
     int i = 0;
     int total = 0;
 
     /* Determine total number of split points */
+    TRACE_BEGIN("split-points", -1);
     p_context = xmlXPathNewContext(p_splitter->p_document);
     p_results = xmlXPathEvalExpression(BAD_CAST(p_splitter->splitexpr), p_context);
+    TRACE_END("split-points", -1);
 
     if (!p_results->nodesetval) {
         fprintf(stderr, "XPath expression '%s' is invalid.\n", p_splitter->splitexpr);
@@ -98,10 +141,41 @@ void handle_body(struct Splitter* p_splitter)
     }
 
     total = p_results->nodesetval->nodeNr;
+    if (total > 0)
+        p_common_parent = p_results->nodesetval->nodeTab[0]->parent;
+
     xmlXPathFreeObject(p_results);
 
     verbprintf("Found %d split points.\n", total);
 
+    splitter_init_layout(p_splitter, total);
+
+    /* Blocks repeated in every part are shared between them */
+    if (p_splitter->dedupmode != DEDUP_NONE && strlen(p_splitter->outdir) > 0 && p_common_parent)
+        splitter_externalize_assets(p_splitter, p_common_parent);
+
+    /* All parts end up in shard directories, so do the
+     * link adjustment for that once for the entire document. */
+    if (strlen(p_splitter->outdir) > 0)
+        splitter_relocate_links(p_splitter, xmlDocGetRootElement(p_splitter->p_document), true);
+
+    if (strlen(p_splitter->searchindex) > 0)
+        p_splitter->p_searchindex = splitter_search_new(p_splitter, total);
+
+    /* The node table holds the split points, so that the XPath
+     * expression need not be evaluated again for every part.
+     * The resources are assigned to the parts in one go, too. */
+    if ((p_splitter->nodetable && total > 0) || splitter_resources_wanted(p_splitter)) {
+        p_results = xmlXPathEvalExpression(BAD_CAST(p_splitter->splitexpr), p_context);
+
+        if (p_splitter->nodetable && total > 0)
+            splitter_build_node_table(p_splitter, p_results->nodesetval);
+        if (splitter_resources_wanted(p_splitter))
+            splitter_scan_resources(p_splitter, p_results->nodesetval, total);
+
+        xmlXPathFreeObject(p_results);
+    }
+
     /* Now iterate them all. We do the splitting by deleting every node
      * on our level before the last target, and everything behind the
      * current target. Graphically:
@@ -114,28 +188,51 @@ void handle_body(struct Splitter* p_splitter)
         xmlNodePtr p_end_node       = NULL; /* End split point; will be deleted */
         xmlNodePtr p_parent_node    = NULL; /* Common parent */
         xmlNodePtr p_interlink_node = NULL; /* Temporary node for the links between parts */
+        xmlNodePtr p_parttoc_node   = NULL; /* Temporary node for the local ToC */
+        struct SectionInfo* p_first_section = NULL;
 
         if (p_splitter->terminate) {
             fprintf(stderr, "Abnormal termination requested, quitting before handling split point %d.\n", i);
+            splitter_free_node_table(p_splitter);
             return;
         }
 
+        if (governor_time_exceeded()) {
+            fprintf(stderr, "Time budget of %d seconds exhausted, quitting before handling split point %d.\n", p_splitter->maxtime, i);
+            xmlXPathFreeContext(p_context);
+            splitter_free_node_table(p_splitter);
+            return;
+        }
+
+        /* The ToC is optional output. Give it up entirely rather
+         * than running out of memory for the parts themselves. */
+        if (p_splitter->tocdepth > 0 && governor_pressure() == GOV_PRESSURE_CRITICAL) {
+            fprintf(stderr, "Warning: Dropping Table of Contents due to memory pressure.\n");
+            splitter_free_toc_info(p_splitter);
+            p_splitter->tocdepth = 0;
+        }
+
         /* If only a specific section was queried, abort if we are not there. */
         if (p_splitter->secnum >= 0 && i != p_splitter->secnum) {
             continue;
         }
 
+        TRACE_BEGIN("part", i);
+        TRACE_BEGIN("slice", i);
+
         /* As we modify the document using the following functions,
          * we invalidate the XPath result and must query for each
-         * tag anew. */
-        p_results = xmlXPathEvalExpression(BAD_CAST(p_splitter->splitexpr), p_context);
+         * tag anew (unless the node table has them). */
+        p_results = NULL;
+        if (!p_splitter->p_nodetable)
+            p_results = xmlXPathEvalExpression(BAD_CAST(p_splitter->splitexpr), p_context);
 
         if (i > 0) {
-            p_start_node = p_results->nodesetval->nodeTab[i-1];
+            p_start_node = split_point(p_splitter, p_results, i-1);
             p_parent_node = p_start_node->parent; /* Only needed for interlinking */
         }
         if (i < total) {
-            p_end_node = p_results->nodesetval->nodeTab[i];
+            p_end_node = split_point(p_splitter, p_results, i);
             p_parent_node = p_end_node->parent;
         }
 
@@ -143,37 +240,94 @@ void handle_body(struct Splitter* p_splitter)
         slice_preceeding_nodes(p_splitter, p_start_node);
         slice_following_nodes(p_splitter, p_end_node);
 
-        if (p_splitter->tocdepth > 0)
-            splitter_collect_toc_info(p_splitter, i);
+        TRACE_END("slice", i);
 
-        if (p_splitter->interlink)
+        /* Before the local ToC is added, which would count
+         * every heading twice */
+        if (p_splitter->p_searchindex) {
+            TRACE_BEGIN("search-index", i);
+            splitter_search_index_part(p_splitter, p_parent_node, i);
+            TRACE_END("search-index", i);
+        }
+
+        if (p_splitter->tocdepth > 0) {
+            TRACE_BEGIN("toc-collect", i);
+            p_first_section = splitter_collect_toc_info(p_splitter, i);
+
+            if (p_splitter->parttoc && !p_splitter->p_template)
+                p_parttoc_node = splitter_add_part_toc(p_splitter, p_parent_node, p_first_section);
+            TRACE_END("toc-collect", i);
+        }
+
+        /* A template brings its own navigation */
+        if (p_splitter->interlink && !p_splitter->p_template)
             p_interlink_node = splitter_add_interlinks(p_splitter, p_parent_node, i, total);
 
+        if (!p_splitter->p_template)
+            splitter_add_resource_hints(p_splitter, i, total);
+
+        splitter_write_part_deps(p_splitter, i);
+
         /* Write out */
-        if (strlen(p_splitter->outdir) == 0) { /* stdout requested */
-            splitter_write_part(p_splitter, NULL);
+        TRACE_BEGIN("write-part", i);
+        if (!splitter_watch_part_changed(p_splitter, i, total)) {
+            verbprintf("Part %d is unchanged.\n", i);
+        }
+        else if (strlen(p_splitter->outdir) == 0) { /* stdout requested */
+            if (p_splitter->p_template)
+                splitter_write_template_part(p_splitter, p_parent_node, p_start_node, p_first_section, i, total, NULL);
+            else
+                splitter_write_part(p_splitter, NULL);
 
             if (i < total) { /* Separator */
                 printf("%s\n", p_splitter->stdoutsep);
             }
         }
         else {
-            memset(targetfilename, '\0', PATH_MAX);
-            sprintf(targetfilename, "%s/%04d.html", p_splitter->outdir, i);
-            splitter_write_part(p_splitter, targetfilename);
+            char partpath[PATH_MAX];
+
+            splitter_part_path(p_splitter, i, partpath);
+            if (snprintf(targetfilename, PATH_MAX, "%s/%s", p_splitter->outdir, partpath) >= PATH_MAX) {
+                fprintf(stderr, "Path of part '%s' is too long.\n", partpath);
+                exit(ERR_IO);
+            }
+
+            splitter_make_part_dir(p_splitter, i);
+
+            if (p_splitter->p_template)
+                splitter_write_template_part(p_splitter, p_parent_node, p_start_node, p_first_section, i, total, targetfilename);
+            else
+                splitter_write_part(p_splitter, targetfilename);
         }
+        TRACE_END("write-part", i);
 
         if (p_splitter->interlink)
             splitter_remove_interlinks(p_splitter, p_interlink_node);
 
+        splitter_remove_resource_hints(p_splitter);
+
+        splitter_remove_part_toc(p_splitter, p_parttoc_node);
+
         /* Resurrect deleted parts */
         reinsert_preceeding_nodes(p_splitter, p_start_node);
         reinsert_following_nodes(p_splitter, p_parent_node);
 
         xmlXPathFreeObject(p_results);
+
+        TRACE_END("part", i);
     }
 
     xmlXPathFreeContext(p_context);
+
+    /* The table points into the document, which the ToC
+     * generation strips afterwards */
+    splitter_free_node_table(p_splitter);
+
+    if (p_splitter->p_searchindex) {
+        TRACE_BEGIN("search-index-merge", -1);
+        splitter_search_finish(p_splitter);
+        TRACE_END("search-index-merge", -1);
+    }
 }
 
 void slice_following_nodes(struct Splitter* p_splitter, xmlNodePtr p_node)
@@ -194,14 +348,14 @@ void slice_following_nodes(struct Splitter* p_splitter, xmlNodePtr p_node)
     /* Count the number of following nodes we have to store */
     p_next_node = p_node; /* Trailing next split point must be removed */
     while(p_next_node) {
-        p_next_node = xmlNextElementSibling(p_next_node);
+        p_next_node = next_element(p_splitter, p_next_node);
         nodecount++;
     }
 
     verbprintf("Going to temporaryly delete %d following nodes.\n", nodecount);
 
     /* Allocate the space we need for storing */
-    nodestore = (xmlNodePtr*) malloc(nodecount * sizeof(xmlNodePtr));
+    nodestore = (xmlNodePtr*) xmlMalloc(nodecount * sizeof(xmlNodePtr));
 
     if (!nodestore) {
         perror("Failed to allocate memory for following-nodes store");
@@ -211,7 +365,7 @@ void slice_following_nodes(struct Splitter* p_splitter, xmlNodePtr p_node)
     /* Store all the nodes and unlink them from the document */
     p_next_node = p_node; /* Trailing next split point must be removed */
     while (p_next_node) {
-        xmlNodePtr p_next_next_node = xmlNextElementSibling(p_next_node);
+        xmlNodePtr p_next_next_node = next_element(p_splitter, p_next_node);
 
         verbprintf("Removing <%s>\n", p_next_node->name);
         xmlUnlinkNode(p_next_node);
@@ -239,15 +393,15 @@ void slice_preceeding_nodes(struct Splitter* p_splitter, xmlNodePtr p_node)
         return;
     }
 
-    p_prev_node = xmlPreviousElementSibling(p_node); /* Previous splitpoint itself must not be removed */
+    p_prev_node = prev_element(p_splitter, p_node); /* Previous splitpoint itself must not be removed */
     while (p_prev_node) {
-        p_prev_node = xmlPreviousElementSibling(p_prev_node);
+        p_prev_node = prev_element(p_splitter, p_prev_node);
         nodecount++;
     }
 
     /* Allocate the space we need for storing */
     verbprintf("Going to temporaryly delete %d preceeding nodes.\n", nodecount);
-    nodestore = (xmlNodePtr*) malloc(nodecount * sizeof(xmlNodePtr));
+    nodestore = (xmlNodePtr*) xmlMalloc(nodecount * sizeof(xmlNodePtr));
 
     if (!nodestore) {
         perror("Failed to allocate memory for preceeding-nodes store");
@@ -255,9 +409,9 @@ void slice_preceeding_nodes(struct Splitter* p_splitter, xmlNodePtr p_node)
     }
 
     /* Store all the nodes and unlink them from the document */
-    p_prev_node = xmlPreviousElementSibling(p_node);  /* Previous splitpoint itself must not be removed */
+    p_prev_node = prev_element(p_splitter, p_node);  /* Previous splitpoint itself must not be removed */
     while (p_prev_node) {
-        xmlNodePtr p_prev_prev_node = xmlPreviousElementSibling(p_prev_node);
+        xmlNodePtr p_prev_prev_node = prev_element(p_splitter, p_prev_node);
         xmlUnlinkNode(p_prev_node);
 
         nodestore[i++] = p_prev_node;
@@ -284,7 +438,7 @@ void reinsert_following_nodes(struct Splitter* p_splitter, xmlNodePtr p_node)
     }
 
     /* Cleanup */
-    free(p_splitter->p_following_nodes);
+    xmlFree(p_splitter->p_following_nodes);
     p_splitter->p_following_nodes = NULL;
     p_splitter->num_following_nodes = 0;
 }
@@ -308,7 +462,42 @@ void reinsert_preceeding_nodes(struct Splitter* p_splitter, xmlNodePtr p_node)
     }
 
     /* Cleanup */
-    free(p_splitter->p_preceeding_nodes);
+    xmlFree(p_splitter->p_preceeding_nodes);
     p_splitter->p_preceeding_nodes = NULL;
     p_splitter->num_preceeding_nodes = 0;
 }
+
+xmlNodePtr split_point(struct Splitter* p_splitter, xmlXPathObjectPtr p_results, int index)
+{
+    struct NodeTable* p_table = p_splitter->p_nodetable;
+
+    if (p_table)
+        return p_table->p_nodes[p_table->p_splits[index]];
+    else
+        return p_results->nodesetval->nodeTab[index];
+}
+
+/* Element siblings are taken from the node table if there is one */
+xmlNodePtr next_element(struct Splitter* p_splitter, xmlNodePtr p_node)
+{
+    struct NodeTable* p_table = p_splitter->p_nodetable;
+    int index = p_table ? splitter_node_index(p_node) : -1;
+
+    if (index < 0)
+        return xmlNextElementSibling(p_node);
+
+    index = p_table->p_entries[index].next;
+    return index >= 0 ? p_table->p_nodes[index] : NULL;
+}
+
+xmlNodePtr prev_element(struct Splitter* p_splitter, xmlNodePtr p_node)
+{
+    struct NodeTable* p_table = p_splitter->p_nodetable;
+    int index = p_table ? splitter_node_index(p_node) : -1;
+
+    if (index < 0)
+        return xmlPreviousElementSibling(p_node);
+
+    index = p_table->p_entries[index].prev;
+    return index >= 0 ? p_table->p_nodes[index] : NULL;
+}
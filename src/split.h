@@ -2,6 +2,14 @@
 #define HTMLSPLITTER_SPLIT_H
 
 struct SectionInfo; /* forward-declare; real declaration in toc.h */
+struct SearchIndex; /* forward-declare; real declaration in search.c */
+struct DedupTable; /* forward-declare; real declaration in dedup.c */
+struct Writer; /* forward-declare; real declaration in writer.c */
+struct NodeTable; /* forward-declare; real declaration in nodetable.h */
+struct Variant; /* forward-declare; real declaration in variant.h */
+struct Template; /* forward-declare; real declaration in template.h */
+struct Resources; /* forward-declare; real declaration in resource.c */
+struct Watch; /* forward-declare; real declaration in watch.c */
 
 /**
  * Main structure of this program.
@@ -15,6 +23,31 @@ struct Splitter {
     bool interlink;
     int tocdepth;
     char tocname[4096];
+    size_t maxmem; /*< Heap budget in bytes, 0 = unlimited */
+    int maxtime;   /*< Wall-clock budget in seconds, 0 = unlimited */
+    char namepattern[256]; /*< printf()-style pattern for part file names */
+    int shardmode;         /*< One of the `shardmode` enum values from layout.h */
+    int shardsize;
+    char searchindex[PATH_MAX]; /*< Search index file to write, empty for none */
+    int dedupmode;              /*< One of the `dedupmode` enum values from dedup.h */
+    bool minify;
+    bool stripcomments;
+    int parsethreads; /*< Number of threads to parse the input with */
+    int writedepth;   /*< Files to write asynchronously at once, 0 = write synchronously */
+    int durability;   /*< One of the `durability` enum values from writer.h */
+    bool nodetable;   /*< Build a node table for traversing the document */
+    int tocpages;     /*< One of the `tocpages` enum values from toc.h */
+    bool tocjson;     /*< Also write the ToC pages as JSON */
+    bool parttoc;     /*< Add a local ToC to every part */
+    int variantthreads; /*< Number of variants to split at once */
+    char templatefile[PATH_MAX]; /*< Page template to render the parts with, empty for none */
+    int resourcehints;           /*< Resources to preload per part, -1 = no resource hints */
+    char depsfile[PATH_MAX];     /*< Resource dependency file to write, empty for none */
+    char tracefile[PATH_MAX];    /*< Trace event file to write, empty for none */
+    int planmode;                /*< One of the `planmode` enum values from plan.h */
+    bool watch;                  /*< Split again whenever the input file changes */
+    char cachedir[PATH_MAX];     /*< Directory for snapshots of parsed documents, empty for none */
+    size_t cachesize;            /*< Size limit of `cachedir` in bytes */
 
     /***** Internal use *****/
     htmlDocPtr p_document;
@@ -23,6 +56,27 @@ struct Splitter {
     int num_following_nodes;
     int num_preceeding_nodes;
     struct SectionInfo* p_sectioninfo;
+    char namefmt[256];    /*< `namepattern` with the width filled in */
+    int shardwidth;       /*< Number of characters in a shard directory name */
+    bool* p_shard_made;   /*< Which shard directories exist already */
+    int num_shards;
+    struct SearchIndex* p_searchindex;
+    struct DedupTable* p_deduptable;
+    char* p_outbuf;         /*< Serialised part when minifying */
+    size_t outbuf_size;
+    size_t outbuf_capacity;
+    size_t minify_written;  /*< Bytes written by the minifier */
+    size_t minify_saved;    /*< Bytes the minifier left out */
+    struct Writer* p_writer;
+    bool writer_unavailable; /*< io_uring could not be set up */
+    char** pp_syncdirs;      /*< Directories to fsync() at the end for the durability mode */
+    int num_syncdirs;
+    struct NodeTable* p_nodetable;
+    struct Variant* p_variants; /*< Split configurations given with --variant */
+    int num_variants;
+    struct Template* p_template;
+    struct Resources* p_resources;
+    struct Watch* p_watch;
 
     bool terminate;
 };
@@ -35,12 +89,14 @@ enum errcode {
     ERR_CLI,
     ERR_IO,
     ERR_PARSE,
-    ERR_MEM
+    ERR_MEM,
+    ERR_TIME
 };
 
 struct Splitter* splitter_new();
 void splitter_free(struct Splitter* ptr);
 
 void splitter_split_file(struct Splitter* p_splitter);
+void splitter_split_document(struct Splitter* p_splitter);
 
 #endif
@@ -0,0 +1,312 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
+#include <libxml/HTMLparser.h>
+#include "split.h"
+#include "template.h"
+#include "toc.h"
+#include "io.h"
+#include "layout.h"
+#include "resource.h"
+#include "trace.h"
+#include "verbose.h"
+
+/* A template is an HTML file with placeholders of the form
+ * {{name}}. It is read and cut into segments once; rendering a
+ * part then only appends the static segments and the slot values
+ * to the output buffer, without building anything in the
+ * document. */
+
+static const char* const s_slot_names[] = {
+    NULL, "content", "title", "prev", "next", "prev-href", "next-href", "toc", "hints", NULL
+};
+
+static void add_segment(struct Template* p_template, int slot, size_t offset, size_t length);
+static int lookup_slot(const char* name, size_t length);
+static void append_title(struct Splitter* p_splitter, xmlNodePtr p_start_node);
+static void append_link(struct Splitter* p_splitter, int index, const char* cssclass, const char* text);
+static void append_toc(struct Splitter* p_splitter, struct SectionInfo* p_first_section);
+static xmlNodePtr find_element(xmlNodePtr p_node, const char* name);
+
+/**
+ * Read and compile the template file given in `templatefile`.
+ * Exits with ERR_IO if it cannot be read and ERR_CLI if it
+ * contains unknown placeholders or no {{content}}.
+ */
+void splitter_load_template(struct Splitter* p_splitter)
+{
+    struct Template* p_template = NULL;
+    FILE* p_file = NULL;
+    size_t pos = 0;
+    size_t start = 0;
+    bool has_content = false;
+
+    p_file = fopen(p_splitter->templatefile, "rb");
+    if (!p_file) {
+        int errsav = errno;
+        fprintf(stderr, "Failed to open template file '%s': %s\n", p_splitter->templatefile, strerror(errsav));
+        exit(ERR_IO);
+    }
+
+    p_template = (struct Template*) xmlMalloc(sizeof(struct Template));
+    if (!p_template) {
+        perror("Failed to allocate memory for the template");
+        exit(ERR_MEM);
+    }
+    memset(p_template, '\0', sizeof(struct Template));
+
+    p_template->p_text = splitter_read_stream(p_file, &p_template->size);
+    fclose(p_file);
+
+    /* Cut into static text and placeholders */
+    while (pos + 1 < p_template->size) {
+        const char* p_end = NULL;
+        int slot = 0;
+
+        if (p_template->p_text[pos] != '{' || p_template->p_text[pos + 1] != '{') {
+            pos++;
+            continue;
+        }
+
+        p_end = memchr(p_template->p_text + pos, '}', p_template->size - pos);
+        if (!p_end || (size_t) (p_end - p_template->p_text) + 1 >= p_template->size || p_end[1] != '}') {
+            fprintf(stderr, "Unterminated placeholder in template file '%s'.\n", p_splitter->templatefile);
+            exit(ERR_CLI);
+        }
+
+        slot = lookup_slot(p_template->p_text + pos + 2, p_end - (p_template->p_text + pos + 2));
+        if (slot == SLOT_TEXT) {
+            fprintf(stderr, "Unknown placeholder '%.*s' in template file '%s'.\n",
+                    (int) (p_end - p_template->p_text - pos + 2), p_template->p_text + pos, p_splitter->templatefile);
+            exit(ERR_CLI);
+        }
+
+        if (pos > start)
+            add_segment(p_template, SLOT_TEXT, start, pos - start);
+
+        add_segment(p_template, slot, 0, 0);
+        has_content = has_content || slot == SLOT_CONTENT;
+
+        pos   = (p_end - p_template->p_text) + 2;
+        start = pos;
+    }
+
+    if (start < p_template->size)
+        add_segment(p_template, SLOT_TEXT, start, p_template->size - start);
+
+    p_splitter->p_template = p_template;
+
+    if (!has_content) {
+        fprintf(stderr, "Template file '%s' has no {{content}} placeholder.\n", p_splitter->templatefile);
+        exit(ERR_CLI);
+    }
+
+    verbprintf("Compiled template '%s' into %d segments.\n", p_splitter->templatefile, p_template->num_segments);
+}
+
+/**
+ * Free the compiled template, if any.
+ */
+void splitter_free_template(struct Splitter* p_splitter)
+{
+    struct Template* p_template = p_splitter->p_template;
+
+    if (!p_template)
+        return;
+
+    xmlFree(p_template->p_text);
+    xmlFree(p_template->p_segments);
+    xmlFree(p_template);
+
+    p_splitter->p_template = NULL;
+}
+
+/**
+ * Render part number `index` of `total` with the template and write
+ * it to `targetfile` (or the standard output if that is NULL). The
+ * content are the children of `p_parent_node` as left by the slicing,
+ * or the <body> if there are no split points. `p_start_node` is the
+ * split point starting the part, NULL for the first part, and
+ * `p_first_section` the first ToC section collected for it.
+ */
+void splitter_write_template_part(struct Splitter* p_splitter, xmlNodePtr p_parent_node, xmlNodePtr p_start_node, struct SectionInfo* p_first_section, int index, int total, const char* targetfile)
+{
+    struct Template* p_template = p_splitter->p_template;
+    xmlNodePtr p_root = xmlDocGetRootElement(p_splitter->p_document);
+    int i = 0;
+
+    if (!p_parent_node)
+        p_parent_node = find_element(p_root, "body");
+
+    TRACE_BEGIN("render", index);
+    p_splitter->outbuf_size = 0;
+
+    for(i=0; i < p_template->num_segments; i++) {
+        struct TemplateSegment* p_segment = &p_template->p_segments[i];
+
+        switch (p_segment->slot) {
+        case SLOT_TEXT:
+            splitter_out_append(p_splitter, p_template->p_text + p_segment->offset, p_segment->length);
+            break;
+        case SLOT_CONTENT:
+            if (p_parent_node)
+                splitter_out_append_nodes(p_splitter, p_parent_node->children);
+            else if (p_root)
+                splitter_out_append_nodes(p_splitter, p_root);
+            break;
+        case SLOT_TITLE:
+            append_title(p_splitter, p_start_node);
+            break;
+        case SLOT_PREV:
+            if (index > 0)
+                append_link(p_splitter, index - 1, "htmlsplit-prev", "&larr;");
+            break;
+        case SLOT_NEXT:
+            if (index < total)
+                append_link(p_splitter, index + 1, "htmlsplit-next", "&rarr;");
+            break;
+        case SLOT_PREV_HREF:
+        case SLOT_NEXT_HREF: {
+            char href[PATH_MAX];
+            int target = p_segment->slot == SLOT_PREV_HREF ? index - 1 : index + 1;
+
+            if (target >= 0 && target <= total) {
+                memset(href, '\0', PATH_MAX);
+                splitter_part_href(p_splitter, target, href);
+                splitter_out_append_escaped(p_splitter, BAD_CAST(href), true);
+            }
+            break;
+        }
+        case SLOT_TOC:
+            append_toc(p_splitter, p_first_section);
+            break;
+        case SLOT_HINTS:
+            splitter_append_resource_hints(p_splitter, index, total);
+            break;
+        default:
+            break;
+        }
+    }
+    TRACE_END("render", index);
+
+    if (p_splitter->minify)
+        p_splitter->minify_written += p_splitter->outbuf_size;
+
+    splitter_write_buffer(p_splitter, targetfile, BAD_CAST(p_splitter->p_outbuf), p_splitter->outbuf_size);
+}
+
+void add_segment(struct Template* p_template, int slot, size_t offset, size_t length)
+{
+    struct TemplateSegment* p_segment = NULL;
+
+    if ((p_template->num_segments & (p_template->num_segments - 1)) == 0) { /* Power of two: full */
+        p_template->p_segments = (struct TemplateSegment*) xmlRealloc(p_template->p_segments,
+                                                                      (p_template->num_segments ? p_template->num_segments * 2 : 1) * sizeof(struct TemplateSegment));
+        if (!p_template->p_segments) {
+            perror("Failed to allocate memory for the template");
+            exit(ERR_MEM);
+        }
+    }
+
+    p_segment = &p_template->p_segments[p_template->num_segments++];
+    p_segment->slot   = slot;
+    p_segment->offset = offset;
+    p_segment->length = length;
+}
+
+/* Slot for the placeholder name, SLOT_TEXT if there is none */
+int lookup_slot(const char* name, size_t length)
+{
+    int slot = 0;
+
+    for(slot = SLOT_CONTENT; s_slot_names[slot]; slot++) {
+        if (strlen(s_slot_names[slot]) == length && strncmp(s_slot_names[slot], name, length) == 0)
+            return slot;
+    }
+
+    return SLOT_TEXT;
+}
+
+/* The text of the split point starting the part, or the document
+ * title for the first part */
+void append_title(struct Splitter* p_splitter, xmlNodePtr p_start_node)
+{
+    xmlNodePtr p_node = p_start_node;
+    xmlChar* title = NULL;
+
+    if (!p_node)
+        p_node = find_element(find_element(xmlDocGetRootElement(p_splitter->p_document), "head"), "title");
+    if (!p_node)
+        return;
+
+    title = xmlNodeGetContent(p_node);
+    if (title) {
+        splitter_out_append_escaped(p_splitter, title, false);
+        xmlFree(title);
+    }
+}
+
+void append_link(struct Splitter* p_splitter, int index, const char* cssclass, const char* text)
+{
+    char href[PATH_MAX];
+
+    memset(href, '\0', PATH_MAX);
+    splitter_part_href(p_splitter, index, href);
+
+    splitter_out_append(p_splitter, "<a class=\"", 10);
+    splitter_out_append(p_splitter, cssclass, strlen(cssclass));
+    splitter_out_append(p_splitter, "\" href=\"", 8);
+    splitter_out_append_escaped(p_splitter, BAD_CAST(href), true);
+    splitter_out_append(p_splitter, "\">", 2);
+    splitter_out_append(p_splitter, text, strlen(text));
+    splitter_out_append(p_splitter, "</a>", 4);
+}
+
+/* A flat list of the part's sections down to the ToC depth; the
+ * items carry the heading level in their class. */
+void append_toc(struct Splitter* p_splitter, struct SectionInfo* p_first_section)
+{
+    struct SectionInfo* p_section = NULL;
+    bool empty = true;
+
+    for (p_section = p_first_section; p_section; p_section = p_section->p_next) {
+        char item[64];
+
+        if (p_section->level > p_splitter->tocdepth)
+            continue;
+
+        if (empty) {
+            splitter_out_append(p_splitter, "<ul class=\"htmlsplit-parttoc\">", 30);
+            empty = false;
+        }
+
+        sprintf(item, "<li class=\"htmlsplit-toc-h%d\"><a href=\"#", p_section->level);
+        splitter_out_append(p_splitter, item, strlen(item));
+        splitter_out_append_escaped(p_splitter, BAD_CAST(p_section->anchor), true);
+        splitter_out_append(p_splitter, "\">", 2);
+        splitter_out_append_nodes(p_splitter, p_section->content_nodes);
+        splitter_out_append(p_splitter, "</a></li>", 9);
+    }
+
+    if (!empty)
+        splitter_out_append(p_splitter, "</ul>", 5);
+}
+
+/* First child element of `p_node` with the given name */
+xmlNodePtr find_element(xmlNodePtr p_node, const char* name)
+{
+    if (!p_node)
+        return NULL;
+
+    for (p_node = xmlFirstElementChild(p_node); p_node; p_node = xmlNextElementSibling(p_node)) {
+        if (xmlStrcasecmp(p_node->name, BAD_CAST(name)) == 0)
+            return p_node;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,44 @@
+#ifndef HTMLSPLIT_TEMPLATE_H
+#define HTMLSPLIT_TEMPLATE_H
+
+/**
+ * What a template segment is filled with.
+ */
+enum templateslot {
+    SLOT_TEXT = 0,  /*< Static text from the template itself */
+    SLOT_CONTENT,   /*< The part's nodes below the split points' parent */
+    SLOT_TITLE,     /*< Text of the heading starting the part */
+    SLOT_PREV,      /*< Link to the previous part */
+    SLOT_NEXT,      /*< Link to the next part */
+    SLOT_PREV_HREF, /*< URL of the previous part */
+    SLOT_NEXT_HREF, /*< URL of the next part */
+    SLOT_TOC,       /*< Local Table of Contents */
+    SLOT_HINTS      /*< Resource hints, see resource.c */
+};
+
+/**
+ * One piece of a compiled template: either a run of static
+ * bytes or a slot filled in for every part.
+ */
+struct TemplateSegment {
+    int slot;       /*< One of the `templateslot` enum values */
+    size_t offset;  /*< Start of the static text in `p_text` */
+    size_t length;
+};
+
+/**
+ * A page template, compiled into a list of segments.
+ */
+struct Template {
+    char* p_text;   /*< Contents of the template file */
+    size_t size;
+    struct TemplateSegment* p_segments;
+    int num_segments;
+};
+
+void splitter_load_template(struct Splitter* p_splitter);
+void splitter_free_template(struct Splitter* p_splitter);
+
+void splitter_write_template_part(struct Splitter* p_splitter, xmlNodePtr p_parent_node, xmlNodePtr p_start_node, struct SectionInfo* p_first_section, int index, int total, const char* targetfile); /*< \private */
+
+#endif
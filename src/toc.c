@@ -14,11 +14,33 @@
 #include "split.h"
 #include "toc.h"
 #include "io.h"
+#include "layout.h"
+#include "nodetable.h"
+#include "governor.h"
+#include "search.h"
+#include "writer.h"
+#include "trace.h"
 #include "verbose.h"
 
+/**
+ * The sections that go into the ToC, in an array for
+ * paginating it.
+ */
+struct TocPages {
+    struct SectionInfo** pp_sections; /*< Sections within the depth limit */
+    int* p_ends;                      /*< For each section, the index after the last section below it */
+    int num_sections;
+};
+
 static xmlNodePtr strip_document(struct Splitter* p_splitter);
-static xmlChar* detect_target_anchor(struct Splitter* p_splitter, xmlNodePtr p_heading_node);
 static xmlNodePtr copy_heading_contents(struct Splitter* p_splitter, xmlNodePtr p_heading_node);
+static void add_section(struct Splitter* p_splitter, xmlNodePtr p_curhead, const char* anchorid, int index, struct SectionInfo** pp_last_section);
+static void collect_from_table(struct Splitter* p_splitter, int index, struct SectionInfo* p_last_section);
+static void write_toc_page(struct Splitter* p_splitter, xmlNodePtr p_parent_node, struct TocPages* p_pages, int page, int first, int last, bool flat);
+static void toc_page_name(int page, const char* extension, char* name);
+static void add_nested_items(struct Splitter* p_splitter, xmlNodePtr p_list, struct SectionInfo* p_first, struct SectionInfo* p_stop, int base_level, bool local);
+static xmlNodePtr add_item(struct Splitter* p_splitter, xmlNodePtr p_list, struct SectionInfo* p_section, bool local);
+static void write_toc_json(struct Splitter* p_splitter, struct TocPages* p_pages, int page, int first, int last, bool flat);
 
 /**
  * This function is to be called during the splitting process.
@@ -29,11 +51,30 @@ static xmlNodePtr copy_heading_contents(struct Splitter* p_splitter, xmlNodePtr
  * filters it for HTML heading elements, whose info is then
  * stored inside a linked list inside the `p_sectioninfo`
  * member of the `p_splitter` object.
+ *
+ * Returns the first section collected for this split point,
+ * or NULL if there is none.
  */
-void splitter_collect_toc_info(struct Splitter* p_splitter, int index)
+struct SectionInfo* splitter_collect_toc_info(struct Splitter* p_splitter, int index)
 {
     xmlXPathContextPtr p_context = NULL;
     xmlXPathObjectPtr p_results  = NULL;
+    struct SectionInfo* p_last_section = NULL;
+    struct SectionInfo* p_previous_last = NULL;
+    int i = 0;
+
+    /* We need to append to the end of the list; note that
+     * for the first item p_last_section will be NULL. */
+    p_last_section = p_splitter->p_sectioninfo;
+    while (p_last_section && p_last_section->p_next) {
+        p_last_section = p_last_section->p_next;
+    }
+    p_previous_last = p_last_section;
+
+    if (p_splitter->p_nodetable) {
+        collect_from_table(p_splitter, index, p_last_section);
+        return p_previous_last ? p_previous_last->p_next : p_splitter->p_sectioninfo;
+    }
 
     p_context = xmlXPathNewContext(p_splitter->p_document);
     p_results = xmlXPathEvalExpression(BAD_CAST("//h1|//h2|//h3|//h4|//h5|//h6"), p_context);
@@ -42,60 +83,56 @@ void splitter_collect_toc_info(struct Splitter* p_splitter, int index)
 
     /* Very first part before first split point may not have
      * any heading tags. */
-    if (p_results && p_results->nodesetval->nodeNr > 0) {
-        struct SectionInfo* p_last_section = NULL;
-        int i = 0;
-
-        /* We need to append to the end of the list; note that
-         * for the first item p_last_section will be NULL. */
-        p_last_section = p_splitter->p_sectioninfo;
-        while (p_last_section && p_last_section->p_next) {
-            p_last_section = p_last_section->p_next;
-        }
+    for(i=0; p_results && i < p_results->nodesetval->nodeNr; i++) {
+        xmlNodePtr p_curhead = p_results->nodesetval->nodeTab[i];
+        xmlChar* anchorid    = splitter_detect_target_anchor(p_splitter, p_curhead);
 
-        for(i=0; i < p_results->nodesetval->nodeNr; i++) {
-            xmlNodePtr p_curhead = p_results->nodesetval->nodeTab[i];
-            xmlChar* anchorid    = detect_target_anchor(p_splitter, p_curhead);
-
-            /* If this heading as an ID attribute, remember it for later ToC generation. */
-            if (anchorid && p_curhead->children) { /* some silly people use empty <h*> tags */
-                struct SectionInfo* p_section = (struct SectionInfo*) malloc(sizeof(struct SectionInfo));
-
-                verbprintf("Collecting heading for later ToC generation.\n");
-                memset(p_section, '\0', sizeof(struct SectionInfo));
-
-                /* Copy easy things */
-                p_section->level = atoi(((char*) p_curhead->name) + 1); /* Strip leading “h” of h1, h2, etc. */
-                strcpy(p_section->anchor, (char*) anchorid);
-                sprintf(p_section->filename, "%04d.html", index);
-
-                /* Copy the heading’s content */
-                p_section->content_nodes = copy_heading_contents(p_splitter, p_curhead);
-                if (!p_section->content_nodes) {
-                    fprintf(stderr, "Warning: Failed to copy node list for ToC collection, skipping this heading.\n");
-                    free(p_section);
-                    /* continue; */
-                    exit(ERR_PARSE); /* DEBUG */
-                }
-
-                /* Advance section linked list */
-                if (p_last_section)
-                    p_last_section->p_next = p_section;
-                else /* First section info */
-                    p_splitter->p_sectioninfo = p_section;
-                p_last_section = p_section;
-
-                /* Cleanup */
-                xmlFree(anchorid);
-            }
-            else {
-                verbprintf("This heading has either no anchor or no content, thus no entry in ToC possible.\n");
-            }
-        }
+        add_section(p_splitter, p_curhead, (const char*) anchorid, index, &p_last_section);
+        xmlFree(anchorid);
     }
 
     xmlXPathFreeObject(p_results);
     xmlXPathFreeContext(p_context);
+
+    return p_previous_last ? p_previous_last->p_next : p_splitter->p_sectioninfo;
+}
+
+/**
+ * Free all the data collected with splitter_collect_toc_info()
+ * without generating a ToC from it. splitter_generate_tocfile()
+ * calls this when it is done.
+ */
+void splitter_free_toc_info(struct Splitter* p_splitter)
+{
+    struct SectionInfo* p_section = p_splitter->p_sectioninfo;
+
+    while (p_section) {
+        struct SectionInfo* p_next = p_section->p_next;
+
+        xmlFreeNodeList(p_section->content_nodes);
+        xmlFree(p_section);
+
+        p_section = p_next;
+    }
+
+    p_splitter->p_sectioninfo = NULL;
+}
+
+/**
+ * Parse the argument to the --toc-pages option, which may
+ * be "chapter" or "level". Returns false if the mode is not
+ * understood.
+ */
+bool splitter_parse_toc_pages(struct Splitter* p_splitter, const char* mode)
+{
+    if (strcmp(mode, "chapter") == 0)
+        p_splitter->tocpages = TOC_PAGES_CHAPTER;
+    else if (strcmp(mode, "level") == 0)
+        p_splitter->tocpages = TOC_PAGES_LEVEL;
+    else
+        return false;
+
+    return true;
 }
 
 /**
@@ -104,38 +141,235 @@ void splitter_collect_toc_info(struct Splitter* p_splitter, int index)
  * out to disk, or, if output to standard output was
  * requested, as a separate “part” out to standard
  * output.
+ *
+ * With --toc-pages, the ToC file only lists the top-level
+ * sections, and further pages are written for the sections
+ * below them (see toc_page_name()); with --toc-json, each
+ * page is also written as JSON. The document is stripped
+ * only once and then reused for every page.
  */
 void splitter_generate_tocfile(struct Splitter* p_splitter)
 {
+    struct TocPages pages;
     struct SectionInfo* p_section = NULL;
     xmlNodePtr p_parent_node = NULL;
-    xmlNodePtr p_node = NULL;
-    xmlNodePtr p_list = NULL;
-    int current_level = 1; /* Level for <h1> tags */
-    xmlChar* toctitle = xmlCharStrdup(p_splitter->tocname);
+    int i = 0;
 
     verbprintf("Generating Table of Contents.\n");
+    TRACE_BEGIN("toc-file", -1);
     p_parent_node = strip_document(p_splitter);
 
+    /* The ToC files are not placed in a shard directory, so
+     * the links inherited from the parts need to be undone. */
+    if (strlen(p_splitter->outdir) > 0)
+        splitter_relocate_links(p_splitter, xmlDocGetRootElement(p_splitter->p_document), false);
+
+    /* Index the sections within the depth limit, and where
+     * the sections below each of them end */
+    memset(&pages, '\0', sizeof(struct TocPages));
+    for (p_section = p_splitter->p_sectioninfo; p_section; p_section = p_section->p_next) {
+        if (p_splitter->tocdepth < p_section->level) {
+            verbprintf("Section has level %d, which is above the threshold of %d.\n", p_section->level, p_splitter->tocdepth);
+            continue;
+        }
+
+        if ((pages.num_sections & (pages.num_sections - 1)) == 0) { /* Power of two: full */
+            int capacity = pages.num_sections ? pages.num_sections * 2 : 1;
+
+            pages.pp_sections = (struct SectionInfo**) xmlRealloc(pages.pp_sections, capacity * sizeof(struct SectionInfo*));
+            pages.p_ends      = (int*) xmlRealloc(pages.p_ends, capacity * sizeof(int));
+            if (!pages.pp_sections || !pages.p_ends) {
+                perror("Failed to allocate memory for ToC pages");
+                exit(ERR_MEM);
+            }
+        }
+
+        pages.pp_sections[pages.num_sections++] = p_section;
+    }
+
+    for(i = pages.num_sections - 1; i >= 0; i--) {
+        int end = i + 1;
+
+        while (end < pages.num_sections && pages.pp_sections[end]->level > pages.pp_sections[i]->level)
+            end = pages.p_ends[end];
+
+        pages.p_ends[i] = end;
+    }
+
+    if (p_splitter->tocpages == TOC_PAGES_SINGLE) {
+        write_toc_page(p_splitter, p_parent_node, &pages, -1, 0, pages.num_sections, false);
+    }
+    else {
+        /* Index of the top-level sections */
+        write_toc_page(p_splitter, p_parent_node, &pages, -1, 0, pages.num_sections, true);
+
+        for(i=0; i < pages.num_sections; i++) {
+            if (pages.p_ends[i] == i + 1) /* Nothing below */
+                continue;
+
+            if (p_splitter->tocpages == TOC_PAGES_CHAPTER) {
+                write_toc_page(p_splitter, p_parent_node, &pages, i, i, pages.p_ends[i], false);
+                i = pages.p_ends[i] - 1; /* Next chapter */
+            }
+            else {
+                write_toc_page(p_splitter, p_parent_node, &pages, i, i + 1, pages.p_ends[i], true);
+            }
+        }
+    }
+
+    xmlFree(pages.pp_sections);
+    xmlFree(pages.p_ends);
+    splitter_free_toc_info(p_splitter);
+    TRACE_END("toc-file", -1);
+}
+
+/**
+ * Temporarily add a list of the sections collected for the
+ * current part, starting with `p_first_section`, to the top
+ * of the common parent of all split points. Links in the list
+ * point to the anchors within the part. The added <div> is
+ * returned; pass it to splitter_remove_part_toc() to get rid
+ * of it again. Returns NULL if there are no sections.
+ */
+xmlNodePtr splitter_add_part_toc(struct Splitter* p_splitter, xmlNodePtr p_parent_node, struct SectionInfo* p_first_section)
+{
+    struct SectionInfo* p_section = NULL;
+    xmlNodePtr p_div = NULL;
+    int base_level = 7;
+
+    if (!p_parent_node)
+        return NULL;
+
+    for (p_section = p_first_section; p_section; p_section = p_section->p_next) {
+        if (p_section->level <= p_splitter->tocdepth && p_section->level < base_level)
+            base_level = p_section->level;
+    }
+
+    if (base_level > 6) /* No sections within the depth limit */
+        return NULL;
+
+    verbprintf("Adding local Table of Contents.\n");
+
+    p_div = xmlNewDocNode(p_splitter->p_document, NULL, BAD_CAST("div"), NULL);
+    xmlNewProp(p_div, BAD_CAST("class"), BAD_CAST("htmlsplit-parttoc"));
+
+    add_nested_items(p_splitter, xmlNewChild(p_div, NULL, BAD_CAST("ul"), NULL), p_first_section, NULL, base_level, true);
+
+    if (p_parent_node->children)
+        xmlAddPrevSibling(p_parent_node->children, p_div);
+    else
+        xmlAddChild(p_parent_node, p_div);
+
+    return p_div;
+}
+
+/**
+ * Remove the list added by splitter_add_part_toc() from the
+ * document again and free it.
+ */
+void splitter_remove_part_toc(struct Splitter* p_splitter, xmlNodePtr p_parttoc_node)
+{
+    if (p_parttoc_node) {
+        xmlUnlinkNode(p_parttoc_node);
+        xmlFreeNode(p_parttoc_node);
+    }
+}
+
+/* Write one ToC page listing sections [first, last) of `p_pages`
+ * into the stripped document. If `flat` is set, only the topmost
+ * sections of the range are listed, with links to the pages for
+ * the sections below them. `page` is the section the page is for,
+ * -1 for the main ToC file. */
+void write_toc_page(struct Splitter* p_splitter, xmlNodePtr p_parent_node, struct TocPages* p_pages, int page, int first, int last, bool flat)
+{
+    xmlNodePtr p_div = NULL;
+    xmlNodePtr p_list = NULL;
+    xmlChar* toctitle = xmlCharStrdup(p_splitter->tocname);
+    char name[64];
+    int i = 0;
+
+    toc_page_name(page, "html", name);
+
     /* Create base structure */
-    p_node = xmlNewChild(p_parent_node, NULL, BAD_CAST("div"), NULL);
-    xmlNewProp(p_node, BAD_CAST("class"), BAD_CAST("htmlsplit-toc"));
+    p_div = xmlNewChild(p_parent_node, NULL, BAD_CAST("div"), NULL);
+    xmlNewProp(p_div, BAD_CAST("class"), BAD_CAST("htmlsplit-toc"));
 
-    xmlNewTextChild(p_node, NULL, BAD_CAST("h1"), toctitle);
-    p_node = xmlNewChild(p_node, NULL, BAD_CAST("ul"), NULL);
+    xmlNewTextChild(p_div, NULL, BAD_CAST("h1"), toctitle);
+    p_list = xmlNewChild(p_div, NULL, BAD_CAST("ul"), NULL);
 
     /* Add ToC items */
-    p_list = p_node;
-    p_section = p_splitter->p_sectioninfo;
-    while(p_section) {
-        char uri[1024];
+    if (flat) {
+        for(i = first; i < last; i = p_pages->p_ends[i]) {
+            xmlNodePtr p_node = add_item(p_splitter, p_list, p_pages->pp_sections[i], false);
+
+            if (p_pages->p_ends[i] > i + 1) { /* Link to the page with the sections below */
+                char subpage[64];
+
+                toc_page_name(i, "html", subpage);
+                p_node = xmlNewChild(p_node->parent, NULL, BAD_CAST("a"), BAD_CAST("&raquo;"));
+                xmlNewProp(p_node, BAD_CAST("class"), BAD_CAST("htmlsplit-toc-more"));
+                xmlNewProp(p_node, BAD_CAST("href"), BAD_CAST(subpage));
+            }
+        }
+    }
+    else {
+        /* The main ToC starts at level 1 even if there are no <h1> */
+        add_nested_items(p_splitter, p_list,
+                         first < p_pages->num_sections ? p_pages->pp_sections[first] : NULL,
+                         last < p_pages->num_sections ? p_pages->pp_sections[last] : NULL,
+                         page < 0 ? 1 : p_pages->pp_sections[page]->level, false);
+    }
+
+    if (strlen(p_splitter->outdir) > 0)
+        splitter_relocate_links(p_splitter, p_div, false);
+
+    /* Write out */
+    if (strlen(p_splitter->outdir) == 0) { /* stdout requested */
+        printf("%s\n", p_splitter->stdoutsep);
+        splitter_write_part(p_splitter, NULL);
+    }
+    else {
+        char path[PATH_MAX];
+
+        if (snprintf(path, PATH_MAX, "%s/%s", p_splitter->outdir, name) >= PATH_MAX) {
+            fprintf(stderr, "Path of ToC page '%s' is too long.\n", name);
+            exit(ERR_IO);
+        }
+
+        splitter_write_part(p_splitter, path);
+
+        if (p_splitter->tocjson)
+            write_toc_json(p_splitter, p_pages, page, first, last, flat);
+    }
+
+    xmlUnlinkNode(p_div);
+    xmlFreeNode(p_div);
+    xmlFree(toctitle);
+}
 
+/* The ToC page for the sections below section number `page`
+ * (-1 for the main ToC) with the given file extension. */
+void toc_page_name(int page, const char* extension, char* name)
+{
+    if (page < 0)
+        sprintf(name, "toc.%s", extension);
+    else
+        sprintf(name, "toc-%d.%s", page, extension);
+}
+
+/* Add list items for the sections from `p_first` up to, but
+ * excluding, `p_stop` to the list, nesting them by their level.
+ * `base_level` is the level of the items in `p_list` itself. If
+ * `local` is set, the links only contain the anchors. */
+void add_nested_items(struct Splitter* p_splitter, xmlNodePtr p_list, struct SectionInfo* p_first, struct SectionInfo* p_stop, int base_level, bool local)
+{
+    struct SectionInfo* p_section = NULL;
+    int current_level = base_level;
+
+    for (p_section = p_first; p_section != p_stop; p_section = p_section->p_next) {
         /* Honour user-specified depth limit */
-        if (p_splitter->tocdepth < p_section->level) {
-            verbprintf("Section has level %d, which is above the threshold of %d.\n", p_section->level, p_splitter->tocdepth);
-            p_section = p_section->p_next;
+        if (p_splitter->tocdepth < p_section->level)
             continue;
-        }
 
         /* Indentation */
         if (p_section->level < current_level) {
@@ -158,36 +392,93 @@ void splitter_generate_tocfile(struct Splitter* p_splitter)
             }
         }
 
-        /* Preparation */
-        memset(uri, '\0', 1024);
-        sprintf(uri, "%s#%s", p_section->filename, p_section->anchor);
-
         verbprintf("Adding section with level %d to ToC on level %d.\n", p_section->level, current_level);
+        add_item(p_splitter, p_list, p_section, local);
+    }
+}
+
+/* Add a list item linking to the section to the list and return
+ * the link. The section’s content nodes are copied, so that they
+ * can be used for several pages. */
+xmlNodePtr add_item(struct Splitter* p_splitter, xmlNodePtr p_list, struct SectionInfo* p_section, bool local)
+{
+    char uri[PATH_MAX + 8192];
+    xmlNodePtr p_node = NULL;
+
+    /* Preparation */
+    memset(uri, '\0', sizeof(uri));
+    sprintf(uri, "%s#%s", local ? "" : p_section->filename, p_section->anchor);
 
-        /* Add node */
-        p_node = xmlNewChild(p_list, NULL, BAD_CAST("li"), NULL);
-        p_node = xmlNewChild(p_node, NULL, BAD_CAST("a"), NULL);
-        xmlNewProp(p_node, BAD_CAST("href"), BAD_CAST(uri));
-        xmlAddChildList(p_node, p_section->content_nodes);
+    /* Add node */
+    p_node = xmlNewChild(p_list, NULL, BAD_CAST("li"), NULL);
+    p_node = xmlNewChild(p_node, NULL, BAD_CAST("a"), NULL);
+    xmlNewProp(p_node, BAD_CAST("href"), BAD_CAST(uri));
+    xmlAddChildList(p_node, xmlDocCopyNodeList(p_splitter->p_document, p_section->content_nodes));
 
-        /* Next */
-        p_section = p_section->p_next;
+    return p_node;
+}
+
+/* Write the sections of a ToC page as JSON next to it. The file
+ * holds an array of entries [LEVEL,"HREF","TEXT"]; on flat pages,
+ * entries with sections below them have the name of the JSON file
+ * listing those as a fourth element. */
+void write_toc_json(struct Splitter* p_splitter, struct TocPages* p_pages, int page, int first, int last, bool flat)
+{
+    char name[64];
+    char path[PATH_MAX];
+    FILE* p_file = NULL;
+    int i = 0;
+
+    toc_page_name(page, "json", name);
+
+    if (snprintf(path, PATH_MAX, "%s/%s", p_splitter->outdir, name) >= PATH_MAX) {
+        fprintf(stderr, "Path of ToC page '%s' is too long.\n", name);
+        exit(ERR_IO);
     }
 
-    /* Write out */
-    if (strlen(p_splitter->outdir) == 0) { /* stdout requested */
-        printf("%s\n", p_splitter->stdoutsep);
-        splitter_write_part(p_splitter, NULL);
+    verbprintf("Writing file '%s'\n", path);
+
+    p_file = fopen(path, "w");
+    if (!p_file) {
+        int errsav = errno;
+        fprintf(stderr, "Failed to open file '%s': %s\n", path, strerror(errsav));
+        exit(ERR_IO);
     }
-    else {
-        char path[PATH_MAX];
-        memset(path, '\0', PATH_MAX);
 
-        sprintf(path, "%s/toc.html", p_splitter->outdir);
-        splitter_write_part(p_splitter, path);
+    fputc('[', p_file);
+    for(i = first; i < last; i = flat ? p_pages->p_ends[i] : i + 1) {
+        struct SectionInfo* p_section = p_pages->pp_sections[i];
+        char href[PATH_MAX + 8192];
+        xmlNodePtr p_node = NULL;
+        xmlChar* text = NULL;
+
+        /* Text of the heading */
+        for (p_node = p_section->content_nodes; p_node; p_node = p_node->next) {
+            xmlChar* content = xmlNodeGetContent(p_node);
+
+            text = xmlStrcat(text, content ? content : BAD_CAST(""));
+            xmlFree(content);
+        }
+
+        sprintf(href, "%s#%s", p_section->filename, p_section->anchor);
+
+        fprintf(p_file, "%s[%d,", i > first ? "," : "", p_section->level);
+        splitter_write_json_string(p_file, href);
+        fputc(',', p_file);
+        splitter_write_json_string(p_file, text ? (const char*) text : "");
+
+        if (flat && p_pages->p_ends[i] > i + 1) {
+            toc_page_name(i, "json", name);
+            fputc(',', p_file);
+            splitter_write_json_string(p_file, name);
+        }
+
+        fputc(']', p_file);
+        xmlFree(text);
     }
+    fputs("]\n", p_file);
 
-    xmlFree(toctitle);
+    splitter_close_file(p_splitter, p_file, path);
 }
 
 /**
@@ -229,7 +520,13 @@ xmlNodePtr strip_document(struct Splitter* p_splitter)
     return p_parent_node;
 }
 
-xmlChar* detect_target_anchor(struct Splitter* p_splitter, xmlNodePtr p_heading_node)
+/**
+ * Find the anchor name that can be used to link to the
+ * given heading element, using the heuristics described
+ * in the manpage. Returns NULL if there is none; otherwise
+ * free the result with xmlFree().
+ */
+xmlChar* splitter_detect_target_anchor(struct Splitter* p_splitter, xmlNodePtr p_heading_node)
 {
     xmlChar* result = NULL;
     xmlNodePtr p_node = NULL;
@@ -309,3 +606,80 @@ xmlNodePtr copy_heading_contents(struct Splitter* p_splitter, xmlNodePtr p_headi
 
     return p_copy;
 }
+
+/* Append an entry for the heading to the list of sections,
+ * if it can be linked to. */
+void add_section(struct Splitter* p_splitter, xmlNodePtr p_curhead, const char* anchorid, int index, struct SectionInfo** pp_last_section)
+{
+    struct SectionInfo* p_section = NULL;
+
+    /* If this heading as an ID attribute, remember it for later ToC generation. */
+    if (!anchorid || !p_curhead->children) { /* some silly people use empty <h*> tags */
+        verbprintf("This heading has either no anchor or no content, thus no entry in ToC possible.\n");
+        return;
+    }
+
+    p_section = (struct SectionInfo*) xmlMalloc(sizeof(struct SectionInfo));
+
+    verbprintf("Collecting heading for later ToC generation.\n");
+    memset(p_section, '\0', sizeof(struct SectionInfo));
+
+    /* Copy easy things */
+    p_section->level = atoi(((char*) p_curhead->name) + 1); /* Strip leading “h” of h1, h2, etc. */
+    strcpy(p_section->anchor, anchorid);
+    splitter_part_path(p_splitter, index, p_section->filename);
+
+    /* Copy the heading’s content. When memory runs low,
+     * only keep its text instead of a deep copy. */
+    if (governor_pressure() >= GOV_PRESSURE_HIGH) {
+        xmlChar* text = xmlNodeGetContent(p_curhead);
+        p_section->content_nodes = xmlNewDocText(p_splitter->p_document, text);
+        xmlFree(text);
+    }
+    else {
+        p_section->content_nodes = copy_heading_contents(p_splitter, p_curhead);
+    }
+
+    if (!p_section->content_nodes) {
+        fprintf(stderr, "Warning: Failed to copy node list for ToC collection, skipping this heading.\n");
+        xmlFree(p_section);
+        /* continue; */
+        exit(ERR_PARSE); /* DEBUG */
+    }
+
+    /* Advance section linked list */
+    if (*pp_last_section)
+        (*pp_last_section)->p_next = p_section;
+    else /* First section info */
+        p_splitter->p_sectioninfo = p_section;
+    *pp_last_section = p_section;
+}
+
+/* Same as the XPath query in splitter_collect_toc_info(), but
+ * only looking at the headings in the node table that are in
+ * the document for this part: those outside the common parent,
+ * and those in the part’s range below it. */
+void collect_from_table(struct Splitter* p_splitter, int index, struct SectionInfo* p_last_section)
+{
+    struct NodeTable* p_table = p_splitter->p_nodetable;
+    int bounds[6];
+    int i = 0;
+
+    bounds[0] = 0;
+    bounds[1] = p_table->common_parent + 1;
+    splitter_part_range(p_table, index, &bounds[2], &bounds[3]);
+    bounds[4] = p_table->p_entries[p_table->common_parent].end;
+    bounds[5] = p_table->num_entries;
+
+    verbprintf("Collecting ToC info below split point %d from the node table.\n", index);
+
+    for(i=0; i < 6; i += 2) {
+        int heading = splitter_first_heading(p_table, bounds[i]);
+
+        for(; heading < p_table->num_headings && p_table->p_headings[heading] < bounds[i+1]; heading++) {
+            int node = p_table->p_headings[heading];
+
+            add_section(p_splitter, p_table->p_nodes[node], splitter_table_anchor(p_table, node, index), index, &p_last_section);
+        }
+    }
+}
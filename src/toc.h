@@ -7,15 +7,29 @@
  */
 struct SectionInfo {
     xmlNodePtr content_nodes; /*< Contents of the <h*> tag, as an xmlNodePtr array */
-    char filename[1024]; /*< Filename of the file the section is contained in */
+    char filename[PATH_MAX]; /*< Path of the file the section is contained in, relative to the output directory */
     char anchor[8192];   /*< NAME attribute to target for linking to this section */
     int level;           /*< Level. 1 for h1, 2 for h2, etc. */
 
     struct SectionInfo* p_next; /*< Next section */
 };
 
+/**
+ * How the ToC is spread over files.
+ */
+enum tocpages {
+    TOC_PAGES_SINGLE = 0, /*< Everything in toc.html */
+    TOC_PAGES_CHAPTER,    /*< One page per top-level section */
+    TOC_PAGES_LEVEL       /*< One page per section, listing the sections directly below it */
+};
+
+bool splitter_parse_toc_pages(struct Splitter* p_splitter, const char* mode);
 void splitter_generate_tocfile(struct Splitter* p_splitter);
 
-void splitter_collect_toc_info(struct Splitter* p_splitter, int index); /*< \private */
+struct SectionInfo* splitter_collect_toc_info(struct Splitter* p_splitter, int index); /*< \private */
+xmlNodePtr splitter_add_part_toc(struct Splitter* p_splitter, xmlNodePtr p_parent_node, struct SectionInfo* p_first_section); /*< \private */
+void splitter_remove_part_toc(struct Splitter* p_splitter, xmlNodePtr p_parttoc_node); /*< \private */
+void splitter_free_toc_info(struct Splitter* p_splitter); /*< \private */
+xmlChar* splitter_detect_target_anchor(struct Splitter* p_splitter, xmlNodePtr p_heading_node); /*< \private */
 
 #endif
@@ -0,0 +1,196 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <libxml/tree.h>
+#include <libxml/HTMLparser.h>
+#include "split.h"
+#include "trace.h"
+#include "verbose.h"
+
+#ifdef HTMLSPLIT_TRACING
+
+/* Every thread records its events into a ring buffer of its own,
+ * so recording needs neither locks nor atomic operations beyond
+ * registering the buffer once. When a buffer is full, the oldest
+ * events are overwritten. The buffers are only read when the
+ * trace file is written at exit, after all other threads have
+ * finished. They are allocated with plain malloc() so as not to
+ * count against the memory budget. */
+
+#define TRACE_CAPACITY (1 << 16) /* events per thread */
+
+struct TraceEvent {
+    unsigned long long ts; /*< Nanoseconds since trace_start() */
+    const char* name;
+    int part;
+    char phase;            /*< 'B' for begin, 'E' for end */
+};
+
+struct TraceBuffer {
+    struct TraceEvent* p_events;
+    unsigned long long count; /*< Events recorded, including overwritten ones */
+    int tid;
+    struct TraceBuffer* p_next;
+};
+
+bool g_htmlsplit_tracing = false; /* Extern */
+
+static __thread struct TraceBuffer* ts_buffer = NULL;
+static struct TraceBuffer* volatile s_buffers = NULL;
+static int s_next_tid = 0;
+static struct timespec s_start;
+static FILE* s_file = NULL;
+
+static struct TraceBuffer* register_buffer();
+static void write_buffer(struct TraceBuffer* p_buffer, bool* p_first);
+
+/**
+ * Start recording trace events, to be written to `path` as
+ * Chrome trace-event JSON at exit. Returns false if tracing
+ * was not compiled in.
+ */
+bool trace_start(const char* path)
+{
+    s_file = fopen(path, "w");
+    if (!s_file) {
+        int errsav = errno;
+        fprintf(stderr, "Failed to open file '%s': %s\n", path, strerror(errsav));
+        exit(ERR_IO);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &s_start);
+    g_htmlsplit_tracing = true;
+
+    atexit(trace_finish);
+    return true;
+}
+
+/**
+ * Record an event; use the TRACE_BEGIN() and TRACE_END()
+ * macros instead of calling this directly.
+ */
+void trace_event(char phase, const char* name, int part)
+{
+    struct TraceBuffer* p_buffer = ts_buffer;
+    struct TraceEvent* p_event = NULL;
+    struct timespec now;
+
+    if (!p_buffer) {
+        p_buffer = register_buffer();
+        if (!p_buffer)
+            return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    p_event = &p_buffer->p_events[p_buffer->count++ % TRACE_CAPACITY];
+    p_event->ts    = (unsigned long long) (now.tv_sec - s_start.tv_sec) * 1000000000ULL + now.tv_nsec - s_start.tv_nsec;
+    p_event->name  = name;
+    p_event->part  = part;
+    p_event->phase = phase;
+}
+
+/**
+ * Write all recorded events to the trace file and free the
+ * buffers. Registered with atexit() by trace_start().
+ */
+void trace_finish()
+{
+    struct TraceBuffer* p_buffer = NULL;
+    bool first = true;
+
+    if (!s_file)
+        return;
+
+    g_htmlsplit_tracing = false;
+
+    fprintf(s_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    for (p_buffer = s_buffers; p_buffer; p_buffer = p_buffer->p_next)
+        write_buffer(p_buffer, &first);
+
+    fprintf(s_file, "]}\n");
+    fclose(s_file);
+    s_file = NULL;
+
+    while (s_buffers) {
+        p_buffer  = s_buffers;
+        s_buffers = p_buffer->p_next;
+
+        free(p_buffer->p_events);
+        free(p_buffer);
+    }
+}
+
+/* Create the calling thread's buffer and add it to the list */
+struct TraceBuffer* register_buffer()
+{
+    struct TraceBuffer* p_buffer = (struct TraceBuffer*) malloc(sizeof(struct TraceBuffer));
+
+    if (!p_buffer)
+        return NULL;
+
+    p_buffer->p_events = (struct TraceEvent*) malloc(TRACE_CAPACITY * sizeof(struct TraceEvent));
+    if (!p_buffer->p_events) {
+        free(p_buffer);
+        return NULL;
+    }
+
+    p_buffer->count = 0;
+    p_buffer->tid   = __sync_fetch_and_add(&s_next_tid, 1);
+
+    do {
+        p_buffer->p_next = s_buffers;
+    } while (!__sync_bool_compare_and_swap(&s_buffers, p_buffer->p_next, p_buffer));
+
+    ts_buffer = p_buffer;
+    return p_buffer;
+}
+
+void write_buffer(struct TraceBuffer* p_buffer, bool* p_first)
+{
+    unsigned long long i = 0;
+    int depth = 0;
+
+    if (p_buffer->count > TRACE_CAPACITY) {
+        i = p_buffer->count - TRACE_CAPACITY;
+        verbprintf("Trace buffer of thread %d overflowed, dropped the oldest %llu events.\n", p_buffer->tid, i);
+    }
+
+    fprintf(s_file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            *p_first ? "" : ",", p_buffer->tid, p_buffer->tid == 0 ? "main" : "worker");
+    *p_first = false;
+
+    for (; i < p_buffer->count; i++) {
+        struct TraceEvent* p_event = &p_buffer->p_events[i % TRACE_CAPACITY];
+
+        /* The begin events of spans may have been overwritten */
+        if (p_event->phase == 'E' && depth == 0)
+            continue;
+        depth += p_event->phase == 'B' ? 1 : -1;
+
+        fprintf(s_file, ",{\"name\":\"%s\",\"cat\":\"htmlsplit\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":1,\"tid\":%d",
+                p_event->name, p_event->phase, p_event->ts / 1000, p_event->ts % 1000, p_buffer->tid);
+
+        if (p_event->part >= 0)
+            fprintf(s_file, ",\"args\":{\"part\":%d}", p_event->part);
+
+        fputc('}', s_file);
+    }
+}
+
+#else
+
+bool trace_start(const char* path)
+{
+    return false;
+}
+
+void trace_finish()
+{
+}
+
+#endif /* HTMLSPLIT_TRACING */
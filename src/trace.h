@@ -0,0 +1,27 @@
+#ifndef HTMLSPLIT_TRACE_H
+#define HTMLSPLIT_TRACE_H
+
+#include "htmlsplit_config.h"
+
+/* Tracing is only compiled in with the HTMLSPLIT_TRACING CMake
+ * option. Otherwise the macros below expand to nothing, and when
+ * compiled in, they only cost a branch unless --trace was given.
+ * `name` must be a string literal (only the pointer is kept) and
+ * `part` the number of the part concerned, or -1. */
+
+#ifdef HTMLSPLIT_TRACING
+extern bool g_htmlsplit_tracing;
+
+void trace_event(char phase, const char* name, int part);
+
+#define TRACE_BEGIN(name, part) do { if (g_htmlsplit_tracing) trace_event('B', (name), (part)); } while (0)
+#define TRACE_END(name, part)   do { if (g_htmlsplit_tracing) trace_event('E', (name), (part)); } while (0)
+#else
+#define TRACE_BEGIN(name, part) ((void) 0)
+#define TRACE_END(name, part)   ((void) 0)
+#endif
+
+bool trace_start(const char* path);
+void trace_finish();
+
+#endif
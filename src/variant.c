@@ -0,0 +1,359 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
+#include <libxml/HTMLparser.h>
+#include "split.h"
+#include "variant.h"
+#include "io.h"
+#include "toc.h"
+#include "template.h"
+#include "nodetable.h"
+#include "resource.h"
+#include "writer.h"
+#include "governor.h"
+#include "trace.h"
+#include "verbose.h"
+
+/* Every variant is split by a Splitter instance of its own that
+ * starts out with the options of the main one. The input is parsed
+ * only once; as splitting, link relocation, asset externalisation
+ * and ToC generation all modify the document, each variant works
+ * on a copy of it, except for the last one, which takes over the
+ * parsed document itself. Copying a tree is much cheaper than
+ * parsing it again. */
+
+struct VariantPool {
+    struct Splitter* p_splitter;
+    int next;               /*< Next variant to split */
+    pthread_mutex_t mutex;
+};
+
+static bool apply_setting(struct Variant* p_variant, char* setting);
+static void take_document(struct Splitter* p_splitter, int index);
+static void make_output_dir(const char* path);
+static void split_variant(struct Variant* p_variant);
+static void* variant_worker(void* p_arg);
+
+/**
+ * Add a variant from a specification of the form NAME:SETTINGS
+ * (see the manpage). The settings are only checked by
+ * splitter_setup_variants(), once all other options are known.
+ * Returns false if the name is invalid.
+ */
+bool splitter_add_variant(struct Splitter* p_splitter, const char* spec)
+{
+    struct Variant* p_variant = NULL;
+    const char* p_colon = strchr(spec, ':');
+    size_t namelen = p_colon ? (size_t) (p_colon - spec) : strlen(spec);
+    size_t i = 0;
+
+    if (namelen == 0 || namelen >= sizeof(p_variant->name))
+        return false;
+
+    for(i=0; i < namelen; i++) {
+        if (!isalnum((unsigned char) spec[i]) && spec[i] != '-' && spec[i] != '_' && spec[i] != '.')
+            return false;
+    }
+
+    /* Options are parsed before the memory governor hooks into
+     * libxml2, so this must not allocate through libxml2. */
+    p_splitter->p_variants = (struct Variant*) realloc(p_splitter->p_variants, (p_splitter->num_variants + 1) * sizeof(struct Variant));
+    if (!p_splitter->p_variants) {
+        perror("Failed to allocate memory for the variant list");
+        exit(ERR_MEM);
+    }
+
+    p_variant = &p_splitter->p_variants[p_splitter->num_variants++];
+    memset(p_variant, '\0', sizeof(struct Variant));
+
+    memcpy(p_variant->name, spec, namelen);
+    p_variant->settings = (char*) malloc(strlen(spec) - namelen + 1);
+    if (!p_variant->settings) {
+        perror("Failed to allocate memory for the variant settings");
+        exit(ERR_MEM);
+    }
+    strcpy(p_variant->settings, p_colon ? p_colon + 1 : "");
+
+    return true;
+}
+
+/**
+ * Create the Splitter instances for all variants, applying their
+ * settings on top of the main options. Exits with ERR_CLI on
+ * invalid settings, so call this before reading the input.
+ */
+void splitter_setup_variants(struct Splitter* p_splitter)
+{
+    int i = 0;
+
+    for(i=0; i < p_splitter->num_variants; i++) {
+        struct Variant* p_variant = &p_splitter->p_variants[i];
+        struct Splitter* p_vsplitter = splitter_new();
+        char* setting = NULL;
+
+        if (!p_vsplitter)
+            exit(ERR_MEM);
+
+        /* All user options come before the internal fields */
+        memcpy(p_vsplitter, p_splitter, offsetof(struct Splitter, p_document));
+        p_variant->p_splitter = p_vsplitter;
+
+        /* Variants would overwrite each other's search index and dependency file */
+        p_vsplitter->searchindex[0] = '\0';
+        p_vsplitter->depsfile[0]    = '\0';
+
+        if (strlen(p_splitter->outdir) > 0) {
+            if (snprintf(p_vsplitter->outdir, PATH_MAX, "%s/%s", p_splitter->outdir, p_variant->name) >= PATH_MAX) {
+                fprintf(stderr, "Output directory for variant '%s' is too long.\n", p_variant->name);
+                exit(ERR_CLI);
+            }
+        }
+
+        for(setting = strtok(p_variant->settings, ";"); setting; setting = strtok(NULL, ";")) {
+            if (!apply_setting(p_variant, setting)) {
+                fprintf(stderr, "Invalid setting '%s' for variant '%s'.\n", setting, p_variant->name);
+                exit(ERR_CLI);
+            }
+        }
+
+        if (strlen(p_vsplitter->outdir) == 0) {
+            fprintf(stderr, "Variant '%s' needs an output directory; use -o or set 'o'.\n", p_variant->name);
+            exit(ERR_CLI);
+        }
+    }
+}
+
+/**
+ * Read and parse the input once, then split it for every variant,
+ * using up to `variantthreads` threads. Each variant also gets its
+ * ToC, if it asks for one.
+ */
+void splitter_split_variants(struct Splitter* p_splitter)
+{
+    struct VariantPool pool;
+    pthread_t* p_threads = NULL;
+    int num_threads = p_splitter->variantthreads;
+    int i = 0;
+
+    splitter_read_input(p_splitter);
+
+    if (!p_splitter->p_document) {
+        fprintf(stderr, "Failed to parse document file '%s'.\n", p_splitter->infile);
+        exit(ERR_PARSE);
+    }
+
+    if (num_threads > p_splitter->num_variants)
+        num_threads = p_splitter->num_variants;
+
+    if (num_threads <= 1) {
+        /* One at a time: copy the document just before it is
+         * needed, so at most two copies exist at once. */
+        for(i=0; i < p_splitter->num_variants && !governor_time_exceeded(); i++) {
+            struct Splitter* p_vsplitter = p_splitter->p_variants[i].p_splitter;
+
+            take_document(p_splitter, i);
+            split_variant(&p_splitter->p_variants[i]);
+
+            /* Give the memory back before the next copy is made;
+             * the node table and resources point into the document. */
+            splitter_free_node_table(p_vsplitter);
+            splitter_free_resources(p_vsplitter);
+            xmlFreeDoc(p_vsplitter->p_document);
+            p_vsplitter->p_document = NULL;
+        }
+
+        return;
+    }
+
+    /* The copies must all be made before any variant starts
+     * modifying the document they are made from. */
+    for(i=0; i < p_splitter->num_variants; i++)
+        take_document(p_splitter, i);
+
+    verbprintf("Splitting %d variants with %d threads.\n", p_splitter->num_variants, num_threads);
+
+    pool.p_splitter = p_splitter;
+    pool.next       = 0;
+    pthread_mutex_init(&pool.mutex, NULL);
+
+    p_threads = (pthread_t*) xmlMalloc(num_threads * sizeof(pthread_t));
+    if (!p_threads) {
+        perror("Failed to allocate memory for the variant threads");
+        exit(ERR_MEM);
+    }
+
+    for(i=0; i < num_threads; i++) {
+        if (pthread_create(&p_threads[i], NULL, variant_worker, &pool) != 0) {
+            perror("Failed to start variant thread");
+            exit(ERR_MEM);
+        }
+    }
+
+    for(i=0; i < num_threads; i++)
+        pthread_join(p_threads[i], NULL);
+
+    pthread_mutex_destroy(&pool.mutex);
+    xmlFree(p_threads);
+}
+
+/**
+ * Ask all variants to stop; safe to call from a signal handler.
+ */
+void splitter_terminate_variants(struct Splitter* p_splitter)
+{
+    int i = 0;
+
+    for(i=0; i < p_splitter->num_variants; i++) {
+        if (p_splitter->p_variants[i].p_splitter)
+            p_splitter->p_variants[i].p_splitter->terminate = true;
+    }
+}
+
+/**
+ * Free all variants and their Splitter instances.
+ */
+void splitter_free_variants(struct Splitter* p_splitter)
+{
+    int i = 0;
+
+    for(i=0; i < p_splitter->num_variants; i++) {
+        if (p_splitter->p_variants[i].p_splitter) {
+            p_splitter->p_variants[i].p_splitter->p_template = NULL; /* Owned by the main instance */
+            splitter_free(p_splitter->p_variants[i].p_splitter);
+        }
+
+        free(p_splitter->p_variants[i].settings);
+    }
+
+    free(p_splitter->p_variants);
+    p_splitter->p_variants   = NULL;
+    p_splitter->num_variants = 0;
+}
+
+/* Apply one KEY=VALUE setting to the variant. The settings
+ * mirror the command-line options of the same name. */
+bool apply_setting(struct Variant* p_variant, char* setting)
+{
+    struct Splitter* p_vsplitter = p_variant->p_splitter;
+    char* value = strchr(setting, '=');
+
+    if (value)
+        *value++ = '\0';
+
+    if (strcmp(setting, "l") == 0) {
+        if (value && strcmp(value, "0") != 0 && strcmp(value, "1") != 0)
+            return false;
+
+        p_vsplitter->interlink = !value || strcmp(value, "1") == 0;
+        return true;
+    }
+
+    if (!value)
+        return false;
+
+    if (strcmp(setting, "x") == 0 && strlen(value) < sizeof(p_vsplitter->splitexpr))
+        strcpy(p_vsplitter->splitexpr, value);
+    else if (strcmp(setting, "o") == 0 && strlen(value) > 0 && strlen(value) < PATH_MAX)
+        strcpy(p_vsplitter->outdir, value);
+    else if (strcmp(setting, "t") == 0)
+        p_vsplitter->tocdepth = atoi(value);
+    else if (strcmp(setting, "T") == 0 && strlen(value) < sizeof(p_vsplitter->tocname))
+        strcpy(p_vsplitter->tocname, value);
+    else if (strcmp(setting, "name-pattern") == 0 && strlen(value) < sizeof(p_vsplitter->namepattern) / 2)
+        strcpy(p_vsplitter->namepattern, value);
+    else if (strcmp(setting, "search-index") == 0 && strlen(value) < PATH_MAX)
+        strcpy(p_vsplitter->searchindex, value);
+    else if (strcmp(setting, "deps-file") == 0 && strlen(value) < PATH_MAX)
+        strcpy(p_vsplitter->depsfile, value);
+    else
+        return false;
+
+    return true;
+}
+
+/* Give variant number `index` its document: a copy of the parsed
+ * one, or the parsed one itself for the last variant. */
+void take_document(struct Splitter* p_splitter, int index)
+{
+    struct Splitter* p_vsplitter = p_splitter->p_variants[index].p_splitter;
+
+    /* The compiled template is only read, so it can be shared */
+    p_vsplitter->p_template = p_splitter->p_template;
+
+    if (index == p_splitter->num_variants - 1) {
+        p_vsplitter->p_document = p_splitter->p_document;
+        p_splitter->p_document  = NULL;
+        return;
+    }
+
+    p_vsplitter->p_document = xmlCopyDoc(p_splitter->p_document, 1);
+
+    if (!p_vsplitter->p_document) {
+        fprintf(stderr, "Failed to copy the document for variant '%s'.\n", p_splitter->p_variants[index].name);
+        exit(ERR_MEM);
+    }
+}
+
+void make_output_dir(const char* path)
+{
+    verbprintf("Creating directory '%s'.\n", path);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        int errsav = errno;
+        fprintf(stderr, "Failed to create directory '%s': %s\n", path, strerror(errsav));
+        exit(ERR_IO);
+    }
+}
+
+/* Split the variant's copy of the document and write its ToC */
+void split_variant(struct Variant* p_variant)
+{
+    struct Splitter* p_vsplitter = p_variant->p_splitter;
+
+    verbprintf("Splitting variant '%s' at '%s' into '%s'.\n", p_variant->name, p_vsplitter->splitexpr, p_vsplitter->outdir);
+
+    make_output_dir(p_vsplitter->outdir);
+    splitter_sync_directory(p_vsplitter, p_vsplitter->outdir);
+
+    TRACE_BEGIN("variant", -1);
+    splitter_split_document(p_vsplitter);
+    TRACE_END("variant", -1);
+
+    if (governor_time_exceeded() || p_vsplitter->terminate)
+        return;
+
+    if (p_vsplitter->tocdepth > 0) {
+        if (governor_pressure() < GOV_PRESSURE_CRITICAL)
+            splitter_generate_tocfile(p_vsplitter);
+        else
+            fprintf(stderr, "Warning: Not generating the ToC file of variant '%s' due to memory pressure.\n", p_variant->name);
+    }
+}
+
+void* variant_worker(void* p_arg)
+{
+    struct VariantPool* p_pool = (struct VariantPool*) p_arg;
+
+    while (!governor_time_exceeded()) {
+        int index = 0;
+
+        pthread_mutex_lock(&p_pool->mutex);
+        index = p_pool->next++;
+        pthread_mutex_unlock(&p_pool->mutex);
+
+        if (index >= p_pool->p_splitter->num_variants)
+            break;
+
+        split_variant(&p_pool->p_splitter->p_variants[index]);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,20 @@
+#ifndef HTMLSPLIT_VARIANT_H
+#define HTMLSPLIT_VARIANT_H
+
+/**
+ * One named split configuration, as given with --variant.
+ */
+struct Variant {
+    char name[256];
+    char* settings;                 /*< Settings part of the specification, applied by splitter_setup_variants() */
+    struct Splitter* p_splitter;    /*< Splitter for this variant, sharing the parsed input */
+};
+
+bool splitter_add_variant(struct Splitter* p_splitter, const char* spec);
+void splitter_setup_variants(struct Splitter* p_splitter);
+void splitter_split_variants(struct Splitter* p_splitter);
+void splitter_terminate_variants(struct Splitter* p_splitter);
+
+void splitter_free_variants(struct Splitter* p_splitter); /*< \private */
+
+#endif
@@ -0,0 +1,422 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <libxml/tree.h>
+#include <libxml/HTMLparser.h>
+#include "split.h"
+#include "watch.h"
+#include "io.h"
+#include "parse.h"
+#include "toc.h"
+#include "layout.h"
+#include "dedup.h"
+#include "trace.h"
+#include "governor.h"
+#include "verbose.h"
+
+/* In watch mode, the input file is split again whenever it changes
+ * ("a cycle"), but only the parts whose content may have changed are
+ * written. That is decided from the raw input before it is parsed:
+ * the quick scan for parallel parsing finds the split points' byte
+ * offsets, and the bytes of every part as well as the bytes outside
+ * of all parts (the "skeleton", which includes part 0) are hashed.
+ * A part is written again if its hash or the skeleton's hash changed
+ * since the last cycle, or if the number of parts did. The parts are
+ * still sliced, so that the ToC and search index are complete, but
+ * serialising and writing them is skipped.
+ *
+ * Where the scan cannot tell the split points (see parse.c), every
+ * part is written in every cycle. Each cycle uses a Splitter of its
+ * own, set up from the user options like a variant's. */
+
+#define WATCH_SETTLE_MS 100 /* Quiet time after a change before splitting */
+
+struct Watch {
+    struct Splitter* p_cycle;            /*< Splitter of the cycle in progress, if any */
+    unsigned long long filehash;         /*< Hash of the entire input in the last cycle */
+    bool complete;                       /*< Whether the last cycle wrote all its files */
+    bool valid;                          /*< Whether the hashes below describe the files written */
+    unsigned long long skeleton;         /*< Hash of the input outside the parts */
+    unsigned long long* p_hashes;        /*< Hash of each part's bytes; index 0 is unused */
+    int total;                           /*< Number of split points */
+    unsigned long long next_skeleton;    /*< Same as the above for the cycle in progress */
+    unsigned long long* p_next_hashes;
+    int next_total;                      /*< -1 if the split points could not be found */
+    int split_total;                     /*< Number of split points found by the XPath expression */
+    xmlChar** pp_paths;                  /*< Part files of the last cycle */
+    int num_paths;
+    xmlChar** pp_next_paths;
+    int rewritten;                       /*< Parts written in the cycle in progress */
+};
+
+static void run_cycle(struct Splitter* p_splitter);
+static bool hash_input(struct Watch* p_watch, struct Splitter* p_splitter, const char* p_buffer, size_t size);
+static void finish_cycle(struct Watch* p_watch, bool complete);
+static void remove_stale_parts(struct Splitter* p_splitter, struct Watch* p_watch);
+static void free_paths(xmlChar** pp_paths, int num_paths);
+static double elapsed_ms(struct timespec* p_start);
+
+/**
+ * Split the input file, then wait for it to change and split it
+ * again, until terminated with splitter_terminate_watch(). Every
+ * cycle reports how long it took and how many parts it wrote.
+ */
+void splitter_watch(struct Splitter* p_splitter)
+{
+    char dir[PATH_MAX];
+    const char* p_base = strrchr(p_splitter->infile, '/');
+    bool pending = false;
+    int fd = -1;
+
+    p_splitter->p_watch = (struct Watch*) xmlMalloc(sizeof(struct Watch));
+    if (!p_splitter->p_watch) {
+        perror("Failed to allocate watch state");
+        exit(ERR_MEM);
+    }
+    memset(p_splitter->p_watch, '\0', sizeof(struct Watch));
+
+    /* Editors often replace the file rather than writing to it,
+     * so the directory is watched for the file's name. */
+    memset(dir, '\0', PATH_MAX);
+    if (p_base) {
+        strncpy(dir, p_splitter->infile, p_base - p_splitter->infile);
+        if (dir[0] == '\0')
+            strcpy(dir, "/");
+        p_base++;
+    }
+    else {
+        strcpy(dir, ".");
+        p_base = p_splitter->infile;
+    }
+
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        int errsav = errno;
+        fprintf(stderr, "Failed to watch directory '%s': %s\n", dir, strerror(errsav));
+        exit(ERR_IO);
+    }
+
+    run_cycle(p_splitter);
+
+    while (!p_splitter->terminate) {
+        struct pollfd pfd;
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len = 0;
+        ssize_t pos = 0;
+        int ready = 0;
+
+        pfd.fd      = fd;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+
+        ready = poll(&pfd, 1, pending ? WATCH_SETTLE_MS : -1);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("Failed to wait for changes");
+            exit(ERR_IO);
+        }
+        else if (ready == 0) { /* Changes have settled */
+            pending = false;
+            run_cycle(p_splitter);
+            continue;
+        }
+
+        len = read(fd, events, sizeof(events));
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("Failed to read file change events");
+            exit(ERR_IO);
+        }
+
+        while (pos < len) {
+            struct inotify_event* p_event = (struct inotify_event*) (events + pos);
+
+            if (p_event->len > 0 && strcmp(p_event->name, p_base) == 0)
+                pending = true;
+
+            pos += sizeof(struct inotify_event) + p_event->len;
+        }
+    }
+
+    close(fd);
+}
+
+/**
+ * Stop watching, after the cycle in progress (if any) has been
+ * abandoned. Safe to call from a signal handler.
+ */
+void splitter_terminate_watch(struct Splitter* p_splitter)
+{
+    if (p_splitter->p_watch && p_splitter->p_watch->p_cycle)
+        p_splitter->p_watch->p_cycle->terminate = true;
+}
+
+/**
+ * Whether part number `index` of `total` may have changed since
+ * the last cycle and must be written again. Always true outside
+ * of watch mode.
+ */
+bool splitter_watch_part_changed(struct Splitter* p_splitter, int index, int total)
+{
+    struct Watch* p_watch = p_splitter->p_watch;
+    char path[PATH_MAX];
+
+    if (!p_watch)
+        return true;
+
+    /* Remember the file for removing it once it is stale */
+    if (!p_watch->pp_next_paths) {
+        p_watch->pp_next_paths = (xmlChar**) xmlMalloc((total + 1) * sizeof(xmlChar*));
+        if (!p_watch->pp_next_paths) {
+            perror("Failed to allocate watch state");
+            exit(ERR_MEM);
+        }
+        memset(p_watch->pp_next_paths, '\0', (total + 1) * sizeof(xmlChar*));
+        p_watch->split_total = total;
+    }
+
+    memset(path, '\0', PATH_MAX);
+    splitter_part_path(p_splitter, index, path);
+    p_watch->pp_next_paths[index] = xmlStrdup(BAD_CAST(path));
+
+    /* With --dedup, all parts go into the manifest or links every time */
+    if (p_watch->valid && p_splitter->dedupmode == DEDUP_NONE
+        && p_watch->next_total == total && p_watch->total == total
+        && p_watch->next_skeleton == p_watch->skeleton
+        && (index == 0 || p_watch->p_next_hashes[index] == p_watch->p_hashes[index]))
+        return false;
+
+    p_watch->rewritten++;
+    return true;
+}
+
+/**
+ * Free the watch state.
+ */
+void splitter_free_watch(struct Splitter* p_splitter)
+{
+    struct Watch* p_watch = p_splitter->p_watch;
+
+    if (!p_watch)
+        return;
+
+    xmlFree(p_watch->p_hashes);
+    xmlFree(p_watch->p_next_hashes);
+    free_paths(p_watch->pp_paths, p_watch->num_paths);
+    free_paths(p_watch->pp_next_paths, p_watch->split_total + 1);
+    xmlFree(p_watch);
+
+    p_splitter->p_watch = NULL;
+}
+
+/* Read, parse, and split the input once more */
+void run_cycle(struct Splitter* p_splitter)
+{
+    struct Watch* p_watch = p_splitter->p_watch;
+    struct Splitter* p_cycle = NULL;
+    struct timespec start;
+    FILE* p_file = NULL;
+    char* p_buffer = NULL;
+    size_t size = 0;
+    bool complete = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TRACE_BEGIN("watch-cycle", -1);
+
+    p_file = fopen(p_splitter->infile, "rb");
+    if (!p_file) {
+        int errsav = errno;
+        fprintf(stderr, "Failed to open file '%s': %s\n", p_splitter->infile, strerror(errsav));
+        TRACE_END("watch-cycle", -1);
+        return; /* Maybe it is being replaced; try again on the next change */
+    }
+
+    verbprintf("Reading file '%s'.\n", p_splitter->infile);
+    p_buffer = splitter_read_stream(p_file, &size);
+    fclose(p_file);
+
+    if (!hash_input(p_watch, p_splitter, p_buffer, size)) {
+        verbprintf("File '%s' is unchanged.\n", p_splitter->infile);
+        xmlFree(p_buffer);
+        TRACE_END("watch-cycle", -1);
+        return;
+    }
+
+    p_cycle = splitter_new();
+    if (!p_cycle)
+        exit(ERR_MEM);
+
+    /* All user options come before the internal fields */
+    memcpy(p_cycle, p_splitter, offsetof(struct Splitter, p_document));
+    p_cycle->p_template = p_splitter->p_template;
+    p_cycle->p_watch    = p_watch;
+    p_watch->p_cycle    = p_cycle;
+    p_watch->rewritten  = 0;
+
+    p_cycle->p_document = splitter_parse_buffer(p_cycle, p_buffer, size, p_splitter->infile);
+    xmlFree(p_buffer);
+
+    if (!p_cycle->p_document) {
+        fprintf(stderr, "Failed to parse document file '%s'.\n", p_splitter->infile);
+    }
+    else {
+        splitter_split_document(p_cycle);
+
+        if (!p_cycle->terminate && p_cycle->tocdepth > 0) {
+            if (governor_pressure() < GOV_PRESSURE_CRITICAL)
+                splitter_generate_tocfile(p_cycle);
+            else
+                fprintf(stderr, "Warning: Not generating the ToC file due to memory pressure.\n");
+        }
+
+        complete = !p_cycle->terminate;
+    }
+
+    if (complete)
+        remove_stale_parts(p_cycle, p_watch);
+
+    p_watch->p_cycle = NULL;
+    p_cycle->p_template = NULL; /* Owned by the main instance */
+    p_cycle->p_watch    = NULL;
+    splitter_free(p_cycle);
+
+    if (complete) {
+        printf("Split '%s' in %.1f ms, wrote %d of %d parts.\n",
+               p_splitter->infile, elapsed_ms(&start), p_watch->rewritten, p_watch->split_total + 1);
+        fflush(stdout);
+    }
+
+    finish_cycle(p_watch, complete);
+    TRACE_END("watch-cycle", -1);
+}
+
+/* Hash the parts and the skeleton of the input for the next cycle.
+ * Returns false if the input did not change at all. */
+bool hash_input(struct Watch* p_watch, struct Splitter* p_splitter, const char* p_buffer, size_t size)
+{
+    unsigned long long filehash = splitter_hash_bytes(SPLITTER_HASH_INIT, p_buffer, size);
+    size_t* p_boundaries = NULL;
+    size_t tail = 0;
+    int count = 0;
+    int i = 0;
+
+    if (p_watch->complete && filehash == p_watch->filehash)
+        return false;
+
+    p_watch->filehash   = filehash;
+    p_watch->next_total = -1;
+
+    if (!splitter_find_boundaries(p_splitter, p_buffer, size, &p_boundaries, &count, &tail) || count == 0) {
+        verbprintf("Split points not found in the raw input, writing all parts.\n");
+        xmlFree(p_boundaries);
+        return true;
+    }
+
+    p_watch->p_next_hashes = (unsigned long long*) xmlMalloc((count + 1) * sizeof(unsigned long long));
+    if (!p_watch->p_next_hashes) {
+        perror("Failed to allocate watch state");
+        exit(ERR_MEM);
+    }
+
+    p_watch->next_skeleton = splitter_hash_bytes(SPLITTER_HASH_INIT, p_buffer, p_boundaries[0]);
+    p_watch->next_skeleton = splitter_hash_bytes(p_watch->next_skeleton, p_buffer + tail, size - tail);
+
+    p_watch->p_next_hashes[0] = 0;
+    for(i = 1; i <= count; i++) {
+        size_t end = i < count ? p_boundaries[i] : tail;
+
+        p_watch->p_next_hashes[i] = splitter_hash_bytes(SPLITTER_HASH_INIT, p_buffer + p_boundaries[i-1], end - p_boundaries[i-1]);
+    }
+
+    p_watch->next_total = count;
+    xmlFree(p_boundaries);
+    return true;
+}
+
+/* Make the state of the cycle just finished the one to compare
+ * the next cycle against */
+void finish_cycle(struct Watch* p_watch, bool complete)
+{
+    xmlFree(p_watch->p_hashes);
+    p_watch->p_hashes      = p_watch->p_next_hashes;
+    p_watch->p_next_hashes = NULL;
+    p_watch->skeleton      = p_watch->next_skeleton;
+    p_watch->total         = p_watch->next_total;
+
+    /* The hashes only describe the parts if the scan found the
+     * same split points as the XPath expression */
+    p_watch->complete = complete;
+    p_watch->valid    = complete && p_watch->next_total == p_watch->split_total;
+
+    if (complete) {
+        free_paths(p_watch->pp_paths, p_watch->num_paths);
+        p_watch->pp_paths  = p_watch->pp_next_paths;
+        p_watch->num_paths = p_watch->split_total + 1;
+    }
+    else {
+        free_paths(p_watch->pp_next_paths, p_watch->split_total + 1);
+    }
+
+    p_watch->pp_next_paths = NULL;
+    p_watch->split_total   = 0;
+}
+
+/* Remove the part files of the last cycle that this cycle did
+ * not write, because there are fewer parts or their names changed */
+void remove_stale_parts(struct Splitter* p_splitter, struct Watch* p_watch)
+{
+    int i = 0;
+
+    for(i=0; i < p_watch->num_paths; i++) {
+        char path[PATH_MAX];
+
+        if (!p_watch->pp_paths[i])
+            continue;
+
+        if (i <= p_watch->split_total && p_watch->pp_next_paths
+            && p_watch->pp_next_paths[i] && xmlStrEqual(p_watch->pp_paths[i], p_watch->pp_next_paths[i]))
+            continue;
+
+        if (snprintf(path, PATH_MAX, "%s/%s", p_splitter->outdir, (const char*) p_watch->pp_paths[i]) >= PATH_MAX)
+            continue; /* Too long to have been written */
+
+        verbprintf("Removing stale part '%s'.\n", path);
+
+        if (unlink(path) != 0 && errno != ENOENT) {
+            int errsav = errno;
+            fprintf(stderr, "Warning: Failed to remove file '%s': %s\n", path, strerror(errsav));
+        }
+    }
+}
+
+void free_paths(xmlChar** pp_paths, int num_paths)
+{
+    int i = 0;
+
+    if (!pp_paths)
+        return;
+
+    for(i=0; i < num_paths; i++)
+        xmlFree(pp_paths[i]);
+    xmlFree(pp_paths);
+}
+
+double elapsed_ms(struct timespec* p_start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - p_start->tv_sec) * 1000.0 + (now.tv_nsec - p_start->tv_nsec) / 1000000.0;
+}
@@ -0,0 +1,12 @@
+#ifndef HTMLSPLIT_WATCH_H
+#define HTMLSPLIT_WATCH_H
+
+struct Watch; /* opaque; see watch.c */
+
+void splitter_watch(struct Splitter* p_splitter);
+void splitter_terminate_watch(struct Splitter* p_splitter);
+
+bool splitter_watch_part_changed(struct Splitter* p_splitter, int index, int total); /*< \private */
+void splitter_free_watch(struct Splitter* p_splitter); /*< \private */
+
+#endif
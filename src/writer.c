@@ -0,0 +1,632 @@
+/* syscall() and syncfs() are GNU extensions */
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <libxml/tree.h>
+#include <libxml/HTMLparser.h>
+#include "htmlsplit_config.h"
+#include "split.h"
+#include "governor.h"
+#include "dedup.h"
+#include "writer.h"
+#include "trace.h"
+#include "verbose.h"
+
+#ifdef HTMLSPLIT_HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+/* With --async-write, files are written through io_uring. Each
+ * file is a small state machine (open, write until done, fsync if
+ * requested, close) of which only one operation at a time is with
+ * the kernel; at most `writedepth` files are in flight, so that
+ * the memory held by their contents is bounded. Completions are
+ * collected whenever a new file is submitted, and waited for only
+ * when all slots are taken. liburing is not needed, the few
+ * system calls are made directly.
+ *
+ * Without io_uring (not compiled in, or refused by the kernel),
+ * and without --async-write, files are written with plain
+ * blocking system calls.
+ *
+ * The few files written piecemeal through stdio (search index,
+ * JSON ToC, dependency file, dedup manifest) are fsync()ed when
+ * closed in both durability modes, as they need not be on the
+ * output directory's file system. New directory entries are
+ * made durable by fsync()ing their directories at the end. */
+
+enum writerjob_state {
+    JOB_FREE = 0,
+    JOB_OPEN,
+    JOB_WRITE,
+    JOB_FSYNC,
+    JOB_CLOSE
+};
+
+struct WriterJob {
+    enum writerjob_state state;
+    char path[PATH_MAX];
+    xmlChar* content; /*< Own copy of the file’s content */
+    size_t size;
+    size_t done;      /*< Bytes written so far */
+    int fd;
+};
+
+/**
+ * State of the asynchronous writer.
+ */
+struct Writer {
+    struct WriterJob* p_jobs; /*< `writedepth` slots */
+    int num_inflight;
+    int num_written;
+    size_t bytes_written;
+#ifdef HTMLSPLIT_HAVE_IO_URING
+    int ringfd;
+    void* p_sqring;
+    size_t sqring_size;
+    void* p_cqring;
+    size_t cqring_size;
+    struct io_uring_sqe* p_sqes;
+    size_t sqes_size;
+    unsigned* p_sq_tail;
+    unsigned* p_sq_mask;
+    unsigned* p_sq_array;
+    unsigned* p_cq_head;
+    unsigned* p_cq_tail;
+    unsigned* p_cq_mask;
+    struct io_uring_cqe* p_cqes;
+    unsigned to_submit;
+#endif
+};
+
+static void write_blocking(struct Splitter* p_splitter, const char* path, const xmlChar* content, size_t size);
+static void sync_outdir(struct Splitter* p_splitter);
+static void sync_directories(struct Splitter* p_splitter);
+static void note_directory(struct Splitter* p_splitter, const char* path);
+#ifdef HTMLSPLIT_HAVE_IO_URING
+static struct Writer* get_writer(struct Splitter* p_splitter);
+static bool setup_ring(struct Writer* p_writer, int depth);
+static struct io_uring_sqe* queue_sqe(struct Writer* p_writer, int job);
+static void queue_next(struct Splitter* p_splitter, int job);
+static void enter_ring(struct Writer* p_writer, bool wait);
+static void reap_completions(struct Splitter* p_splitter, bool wait);
+#endif
+
+/**
+ * Parse the argument to the --durability option, which may
+ * be "none", "fsync", or "syncfs". Returns false if the mode
+ * is not understood.
+ */
+bool splitter_parse_durability(struct Splitter* p_splitter, const char* mode)
+{
+    if (strcmp(mode, "none") == 0)
+        p_splitter->durability = DURABILITY_NONE;
+    else if (strcmp(mode, "fsync") == 0)
+        p_splitter->durability = DURABILITY_FSYNC;
+    else if (strcmp(mode, "syncfs") == 0)
+        p_splitter->durability = DURABILITY_SYNCFS;
+    else
+        return false;
+
+    return true;
+}
+
+/**
+ * Write `size` bytes of `content` to the file `path`. If
+ * asynchronous writing was requested, the content is copied
+ * and the function returns before the file is written; errors
+ * are reported (and terminate the program) later then.
+ */
+void splitter_write_file(struct Splitter* p_splitter, const char* path, const xmlChar* content, size_t size)
+{
+#ifdef HTMLSPLIT_HAVE_IO_URING
+    struct Writer* p_writer = get_writer(p_splitter);
+    struct WriterJob* p_job = NULL;
+    int job = 0;
+#endif
+
+    /* The file may be a hard link made by --dedup link, which
+     * must not be truncated, as that would change all its names.
+     * Other modes keep the existing file (and its permissions
+     * and links) and save the extra system call. */
+    if (p_splitter->dedupmode == DEDUP_LINK)
+        unlink(path);
+
+    if (p_splitter->durability == DURABILITY_FSYNC)
+        note_directory(p_splitter, path);
+
+#ifdef HTMLSPLIT_HAVE_IO_URING
+    if (!p_writer) {
+        write_blocking(p_splitter, path, content, size);
+        return;
+    }
+
+    /* Pick up what is done already, and wait for a free slot
+     * if there is none. Under memory pressure, let all pending
+     * files be written before queueing another copy. */
+    reap_completions(p_splitter, false);
+    while (p_writer->num_inflight == p_splitter->writedepth
+           || (p_writer->num_inflight > 0 && governor_pressure() >= GOV_PRESSURE_HIGH))
+        reap_completions(p_splitter, true);
+
+    while (p_writer->p_jobs[job].state != JOB_FREE)
+        job++;
+
+    p_job = &p_writer->p_jobs[job];
+    p_job->content = (xmlChar*) xmlMalloc(size > 0 ? size : 1);
+    if (!p_job->content) {
+        perror("Failed to allocate memory for output file");
+        exit(ERR_MEM);
+    }
+
+    memcpy(p_job->content, content, size);
+    strcpy(p_job->path, path);
+    p_job->size  = size;
+    p_job->done  = 0;
+    p_job->fd    = -1;
+    p_job->state = JOB_FREE;
+    p_writer->num_inflight++;
+
+    queue_next(p_splitter, job);
+    enter_ring(p_writer, false);
+#else
+    write_blocking(p_splitter, path, content, size);
+#endif
+}
+
+/**
+ * Close `p_file`, which was written to `path` through stdio,
+ * applying the durability mode. Exits with ERR_IO if the
+ * file could not be written completely.
+ */
+void splitter_close_file(struct Splitter* p_splitter, FILE* p_file, const char* path)
+{
+    bool ok = fflush(p_file) == 0;
+
+    if (ok && p_splitter->durability != DURABILITY_NONE) {
+        ok = fsync(fileno(p_file)) == 0;
+        note_directory(p_splitter, path);
+    }
+
+    if (!ok || fclose(p_file) != 0) {
+        int errsav = errno;
+        fprintf(stderr, "Failed to write file '%s': %s\n", path, strerror(errsav));
+        exit(ERR_IO);
+    }
+}
+
+/**
+ * Note that the directory `path` was created, so that the
+ * directory containing it is synced with --durability fsync.
+ */
+void splitter_sync_directory(struct Splitter* p_splitter, const char* path)
+{
+    if (p_splitter->durability == DURABILITY_FSYNC)
+        note_directory(p_splitter, path);
+}
+
+/**
+ * If the file `path` is still being written asynchronously,
+ * return the content queued for it and store its size in
+ * `p_size`. Returns NULL if no write to `path` is pending,
+ * i.e. the file on disk is complete. The content is only
+ * valid until the next call into the writer.
+ */
+const xmlChar* splitter_pending_content(struct Splitter* p_splitter, const char* path, size_t* p_size)
+{
+#ifdef HTMLSPLIT_HAVE_IO_URING
+    struct Writer* p_writer = p_splitter->p_writer;
+    int i = 0;
+
+    for(i=0; p_writer && p_writer->num_inflight > 0 && i < p_splitter->writedepth; i++) {
+        struct WriterJob* p_job = &p_writer->p_jobs[i];
+
+        if (p_job->state != JOB_FREE && strcmp(p_job->path, path) == 0) {
+            *p_size = p_job->size;
+            return p_job->content;
+        }
+    }
+#endif
+
+    return NULL;
+}
+
+/**
+ * Wait until all files passed to splitter_write_file()
+ * have been written.
+ */
+void splitter_flush_writer(struct Splitter* p_splitter)
+{
+#ifdef HTMLSPLIT_HAVE_IO_URING
+    struct Writer* p_writer = p_splitter->p_writer;
+
+    while (p_writer && p_writer->num_inflight > 0)
+        reap_completions(p_splitter, true);
+#endif
+}
+
+/**
+ * Finish all pending writes, apply the end-of-run durability
+ * mode, and free the writer.
+ */
+void splitter_free_writer(struct Splitter* p_splitter)
+{
+    struct Writer* p_writer = p_splitter->p_writer;
+
+    splitter_flush_writer(p_splitter);
+
+    if (p_splitter->durability == DURABILITY_SYNCFS)
+        sync_outdir(p_splitter);
+
+    sync_directories(p_splitter);
+
+    if (!p_writer)
+        return;
+
+    verbprintf("Wrote %d files with %lu bytes asynchronously.\n", p_writer->num_written, (unsigned long) p_writer->bytes_written);
+
+#ifdef HTMLSPLIT_HAVE_IO_URING
+    munmap(p_writer->p_sqes, p_writer->sqes_size);
+    munmap(p_writer->p_cqring, p_writer->cqring_size);
+    munmap(p_writer->p_sqring, p_writer->sqring_size);
+    close(p_writer->ringfd);
+#endif
+
+    xmlFree(p_writer->p_jobs);
+    xmlFree(p_writer);
+    p_splitter->p_writer = NULL;
+}
+
+void write_blocking(struct Splitter* p_splitter, const char* path, const xmlChar* content, size_t size)
+{
+    size_t done = 0;
+    int fd = -1;
+
+    TRACE_BEGIN("write-file", -1);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (fd < 0) {
+        int errsav = errno;
+        fprintf(stderr, "Failed to open file '%s': %s\n", path, strerror(errsav));
+        exit(ERR_IO);
+    }
+
+    while (done < size) {
+        ssize_t written = write(fd, content + done, size - done);
+
+        if (written < 0 && errno != EINTR) {
+            int errsav = errno;
+            fprintf(stderr, "Failed to write file '%s': %s\n", path, strerror(errsav));
+            exit(ERR_IO);
+        }
+
+        if (written > 0)
+            done += written;
+    }
+
+    if ((p_splitter->durability == DURABILITY_FSYNC && fsync(fd) != 0) || close(fd) != 0) {
+        int errsav = errno;
+        fprintf(stderr, "Failed to write file '%s': %s\n", path, strerror(errsav));
+        exit(ERR_IO);
+    }
+    TRACE_END("write-file", -1);
+}
+
+/* One syncfs() covers the parts as well as the ToC, assets,
+ * and search index, which all live on the same file system. */
+void sync_outdir(struct Splitter* p_splitter)
+{
+    int fd = -1;
+
+    if (strlen(p_splitter->outdir) == 0)
+        return;
+
+    verbprintf("Syncing the file system of '%s'.\n", p_splitter->outdir);
+
+    fd = open(p_splitter->outdir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || syncfs(fd) != 0) {
+        int errsav = errno;
+        fprintf(stderr, "Failed to sync '%s': %s\n", p_splitter->outdir, strerror(errsav));
+        exit(ERR_IO);
+    }
+
+    close(fd);
+}
+
+/* fsync() all directories noted, which makes the entries
+ * of new files and directories in them durable. */
+void sync_directories(struct Splitter* p_splitter)
+{
+    int i = 0;
+
+    if (p_splitter->num_syncdirs > 0)
+        verbprintf("Syncing %d directories.\n", p_splitter->num_syncdirs);
+
+    for(i=0; i < p_splitter->num_syncdirs; i++) {
+        const char* dir = p_splitter->pp_syncdirs[i];
+        int fd = open(dir, O_RDONLY | O_DIRECTORY);
+
+        if (fd < 0 || fsync(fd) != 0) {
+            int errsav = errno;
+            fprintf(stderr, "Failed to sync directory '%s': %s\n", dir, strerror(errsav));
+            exit(ERR_IO);
+        }
+
+        close(fd);
+        xmlFree(p_splitter->pp_syncdirs[i]);
+    }
+
+    xmlFree(p_splitter->pp_syncdirs);
+    p_splitter->pp_syncdirs  = NULL;
+    p_splitter->num_syncdirs = 0;
+}
+
+/* Add the directory containing `path` to the directories
+ * to sync, unless it is in there already. */
+void note_directory(struct Splitter* p_splitter, const char* path)
+{
+    char dir[PATH_MAX];
+    const char* p_slash = strrchr(path, '/');
+    char** pp_dirs = NULL;
+    int i = 0;
+
+    if (!p_slash)
+        strcpy(dir, ".");
+    else if (p_slash == path)
+        strcpy(dir, "/");
+    else {
+        memcpy(dir, path, p_slash - path);
+        dir[p_slash - path] = '\0';
+    }
+
+    /* Parts mostly go to the directory of the previous one */
+    for(i = p_splitter->num_syncdirs - 1; i >= 0; i--) {
+        if (strcmp(p_splitter->pp_syncdirs[i], dir) == 0)
+            return;
+    }
+
+    pp_dirs = (char**) xmlRealloc(p_splitter->pp_syncdirs, (p_splitter->num_syncdirs + 1) * sizeof(char*));
+    if (!pp_dirs || !(pp_dirs[p_splitter->num_syncdirs] = (char*) xmlStrdup(BAD_CAST(dir)))) {
+        perror("Failed to allocate memory for the directories to sync");
+        exit(ERR_MEM);
+    }
+
+    p_splitter->pp_syncdirs = pp_dirs;
+    p_splitter->num_syncdirs++;
+}
+
+#ifdef HTMLSPLIT_HAVE_IO_URING
+
+/* Returns NULL if files are to be written blocking. */
+struct Writer* get_writer(struct Splitter* p_splitter)
+{
+    struct Writer* p_writer = p_splitter->p_writer;
+
+    if (p_writer || p_splitter->writedepth == 0 || p_splitter->writer_unavailable)
+        return p_writer;
+
+    p_writer = (struct Writer*) xmlMalloc(sizeof(struct Writer));
+    if (!p_writer) {
+        perror("Failed to allocate writer");
+        exit(ERR_MEM);
+    }
+
+    memset(p_writer, '\0', sizeof(struct Writer));
+
+    if (!setup_ring(p_writer, p_splitter->writedepth)) {
+        int errsav = errno;
+        fprintf(stderr, "Warning: io_uring not available (%s), writing files synchronously.\n", strerror(errsav));
+
+        xmlFree(p_writer);
+        p_splitter->writer_unavailable = true;
+        return NULL;
+    }
+
+    p_writer->p_jobs = (struct WriterJob*) xmlMalloc(p_splitter->writedepth * sizeof(struct WriterJob));
+    if (!p_writer->p_jobs) {
+        perror("Failed to allocate writer slots");
+        exit(ERR_MEM);
+    }
+
+    memset(p_writer->p_jobs, '\0', p_splitter->writedepth * sizeof(struct WriterJob));
+
+    verbprintf("Writing files through io_uring with %d files in flight.\n", p_splitter->writedepth);
+
+    p_splitter->p_writer = p_writer;
+    return p_writer;
+}
+
+bool setup_ring(struct Writer* p_writer, int depth)
+{
+    struct io_uring_params params;
+
+    memset(&params, '\0', sizeof(struct io_uring_params));
+
+    p_writer->ringfd = (int) syscall(__NR_io_uring_setup, depth, &params);
+    if (p_writer->ringfd < 0)
+        return false;
+
+    /* The open and close operations appeared in the same
+     * kernel release (5.6) as this feature flag. */
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(p_writer->ringfd);
+        errno = ENOSYS;
+        return false;
+    }
+
+    p_writer->sqring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    p_writer->cqring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    p_writer->sqes_size   = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    p_writer->p_sqring = mmap(NULL, p_writer->sqring_size, PROT_READ | PROT_WRITE, MAP_SHARED, p_writer->ringfd, IORING_OFF_SQ_RING);
+    p_writer->p_cqring = mmap(NULL, p_writer->cqring_size, PROT_READ | PROT_WRITE, MAP_SHARED, p_writer->ringfd, IORING_OFF_CQ_RING);
+    p_writer->p_sqes   = mmap(NULL, p_writer->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, p_writer->ringfd, IORING_OFF_SQES);
+
+    if (p_writer->p_sqring == MAP_FAILED || p_writer->p_cqring == MAP_FAILED || p_writer->p_sqes == MAP_FAILED) {
+        perror("Failed to map io_uring");
+        exit(ERR_MEM);
+    }
+
+    p_writer->p_sq_tail  = (unsigned*) ((char*) p_writer->p_sqring + params.sq_off.tail);
+    p_writer->p_sq_mask  = (unsigned*) ((char*) p_writer->p_sqring + params.sq_off.ring_mask);
+    p_writer->p_sq_array = (unsigned*) ((char*) p_writer->p_sqring + params.sq_off.array);
+    p_writer->p_cq_head  = (unsigned*) ((char*) p_writer->p_cqring + params.cq_off.head);
+    p_writer->p_cq_tail  = (unsigned*) ((char*) p_writer->p_cqring + params.cq_off.tail);
+    p_writer->p_cq_mask  = (unsigned*) ((char*) p_writer->p_cqring + params.cq_off.ring_mask);
+    p_writer->p_cqes     = (struct io_uring_cqe*) ((char*) p_writer->p_cqring + params.cq_off.cqes);
+
+    return true;
+}
+
+/* Every job has at most one operation queued or with the kernel,
+ * and the ring has at least `writedepth` entries, so there is
+ * always room. */
+struct io_uring_sqe* queue_sqe(struct Writer* p_writer, int job)
+{
+    unsigned tail = *p_writer->p_sq_tail;
+    unsigned index = tail & *p_writer->p_sq_mask;
+    struct io_uring_sqe* p_sqe = &p_writer->p_sqes[index];
+
+    memset(p_sqe, '\0', sizeof(struct io_uring_sqe));
+    p_sqe->user_data = job;
+
+    p_writer->p_sq_array[index] = index;
+    __atomic_store_n(p_writer->p_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    p_writer->to_submit++;
+
+    return p_sqe;
+}
+
+/* Advance the job to its next state and queue the operation for it. */
+void queue_next(struct Splitter* p_splitter, int job)
+{
+    struct Writer* p_writer = p_splitter->p_writer;
+    struct WriterJob* p_job = &p_writer->p_jobs[job];
+    struct io_uring_sqe* p_sqe = NULL;
+
+    switch (p_job->state) {
+    case JOB_FREE:
+        p_job->state = JOB_OPEN;
+
+        p_sqe = queue_sqe(p_writer, job);
+        p_sqe->opcode     = IORING_OP_OPENAT;
+        p_sqe->fd         = AT_FDCWD;
+        p_sqe->addr       = (unsigned long) p_job->path;
+        p_sqe->len        = 0666;
+        p_sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        break;
+    case JOB_OPEN:
+    case JOB_WRITE:
+        if (p_job->done < p_job->size) {
+            p_job->state = JOB_WRITE;
+
+            p_sqe = queue_sqe(p_writer, job);
+            p_sqe->opcode = IORING_OP_WRITE;
+            p_sqe->fd     = p_job->fd;
+            p_sqe->addr   = (unsigned long) (p_job->content + p_job->done);
+            p_sqe->len    = (unsigned) (p_job->size - p_job->done > 0x40000000 ? 0x40000000 : p_job->size - p_job->done);
+            p_sqe->off    = p_job->done;
+            break;
+        }
+        else if (p_splitter->durability == DURABILITY_FSYNC) {
+            p_job->state = JOB_FSYNC;
+
+            p_sqe = queue_sqe(p_writer, job);
+            p_sqe->opcode = IORING_OP_FSYNC;
+            p_sqe->fd     = p_job->fd;
+            break;
+        }
+        /* Fall through */
+    case JOB_FSYNC:
+        p_job->state = JOB_CLOSE;
+
+        p_sqe = queue_sqe(p_writer, job);
+        p_sqe->opcode = IORING_OP_CLOSE;
+        p_sqe->fd     = p_job->fd;
+        break;
+    case JOB_CLOSE:
+        p_writer->num_inflight--;
+        p_writer->num_written++;
+        p_writer->bytes_written += p_job->size;
+
+        xmlFree(p_job->content);
+        p_job->content = NULL;
+        p_job->state   = JOB_FREE;
+        break;
+    }
+}
+
+/* Submit all queued operations and, if `wait` is true,
+ * wait for at least one completion. */
+void enter_ring(struct Writer* p_writer, bool wait)
+{
+    while (p_writer->to_submit > 0 || wait) {
+        int ret = (int) syscall(__NR_io_uring_enter, p_writer->ringfd, p_writer->to_submit, wait ? 1 : 0,
+                                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EBUSY) { /* Completion queue full; reap first */
+                wait = true;
+                continue;
+            }
+
+            perror("Failed to submit to io_uring");
+            exit(ERR_IO);
+        }
+
+        p_writer->to_submit -= ret;
+        wait = false;
+    }
+}
+
+void reap_completions(struct Splitter* p_splitter, bool wait)
+{
+    struct Writer* p_writer = p_splitter->p_writer;
+    unsigned head = 0;
+
+    if (wait) {
+        TRACE_BEGIN("writer-wait", -1);
+        enter_ring(p_writer, true);
+        TRACE_END("writer-wait", -1);
+    }
+
+    head = *p_writer->p_cq_head;
+
+    while (head != __atomic_load_n(p_writer->p_cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* p_cqe = &p_writer->p_cqes[head & *p_writer->p_cq_mask];
+        struct WriterJob* p_job = &p_writer->p_jobs[p_cqe->user_data];
+
+        if (p_cqe->res < 0) {
+            fprintf(stderr, "Failed to %s file '%s': %s\n",
+                    p_job->state == JOB_OPEN ? "open" : "write", p_job->path, strerror(-p_cqe->res));
+            exit(ERR_IO);
+        }
+
+        if (p_job->state == JOB_OPEN)
+            p_job->fd = p_cqe->res;
+        else if (p_job->state == JOB_WRITE)
+            p_job->done += p_cqe->res;
+
+        queue_next(p_splitter, (int) p_cqe->user_data);
+
+        head++;
+        __atomic_store_n(p_writer->p_cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    enter_ring(p_writer, false);
+}
+
+#endif /* HTMLSPLIT_HAVE_IO_URING */
@@ -0,0 +1,23 @@
+#ifndef HTMLSPLIT_WRITER_H
+#define HTMLSPLIT_WRITER_H
+
+/**
+ * How hard to try to get the output onto stable storage
+ * before exiting.
+ */
+enum durability {
+    DURABILITY_NONE = 0, /*< Leave it to the kernel */
+    DURABILITY_FSYNC,    /*< fsync() each file after writing it */
+    DURABILITY_SYNCFS    /*< One syncfs() on the output directory at the end */
+};
+
+bool splitter_parse_durability(struct Splitter* p_splitter, const char* mode);
+
+void splitter_write_file(struct Splitter* p_splitter, const char* path, const xmlChar* content, size_t size); /*< \private */
+void splitter_close_file(struct Splitter* p_splitter, FILE* p_file, const char* path); /*< \private */
+void splitter_sync_directory(struct Splitter* p_splitter, const char* path); /*< \private */
+const xmlChar* splitter_pending_content(struct Splitter* p_splitter, const char* path, size_t* p_size); /*< \private */
+void splitter_flush_writer(struct Splitter* p_splitter); /*< \private */
+void splitter_free_writer(struct Splitter* p_splitter); /*< \private */
+
+#endif